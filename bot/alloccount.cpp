@@ -0,0 +1,254 @@
+// Heap allocations on the server's hot path.
+//
+// Runs the server in-process with a counting operator new, connects a
+// channel's worth of clients and, once everything is warm, drives each of
+// the PRIVMSG, NOTICE and JOIN paths in turn while counting the
+// allocations made on the shard's thread. Reply lines come from the
+// buffer pools and scratch space from the shard's arena, so the count
+// should be zero for every path; the exit status is 1 if it is not.
+//
+// Build:  g++ -std=c++17 -O2 -pthread -Iserver -o alloccount bot/alloccount.cpp $(ls server/*.cpp | grep -v main.cpp) -lssl -lcrypto
+// Run:    ./alloccount [--clients N] [--rounds N] [--port P] [--trace]
+//
+// --trace prints a backtrace for the first few allocations counted; build
+// with -g -rdynamic to get names in it. One shard is used: lines posted to
+// another shard allocate an inbox node each, and that is not counted as
+// the hot path. Liveness timers are off, as a timer run gives back the
+// storage of an empty send queue, which the next line takes again.
+
+#include "IRCServer.h"
+#include "Shard.h"
+#include <arpa/inet.h>
+#include <execinfo.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TRACE_LIMIT 5              // Backtraces printed with --trace
+
+static std::atomic<bool> counting(false);
+static std::atomic<size_t> allocations(0);
+static bool trace = false;
+static thread_local bool in_trace = false;
+
+static void* countedAlloc(size_t size) {
+    if (counting.load(std::memory_order_relaxed) && Shard::current() && !in_trace) {
+        size_t n = allocations.fetch_add(1, std::memory_order_relaxed);
+        if (trace && n < TRACE_LIMIT) {
+            in_trace = true;
+            void* frames[32];
+            int depth = backtrace(frames, 32);
+            fprintf(stderr, "allocation of %zu bytes:\n", size);
+            backtrace_symbols_fd(frames, depth, STDERR_FILENO);
+            in_trace = false;
+        }
+    }
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try { return countedAlloc(size); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try { return countedAlloc(size); } catch (...) { return nullptr; }
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+struct Options {
+    int port = 6699;
+    int clients = 50;
+    int rounds = 200;
+};
+
+static Options opts;
+static std::vector<int> fds;
+static unsigned long marks = 0;
+
+static void sendLine(int fd, const std::string& line) {
+    std::string data = line + "\r\n";
+    if (send(fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size())) {
+        perror("send");
+        exit(2);
+    }
+}
+
+// Read from fd until text has arrived
+static void waitFor(int fd, const std::string& text) {
+    std::string seen;
+    char buf[65536];
+    while (seen.find(text) == std::string::npos) {
+        ssize_t n = recv(fd, buf, sizeof buf, 0);
+        if (n <= 0) {
+            fprintf(stderr, "Connection closed while waiting for %s\n", text.c_str());
+            exit(2);
+        }
+        seen.append(buf, n);
+        // Keep only enough to match across reads
+        if (seen.size() > text.size() * 2 + sizeof buf) {
+            seen.erase(0, seen.size() - text.size());
+        }
+    }
+}
+
+// Throw away whatever has arrived, so no send queue grows
+static void drainAll() {
+    char buf[65536];
+    for (int fd : fds) {
+        while (recv(fd, buf, sizeof buf, MSG_DONTWAIT) > 0) {
+        }
+    }
+}
+
+// The server handles a client's lines in order, so once the PONG for a
+// mark is back everything sent before it has been handled
+static void sync(int fd) {
+    std::string mark = "mark" + std::to_string(++marks);
+    sendLine(fd, "PING :" + mark);
+    waitFor(fd, mark);
+}
+
+struct Path {
+    const char* name;
+    void (*step)(int round);
+};
+
+static std::string nick(int i) {
+    return "c" + std::to_string(i);
+}
+
+static const Path paths[] = {
+    {"PRIVMSG #channel", [](int round) {
+        sendLine(fds[round % fds.size()], "PRIVMSG #bench :hello everyone, round " + std::to_string(round));
+    }},
+    {"PRIVMSG nick", [](int round) {
+        sendLine(fds[round % fds.size()], "PRIVMSG " + nick((round + 1) % fds.size()) + " :hello you");
+    }},
+    {"PRIVMSG list", [](int round) {
+        sendLine(fds[round % fds.size()], "PRIVMSG #bench," + nick((round + 1) % fds.size()) + " :hello both");
+    }},
+    {"NOTICE #channel", [](int round) {
+        sendLine(fds[round % fds.size()], "NOTICE #bench :notice, round " + std::to_string(round));
+    }},
+    {"NOTICE nick", [](int round) {
+        sendLine(fds[round % fds.size()], "NOTICE " + nick((round + 1) % fds.size()) + " :psst");
+    }},
+    {"JOIN", [](int round) {
+        int fd = fds[round % fds.size()];
+        sendLine(fd, "PART #bench");
+        sendLine(fd, "JOIN #bench");
+    }},
+};
+
+static size_t run(const Path& path, int rounds) {
+    size_t before = allocations.load();
+    for (int round = 0; round < rounds; ++round) {
+        path.step(round);
+        sync(fds[round % fds.size()]);
+        drainAll();
+    }
+    return allocations.load() - before;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [--clients N] [--rounds N] [--port P] [--trace]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"clients", required_argument, 0, 'c'},
+        {"rounds", required_argument, 0, 'r'},
+        {"port", required_argument, 0, 'p'},
+        {"trace", no_argument, 0, 't'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:r:p:th", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c': opts.clients = atoi(optarg); break;
+        case 'r': opts.rounds = atoi(optarg); break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 't': trace = true; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (opts.clients < 2 || opts.rounds < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    ServerConfig config;
+    config.port = opts.port;
+    config.flood_rate = 0;
+    config.max_per_ip = 0;
+    config.ping_interval = 0;
+    config.registration_timeout = 0;
+    // Runs until the process exits
+    IRCServer* server = new IRCServer(config);
+    std::thread([server]() { server->start(); }).detach();
+
+    for (int i = 0; i < opts.clients; ++i) {
+        int fd = -1;
+        struct sockaddr_in6 addr = {};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(opts.port);
+        addr.sin6_addr = in6addr_loopback;
+        // The listener may not be up yet
+        for (int attempt = 0; attempt < 50; ++attempt) {
+            fd = socket(AF_INET6, SOCK_STREAM, 0);
+            if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) == 0) break;
+            close(fd);
+            fd = -1;
+            usleep(100000);
+        }
+        if (fd < 0) {
+            perror("connect");
+            return 2;
+        }
+        fds.push_back(fd);
+        sendLine(fd, "NICK " + nick(i));
+        sendLine(fd, "USER bench 0 * :bench");
+        sendLine(fd, "JOIN #bench");
+        waitFor(fd, " 366 ");
+        drainAll();
+    }
+
+    // Fill the pools, and grow the queues and tables to their working
+    // size: every client takes each path at least once, and the channel's
+    // history ring fills up (until then each line it keeps takes a block
+    // the pool does not get back)
+    for (const Path& path : paths) {
+        run(path, HISTORY_LINES + opts.clients);
+    }
+
+    counting = true;
+    size_t total = 0;
+    printf("%d clients in one channel, %d rounds per path\n", opts.clients, opts.rounds);
+    for (const Path& path : paths) {
+        size_t count = run(path, opts.rounds);
+        printf("  %-18s %8zu allocations\n", path.name, count);
+        total += count;
+    }
+    counting = false;
+    printf("%s\n", total == 0 ? "ok" : "FAIL: the hot path allocated");
+    fflush(stdout);
+    // The server thread never returns; skip static destructors racing it
+    _exit(total == 0 ? 0 : 1);
+}
@@ -0,0 +1,103 @@
+# Delivery latency against channel size, serial and parallel fan-out.
+#
+# For each channel size, starts the server once per mode, puts that many
+# loadgen clients in a single channel and has them talk in it at a low
+# rate, so every line is one broadcast to the whole channel. Reported per
+# run: how long the sender's thread spent on each PRIVMSG (the stall
+# everything else on that shard waits out, from the metrics socket) and
+# loadgen's end-to-end delivery latency over all recipients.
+#
+# Serial is the default server; parallel adds --fanout-workers W
+# --fanout-threshold 1 so every broadcast goes through the pool. --modes
+# serial sweeps channel size with the pool off, which is the cost of the
+# shared-buffer broadcast on its own:
+#   python3 bot/fanoutbench.py --modes serial --sizes 10,100,1000,5000 --threads 1
+#
+# Build loadgen first (see bot/loadgen.cpp), then:
+#   python3 bot/fanoutbench.py --server ./server/myserver --loadgen ./loadgen \
+#       --sizes 1000,5000,10000 --threads 4 --workers 3
+# Each size needs that many file descriptors in both processes.
+
+import argparse
+import json
+import os
+import socket
+import subprocess
+import sys
+import time
+
+
+def scrape(path):
+    sock = socket.socket(socket.AF_UNIX)
+    sock.connect(path)
+    sock.sendall(b"GET /metrics HTTP/1.0\r\n\r\n")
+    data = b""
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    sock.close()
+    values = {}
+    for line in data.decode().splitlines():
+        for key in ("sum", "count"):
+            prefix = 'ircd_command_duration_seconds_%s{command="PRIVMSG"' % key
+            if line.startswith(prefix):
+                values[key] = float(line.split()[-1])
+    return values
+
+
+def run(args, size, parallel):
+    metrics = "/tmp/fanoutbench.%d.sock" % os.getpid()
+    if os.path.exists(metrics):
+        os.unlink(metrics)
+    command = [args.server, "--port", str(args.port), "--threads", str(args.threads),
+               "--flood-rate", "0", "--max-per-ip", "0", "--history-budget", "0",
+               "--metrics-socket", metrics]
+    if parallel:
+        command += ["--fanout-workers", str(args.workers), "--fanout-threshold", "1"]
+    server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        time.sleep(0.5)
+        output = "/tmp/fanoutbench.%d.json" % os.getpid()
+        subprocess.run([args.loadgen, "--port", str(args.port), "--clients", str(size), "--channels", "1",
+                        "--rate", str(args.rate), "--duration", str(args.duration), "--mix", "100,0,0,0",
+                        "--output", output], stdout=subprocess.DEVNULL, check=True)
+        with open(output) as f:
+            result = json.load(f)
+        os.unlink(output)
+        stall = scrape(metrics)
+    finally:
+        server.kill()
+        server.wait()
+    mean_us = stall["sum"] / stall["count"] * 1e6 if stall.get("count") else 0.0
+    latency = result["latency_us"]
+    return mean_us, latency["p50"], latency["p99"], latency["max"]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--server", default="./server/myserver")
+    parser.add_argument("--loadgen", default="./loadgen")
+    parser.add_argument("--port", type=int, default=6670)
+    parser.add_argument("--sizes", default="1000,5000,10000")
+    parser.add_argument("--threads", type=int, default=4, help="server shards")
+    parser.add_argument("--workers", type=int, default=3, help="fan-out workers in parallel mode")
+    parser.add_argument("--rate", type=float, default=5, help="channel lines per second")
+    parser.add_argument("--duration", type=int, default=10)
+    parser.add_argument("--modes", default="serial,parallel")
+    args = parser.parse_args()
+
+    print("%8s  %-8s  %12s  %10s  %10s  %10s" % ("members", "mode", "stall us", "p50 us", "p99 us", "max us"))
+    modes = args.modes.split(",")
+    if any(mode not in ("serial", "parallel") for mode in modes):
+        parser.error("--modes takes serial, parallel or both")
+    for size in [int(s) for s in args.sizes.split(",")]:
+        for mode in modes:
+            stall, p50, p99, worst = run(args, size, mode == "parallel")
+            print("%8d  %-8s  %12.1f  %10d  %10d  %10d" % (size, mode, stall, p50, p99, worst))
+            sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
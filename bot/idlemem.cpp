@@ -0,0 +1,202 @@
+// Resident memory per idle connection.
+//
+// Reads the server's resident set size, opens N connections and registers
+// each of them (NICK/USER, then waits for the end of the MOTD), leaves them
+// idle for a moment and reads the resident size again. The growth divided
+// by N is what an idle registered client costs the server, kernel socket
+// buffers aside, and is checked against --budget: the exit status is 1 if
+// it is over.
+//
+// Build:  g++ -std=c++17 -O2 -o idlemem bot/idlemem.cpp
+// Run:    ./idlemem --pid $(pidof myserver) --clients 100000 --budget 1024
+//
+// 100k connections need `ulimit -n` above that for both processes, and
+// more than one source address, as each gives about 28k ephemeral ports.
+// The server listens on IPv6, so add a few to the loopback first:
+//   for i in 2 3 4 5; do ip -6 addr add fd00::$i/128 dev lo; done
+//   ./idlemem --pid ... --clients 100000 --sources fd00::2,fd00::3,fd00::4,fd00::5
+// Start the server with --max-per-ip 0 --flood-rate 0.
+
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define WINDOW 1000                // Registrations in flight at once
+
+struct Options {
+    const char* host = "::1";
+    const char* port = "6667";
+    int pid = 0;
+    int clients = 10000;
+    long budget = 0;               // Bytes per connection; 0 reports only
+    double settle = 2.0;           // Seconds idle before measuring
+    std::vector<std::string> sources;
+};
+
+static Options opts;
+
+static long residentBytes(int pid) {
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/statm", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    long size = 0, resident = -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s --pid PID [--host H] [--port P] [--clients N] [--budget BYTES]\n"
+                    "       [--settle SECONDS] [--sources ADDR,ADDR,...]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"host", required_argument, 0, 'H'},
+        {"port", required_argument, 0, 'p'},
+        {"pid", required_argument, 0, 'P'},
+        {"clients", required_argument, 0, 'c'},
+        {"budget", required_argument, 0, 'b'},
+        {"settle", required_argument, 0, 's'},
+        {"sources", required_argument, 0, 'S'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:P:c:b:s:S:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'H': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 'P': opts.pid = atoi(optarg); break;
+        case 'c': opts.clients = atoi(optarg); break;
+        case 'b': opts.budget = atol(optarg); break;
+        case 's': opts.settle = atof(optarg); break;
+        case 'S': {
+            std::string list = optarg;
+            size_t pos = 0;
+            while (pos <= list.size()) {
+                size_t comma = list.find(',', pos);
+                if (comma == std::string::npos) comma = list.size();
+                if (comma > pos) opts.sources.push_back(list.substr(pos, comma - pos));
+                pos = comma + 1;
+            }
+            break;
+        }
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (opts.pid <= 0 || opts.clients <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct addrinfo hints = {}, *server;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(opts.host, opts.port, &hints, &server) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", opts.host);
+        return 2;
+    }
+
+    long before = residentBytes(opts.pid);
+    if (before < 0) {
+        fprintf(stderr, "Cannot read the resident size of pid %d\n", opts.pid);
+        return 2;
+    }
+
+    int ep = epoll_create1(0);
+    std::vector<int> fds(opts.clients, -1);
+    std::vector<std::string> pending(opts.clients);   // Input until registered
+    int in_flight = 0, done = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    // Wait for replies until at most `limit` registrations are in flight
+    auto drain = [&](int limit) {
+        struct epoll_event events[256];
+        char buf[4096];
+        while (in_flight > limit) {
+            int n = epoll_wait(ep, events, 256, 10000);
+            if (n <= 0) {
+                fprintf(stderr, "No progress with %d registrations in flight\n", in_flight);
+                exit(2);
+            }
+            for (int i = 0; i < n; ++i) {
+                int index = static_cast<int>(events[i].data.u32);
+                ssize_t got = recv(fds[index], buf, sizeof buf, 0);
+                if (got <= 0) {
+                    fprintf(stderr, "Connection %d closed during registration\n", index);
+                    exit(2);
+                }
+                pending[index].append(buf, got);
+                if (pending[index].find(" 376 ") != std::string::npos
+                    || pending[index].find(" 422 ") != std::string::npos) {
+                    std::string().swap(pending[index]);
+                    epoll_ctl(ep, EPOLL_CTL_DEL, fds[index], NULL);
+                    --in_flight;
+                    ++done;
+                }
+            }
+        }
+    };
+
+    for (int i = 0; i < opts.clients; ++i) {
+        int fd = socket(server->ai_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("socket");
+            return 2;
+        }
+        if (!opts.sources.empty()) {
+            struct addrinfo* source;
+            if (getaddrinfo(opts.sources[i % opts.sources.size()].c_str(), NULL, &hints, &source) != 0
+                || bind(fd, source->ai_addr, source->ai_addrlen) < 0) {
+                perror("bind");
+                return 2;
+            }
+            freeaddrinfo(source);
+        }
+        if (connect(fd, server->ai_addr, server->ai_addrlen) < 0) {
+            perror("connect");
+            return 2;
+        }
+        fds[i] = fd;
+        std::string hello = "NICK i" + std::to_string(i) + "\r\nUSER idle 0 * :idle\r\n";
+        if (send(fd, hello.data(), hello.size(), 0) != static_cast<ssize_t>(hello.size())) {
+            perror("send");
+            return 2;
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u32 = static_cast<uint32_t>(i);
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        if (++in_flight >= WINDOW) drain(WINDOW / 2);
+    }
+    drain(0);
+    double setup = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(opts.settle));
+    long after = residentBytes(opts.pid);
+    double per_client = static_cast<double>(after - before) / done;
+
+    printf("%d idle registered connections in %.1fs\n", done, setup);
+    printf("  server resident  %ld -> %ld bytes\n", before, after);
+    printf("  per connection   %.0f bytes", per_client);
+    if (opts.budget > 0) {
+        printf("  (budget %ld: %s)", opts.budget, per_client <= opts.budget ? "ok" : "OVER");
+    }
+    printf("\n");
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    freeaddrinfo(server);
+    return opts.budget > 0 && per_client > opts.budget ? 1 : 0;
+}
@@ -0,0 +1,766 @@
+// Load generator for the IRC server.
+//
+// Opens many registered clients (NICK/USER/JOIN), then drives an open-loop
+// mix of channel PRIVMSG, direct PRIVMSG, NOTICE and PART/JOIN churn at a
+// fixed total rate. Every message carries its send time, so each delivery
+// seen by a receiving client yields an end-to-end latency sample.
+//
+// Build:  g++ -std=c++17 -O2 -pthread -o loadgen bot/loadgen.cpp -lssl -lcrypto
+// Run:    ./loadgen --clients 20000 --channels 50 --rate 50000 --duration 30
+//
+// With --storm there is no message traffic. Once every client is in, all
+// of them disconnect together and immediately reconnect, as after a
+// netsplit or restart, and the time until all are registered and joined
+// again is reported as the storm recovery time:
+//   ./loadgen --clients 20000 --storm
+//
+// --tls connects with TLS (the server's certificate is not checked, so a
+// self-signed one will do). In a storm each client reconnects with the
+// session it was given, as a real client would; --no-resume forces full
+// handshakes, so the two runs show what resumption saves:
+//   ./loadgen --clients 5000 --storm --tls --port 6697 [--no-resume]
+//
+// --targets N puts each client in N channels and makes its channel
+// traffic address all of them in one PRIVMSG #a,#b,... line; --split sends
+// the same traffic as N single-target lines instead, for comparison:
+//   ./loadgen --clients 2000 --channels 50 --targets 8 --rate 2000 [--split]
+//
+// --mix 0,100,0,0 sends direct PRIVMSGs only, so every line is one
+// nickname lookup and one delivery. Raise --rate until delivered/s stops
+// following it to find the server's direct-message capacity:
+//   ./loadgen --clients 10000 --mix 0,100,0,0 --rate 60000
+// All clients connect from one address to one port, which caps a run at
+// the ephemeral port range (about 28k) whatever `ulimit -n` allows.
+//
+// --port takes a comma-separated list to spread the clients round-robin
+// over several linked servers, e.g. --port 6667,6668,6669, so the same
+// workload can be compared across network sizes.
+//
+// Results are printed and written as JSON (--output) so runs against
+// different server versions can be compared. All clients come from one
+// address at rates far above a human's, so start the server with
+// --max-per-ip 0 --flood-rate 0.
+
+#include <algorithm>
+#include <climits>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <random>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define MAX_INFLIGHT_CONNECTS 256  // Per worker, while setting up
+#define OUTBUF_LIMIT (64 * 1024)   // Skip a sender whose socket is backed up
+#define DRAIN_SECONDS 2            // Collect late deliveries after the run
+
+struct Options {
+    std::string host = "::1";
+    std::string port = "6667";     // One port, or several separated by commas
+    int clients = 1000;
+    int channels = 10;
+    int threads = 4;
+    double rate = 10000;           // Messages per second, all workers together
+    int duration = 10;             // Seconds of traffic after setup
+    int mix[4] = {70, 20, 5, 5};   // channel, direct, notice, churn weights
+    std::string output = "loadgen.json";
+    bool storm = false;            // Measure reconnect-storm recovery instead
+    bool tls = false;
+    bool resume = true;            // Reconnect with the previous TLS session
+    int targets = 1;               // Channels per client, all addressed by each channel message
+    bool split = false;            // One line per target instead of a target list
+};
+
+enum Op { OP_CHANNEL, OP_DIRECT, OP_NOTICE, OP_CHURN, OP_COUNT };
+static const char* op_names[OP_COUNT] = {"channel_privmsg", "direct_privmsg", "notice", "churn"};
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// Log-linear histogram of microsecond latencies: 32 sub-buckets per power
+// of two, so every recorded value is within about 3% of its bucket.
+#define SUB_BUCKETS 32
+#define SUB_BITS 5
+#define HIST_BUCKETS (SUB_BUCKETS + 59 * SUB_BUCKETS)
+
+struct Histogram {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(HIST_BUCKETS);
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    static int bucketOf(uint64_t v) {
+        if (v < SUB_BUCKETS) return static_cast<int>(v);
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - SUB_BITS;
+        return SUB_BUCKETS + shift * SUB_BUCKETS + static_cast<int>((v >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t valueOf(int bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+        uint64_t sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+        return (SUB_BUCKETS + sub) << shift;
+    }
+
+    void record(uint64_t v) {
+        ++counts[bucketOf(v)];
+        ++total;
+        max = std::max(max, v);
+    }
+
+    void merge(const Histogram& other) {
+        for (int i = 0; i < HIST_BUCKETS; ++i) counts[i] += other.counts[i];
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * total);
+        if (rank >= total) rank = total - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen > rank) return std::min(valueOf(i), max);
+        }
+        return max;
+    }
+};
+
+struct Conn {
+    int fd = -1;
+    int index;                     // Global client number; nick is lg<index>
+    std::string out;               // Bytes not yet accepted by the socket
+    std::string in;                // Partial line carried between reads
+    bool connected = false;
+    bool joined = false;           // Saw the end of NAMES for all its channels
+    int names_seen = 0;
+    SSL* ssl = nullptr;
+    bool handshaking = false;
+    SSL_SESSION* session = nullptr;    // Offered on the next connect
+};
+
+struct Stats {
+    uint64_t sent[OP_COUNT] = {};
+    uint64_t delivered = 0;
+    uint64_t bytes_out = 0;
+    uint64_t bytes_in = 0;
+    uint64_t connect_failures = 0;
+    uint64_t disconnects = 0;
+    uint64_t skipped_backpressure = 0;
+    uint64_t handshakes = 0;
+    uint64_t resumed = 0;
+    Histogram latency_us;
+};
+
+static Options opts;
+static std::atomic<int> joined_total(0);
+static std::atomic<int> failed_total(0);
+static std::atomic<bool> storm_go(false);
+static std::atomic<bool> sending(false);
+static std::atomic<bool> stopping(false);
+static std::vector<struct addrinfo*> server_addrs;   // Clients take turns
+static SSL_CTX* tls_ctx = nullptr;
+
+class Worker {
+public:
+    Stats stats;
+
+    Worker(int id, int first, int count) : rng(id * 7919 + 1) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        for (int i = 0; i < count; ++i) {
+            conns.emplace_back();
+            conns.back().index = first + i;
+        }
+    }
+
+    ~Worker() {
+        for (Conn& c : conns) {
+            if (c.fd >= 0) close(c.fd);
+            SSL_free(c.ssl);
+            SSL_SESSION_free(c.session);
+        }
+        close(epfd);
+    }
+
+    void run() {
+        setup(MAX_INFLIGHT_CONNECTS);
+        if (opts.storm) {
+            while (!storm_go.load()) {
+                poll(1);
+            }
+            // Everyone drops at once, then everyone reconnects at once.
+            // Fresh nicks, since the server may not have reaped the old ones.
+            dropAll();
+            prefix = "ls";
+            setup(INT_MAX);
+            return;
+        }
+
+        while (!sending.load()) {
+            poll(1);
+        }
+
+        uint64_t start = nowNs();
+        double worker_rate = opts.rate / opts.threads;
+        uint64_t issued = 0;
+        while (!stopping.load()) {
+            // Open loop: issue whatever the schedule says is due by now
+            double due = (nowNs() - start) / 1e9 * worker_rate;
+            while (issued < due) {
+                sendOne();
+                ++issued;
+            }
+            flushAll();
+            poll(1);
+        }
+
+        uint64_t drain_until = nowNs() + DRAIN_SECONDS * 1000000000ull;
+        while (nowNs() < drain_until) {
+            poll(10);
+        }
+    }
+
+private:
+    int epfd;
+    std::vector<Conn> conns;
+    std::mt19937 rng;
+    const char* prefix = "lg";     // Nick prefix
+    int joined = 0;
+    int failed = 0;
+    size_t next_connect = 0;
+    int inflight = 0;
+
+    void setup(int max_inflight) {
+        while (joined + failed < static_cast<int>(conns.size())) {
+            while (inflight < max_inflight && next_connect < conns.size()) {
+                startConnect(conns[next_connect++]);
+            }
+            poll(10);
+        }
+    }
+
+    void connectFailed() {
+        ++stats.connect_failures;
+        ++failed;
+        failed_total.fetch_add(1);
+    }
+
+    void dropAll() {
+        for (Conn& c : conns) {
+            if (c.ssl) {
+                // A session freed without close_notify cannot be resumed
+                SSL_shutdown(c.ssl);
+                // Holds the tickets the server sent after the handshake
+                if (opts.resume) {
+                    SSL_SESSION_free(c.session);
+                    c.session = SSL_get1_session(c.ssl);
+                }
+                SSL_free(c.ssl);
+                c.ssl = nullptr;
+            }
+            if (c.fd >= 0) close(c.fd);
+            c.fd = -1;
+            c.out.clear();
+            c.in.clear();
+            c.connected = false;
+            c.joined = false;
+            c.names_seen = 0;
+        }
+        joined = failed = 0;
+        next_connect = 0;
+        inflight = 0;
+    }
+
+    void startConnect(Conn& c) {
+        const struct addrinfo* server_addr = server_addrs[c.index % server_addrs.size()];
+        c.fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c.fd < 0) {
+            perror("socket");
+            connectFailed();
+            return;
+        }
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        if (connect(c.fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            perror("connect");
+            close(c.fd);
+            c.fd = -1;
+            connectFailed();
+            return;
+        }
+
+        char reg[128];
+        snprintf(reg, sizeof reg, "NICK %s%d\r\nUSER lg%d lg lg :load\r\n", prefix, c.index, c.index);
+        c.out += reg;
+        c.out += "JOIN " + channelsOf(c.index) + "\r\n";
+
+        if (tls_ctx) {
+            // The handshake starts once the connection is writable
+            c.ssl = SSL_new(tls_ctx);
+            SSL_set_fd(c.ssl, c.fd);
+            SSL_set_connect_state(c.ssl);
+            if (c.session) {
+                SSL_set_session(c.ssl, c.session);
+            }
+            c.handshaking = true;
+        }
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+        ++inflight;
+    }
+
+    static std::string channelOf(int index) {
+        return "#lg" + std::to_string(index % opts.channels);
+    }
+
+    // The client's --targets channels, as a comma-separated list
+    static std::string channelsOf(int index) {
+        std::string list = channelOf(index);
+        for (int i = 1; i < opts.targets; ++i) {
+            list += "," + channelOf(index + i);
+        }
+        return list;
+    }
+
+    void sendOne() {
+        std::uniform_int_distribution<size_t> pick(0, conns.size() - 1);
+        Conn& c = conns[pick(rng)];
+        if (c.fd < 0) return;
+        if (c.out.size() > OUTBUF_LIMIT) {
+            ++stats.skipped_backpressure;
+            return;
+        }
+
+        int total_weight = opts.mix[0] + opts.mix[1] + opts.mix[2] + opts.mix[3];
+        int roll = std::uniform_int_distribution<int>(0, total_weight - 1)(rng);
+        int op = 0;
+        while (roll >= opts.mix[op]) {
+            roll -= opts.mix[op];
+            ++op;
+        }
+
+        std::uniform_int_distribution<int> anyone(0, opts.clients - 1);
+        char line[1024];
+        uint64_t t = nowNs();
+        switch (op) {
+        case OP_CHANNEL:
+            if (opts.split) {
+                for (int i = 1; i < opts.targets; ++i) {
+                    snprintf(line, sizeof line, "PRIVMSG %s :T %llu channel traffic\r\n",
+                             channelOf(c.index + i).c_str(), static_cast<unsigned long long>(t));
+                    c.out += line;
+                }
+                snprintf(line, sizeof line, "PRIVMSG %s :T %llu channel traffic\r\n",
+                         channelOf(c.index).c_str(), static_cast<unsigned long long>(t));
+            } else {
+                snprintf(line, sizeof line, "PRIVMSG %s :T %llu channel traffic\r\n",
+                         channelsOf(c.index).c_str(), static_cast<unsigned long long>(t));
+            }
+            break;
+        case OP_DIRECT:
+            snprintf(line, sizeof line, "PRIVMSG lg%d :T %llu direct message\r\n",
+                     anyone(rng), static_cast<unsigned long long>(t));
+            break;
+        case OP_NOTICE:
+            snprintf(line, sizeof line, "NOTICE lg%d :T %llu notice\r\n",
+                     anyone(rng), static_cast<unsigned long long>(t));
+            break;
+        default:
+            // Sent together, so the client is back in before its next message
+            snprintf(line, sizeof line, "PART %s\r\nJOIN %s\r\n",
+                     channelOf(c.index).c_str(), channelOf(c.index).c_str());
+            break;
+        }
+        c.out += line;
+        ++stats.sent[op];
+    }
+
+    void flushAll() {
+        for (Conn& c : conns) {
+            if (c.connected && !c.out.empty()) flush(c);
+        }
+    }
+
+    void flush(Conn& c) {
+        while (!c.out.empty()) {
+            ssize_t n;
+            if (c.ssl) {
+                if (c.handshaking) return;
+                n = SSL_write(c.ssl, c.out.data(), static_cast<int>(std::min(c.out.size(), static_cast<size_t>(INT_MAX))));
+                if (n <= 0) {
+                    int err = SSL_get_error(c.ssl, static_cast<int>(n));
+                    if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) drop(c);
+                    return;
+                }
+            } else {
+                n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN) drop(c);
+                return;
+            }
+            stats.bytes_out += n;
+            c.out.erase(0, n);
+        }
+    }
+
+    void drop(Conn& c) {
+        if (c.fd < 0) return;
+        SSL_free(c.ssl);
+        c.ssl = nullptr;
+        close(c.fd);
+        c.fd = -1;
+        if (c.joined) {
+            ++stats.disconnects;
+        } else {
+            connectFailed();
+            --inflight;
+        }
+    }
+
+    void poll(int timeout_ms) {
+        epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, timeout_ms);
+        for (int i = 0; i < n; ++i) {
+            Conn& c = *static_cast<Conn*>(events[i].data.ptr);
+            if (c.fd < 0) continue;
+            if (c.handshaking && !handshake(c)) continue;
+            if (events[i].events & EPOLLOUT) {
+                c.connected = true;
+                flush(c);
+            }
+            if (c.fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                readFrom(c);
+            }
+        }
+    }
+
+    // Move a TLS handshake along; true once it is done and the connection
+    // can carry lines
+    bool handshake(Conn& c) {
+        int rc = SSL_do_handshake(c.ssl);
+        if (rc == 1) {
+            c.handshaking = false;
+            ++stats.handshakes;
+            if (SSL_session_reused(c.ssl)) ++stats.resumed;
+            return true;
+        }
+        int err = SSL_get_error(c.ssl, rc);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            ERR_clear_error();
+            drop(c);
+        }
+        return false;
+    }
+
+    void readFrom(Conn& c) {
+        char buf[16384];
+        while (true) {
+            ssize_t n;
+            if (c.ssl) {
+                n = SSL_read(c.ssl, buf, sizeof buf);
+                if (n <= 0) {
+                    int err = SSL_get_error(c.ssl, static_cast<int>(n));
+                    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) break;
+                    ERR_clear_error();
+                    drop(c);
+                    return;
+                }
+            } else {
+                n = recv(c.fd, buf, sizeof buf, 0);
+            }
+            if (n > 0) {
+                stats.bytes_in += n;
+                c.in.append(buf, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) break;
+            drop(c);
+            return;
+        }
+
+        size_t start = 0, end;
+        while ((end = c.in.find('\n', start)) != std::string::npos) {
+            handleLine(c, c.in.data() + start, end - start);
+            start = end + 1;
+        }
+        c.in.erase(0, start);
+    }
+
+    void handleLine(Conn& c, const char* line, size_t len) {
+        std::string_view l(line, len);
+        size_t stamp = l.find(" :T ");
+        if (stamp != std::string_view::npos) {
+            uint64_t sent_ns = strtoull(line + stamp + 4, nullptr, 10);
+            uint64_t now = nowNs();
+            if (sent_ns && now > sent_ns) {
+                stats.latency_us.record((now - sent_ns) / 1000);
+            }
+            ++stats.delivered;
+        } else if (l.compare(0, 4, "PING") == 0) {
+            c.out += "PONG";
+            c.out.append(l.substr(4));
+            c.out += "\n";
+            flush(c);
+        } else if (!c.joined && l.find(" 366 ") != std::string_view::npos && ++c.names_seen == opts.targets) {
+            c.joined = true;
+            ++joined;
+            --inflight;
+            joined_total.fetch_add(1);
+        }
+    }
+};
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [--host H] [--port P[,P...]] [--clients N] [--channels N] [--threads N]\n"
+              << "       [--rate MSGS_PER_SEC] [--duration SECS] [--mix CHAN,DIRECT,NOTICE,CHURN] [--output FILE]\n"
+              << "       [--storm] [--tls] [--no-resume] [--targets N] [--split]"
+              << std::endl;
+}
+
+static bool parseMix(const char* arg) {
+    return sscanf(arg, "%d,%d,%d,%d", &opts.mix[0], &opts.mix[1], &opts.mix[2], &opts.mix[3]) == 4 &&
+           opts.mix[0] >= 0 && opts.mix[1] >= 0 && opts.mix[2] >= 0 && opts.mix[3] >= 0 &&
+           opts.mix[0] + opts.mix[1] + opts.mix[2] + opts.mix[3] > 0;
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"clients", required_argument, NULL, 'c'},
+        {"channels", required_argument, NULL, 'C'},
+        {"threads", required_argument, NULL, 't'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"mix", required_argument, NULL, 'm'},
+        {"output", required_argument, NULL, 'o'},
+        {"storm", no_argument, NULL, 's'},
+        {"tls", no_argument, NULL, 'T'},
+        {"no-resume", no_argument, NULL, 'R'},
+        {"targets", required_argument, NULL, 'N'},
+        {"split", no_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:c:C:t:r:d:m:o:sTRN:Sh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'H': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 'c': opts.clients = atoi(optarg); break;
+        case 'C': opts.channels = atoi(optarg); break;
+        case 't': opts.threads = atoi(optarg); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 'd': opts.duration = atoi(optarg); break;
+        case 'm':
+            if (!parseMix(optarg)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o': opts.output = optarg; break;
+        case 's': opts.storm = true; break;
+        case 'T': opts.tls = true; break;
+        case 'R': opts.resume = false; break;
+        case 'N': opts.targets = atoi(optarg); break;
+        case 'S': opts.split = true; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (opts.clients < 1 || opts.channels < 1 || opts.threads < 1 || opts.rate <= 0 || opts.duration < 1 ||
+        opts.targets < 1 || opts.targets > opts.channels) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    opts.threads = std::min(opts.threads, opts.clients);
+
+    // Every client is a descriptor
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (opts.tls) {
+        tls_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_NONE, NULL);
+        SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    size_t start = 0;
+    while (start <= opts.port.size()) {
+        size_t comma = opts.port.find(',', start);
+        if (comma == std::string::npos) comma = opts.port.size();
+        struct addrinfo* server_addr;
+        int rv = getaddrinfo(opts.host.c_str(), opts.port.substr(start, comma - start).c_str(), &hints, &server_addr);
+        if (rv != 0) {
+            std::cerr << "getaddrinfo: " << gai_strerror(rv) << std::endl;
+            return EXIT_FAILURE;
+        }
+        server_addrs.push_back(server_addr);
+        start = comma + 1;
+    }
+
+    std::vector<Worker*> workers;
+    int per_worker = opts.clients / opts.threads;
+    int first = 0;
+    for (int i = 0; i < opts.threads; ++i) {
+        int count = per_worker + (i < opts.clients % opts.threads ? 1 : 0);
+        workers.push_back(new Worker(i, first, count));
+        first += count;
+    }
+
+    std::cout << "Connecting " << opts.clients << " clients to " << opts.host << ":" << opts.port << std::endl;
+    uint64_t setup_start = nowNs();
+    std::vector<std::thread> threads;
+    for (Worker* w : workers) {
+        threads.emplace_back(&Worker::run, w);
+    }
+
+    // Traffic starts once every client is registered and in its channel
+    while (joined_total.load() + failed_total.load() < opts.clients) {
+        usleep(10000);
+    }
+    uint64_t setup_end = nowNs();
+    int joined_clients = joined_total.load();
+    double setup_seconds = (setup_end - setup_start) / 1e9;
+    std::cout << joined_clients << " clients joined in " << setup_seconds << "s" << std::endl;
+
+    double run_seconds = 0;
+    double storm_seconds = 0;
+    int storm_joined = 0;
+    if (opts.storm) {
+        joined_total = 0;
+        failed_total = 0;
+        uint64_t storm_start = nowNs();
+        storm_go = true;
+        while (joined_total.load() + failed_total.load() < opts.clients) {
+            usleep(1000);
+        }
+        storm_seconds = (nowNs() - storm_start) / 1e9;
+        storm_joined = joined_total.load();
+        std::cout << storm_joined << " clients back after the reconnect storm in " << storm_seconds << "s" << std::endl;
+    } else {
+        sending = true;
+        uint64_t run_start = nowNs();
+        sleep(opts.duration);
+        stopping = true;
+        run_seconds = (nowNs() - run_start) / 1e9;
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    Stats total;
+    for (Worker* w : workers) {
+        for (int op = 0; op < OP_COUNT; ++op) total.sent[op] += w->stats.sent[op];
+        total.delivered += w->stats.delivered;
+        total.bytes_out += w->stats.bytes_out;
+        total.bytes_in += w->stats.bytes_in;
+        total.connect_failures += w->stats.connect_failures;
+        total.disconnects += w->stats.disconnects;
+        total.skipped_backpressure += w->stats.skipped_backpressure;
+        total.handshakes += w->stats.handshakes;
+        total.resumed += w->stats.resumed;
+        total.latency_us.merge(w->stats.latency_us);
+    }
+    uint64_t sent = 0;
+    for (int op = 0; op < OP_COUNT; ++op) sent += total.sent[op];
+
+    if (opts.tls) {
+        std::cout << total.handshakes << " TLS handshakes, " << total.resumed << " resumed" << std::endl;
+    }
+    if (!opts.storm) {
+        std::cout << "sent " << sent << " (" << sent / run_seconds << "/s), delivered " << total.delivered
+                  << " (" << total.delivered / run_seconds << "/s)\n"
+                  << "latency us p50 " << total.latency_us.percentile(50)
+                  << " p99 " << total.latency_us.percentile(99)
+                  << " p999 " << total.latency_us.percentile(99.9)
+                  << " max " << total.latency_us.max << std::endl;
+    }
+
+    FILE* out = fopen(opts.output.c_str(), "w");
+    if (!out) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"clients\": %d,\n  \"channels\": %d,\n  \"threads\": %d,\n", opts.clients, opts.channels, opts.threads);
+    fprintf(out, "  \"target_rate\": %.0f,\n  \"duration_s\": %.3f,\n", opts.rate, run_seconds);
+    fprintf(out, "  \"targets\": %d,\n  \"split\": %s,\n", opts.targets, opts.split ? "true" : "false");
+    fprintf(out, "  \"mix\": {\"%s\": %d, \"%s\": %d, \"%s\": %d, \"%s\": %d},\n",
+            op_names[0], opts.mix[0], op_names[1], opts.mix[1], op_names[2], opts.mix[2], op_names[3], opts.mix[3]);
+    fprintf(out, "  \"joined_clients\": %d,\n  \"setup_s\": %.3f,\n  \"connect_rate_per_s\": %.1f,\n",
+            joined_clients, setup_seconds, joined_clients / setup_seconds);
+    if (opts.storm) {
+        fprintf(out, "  \"storm_clients\": %d,\n  \"storm_recovery_s\": %.3f,\n  \"storm_reconnect_rate_per_s\": %.1f,\n",
+                storm_joined, storm_seconds, storm_joined / storm_seconds);
+    }
+    if (opts.tls) {
+        fprintf(out, "  \"tls_handshakes\": %llu,\n  \"tls_resumed\": %llu,\n",
+                static_cast<unsigned long long>(total.handshakes), static_cast<unsigned long long>(total.resumed));
+    }
+    fprintf(out, "  \"sent\": {");
+    for (int op = 0; op < OP_COUNT; ++op) {
+        fprintf(out, "%s\"%s\": %llu", op ? ", " : "", op_names[op], static_cast<unsigned long long>(total.sent[op]));
+    }
+    fprintf(out, "},\n");
+    fprintf(out, "  \"sent_per_s\": %.1f,\n  \"delivered\": %llu,\n  \"delivered_per_s\": %.1f,\n",
+            run_seconds > 0 ? sent / run_seconds : 0.0, static_cast<unsigned long long>(total.delivered),
+            run_seconds > 0 ? total.delivered / run_seconds : 0.0);
+    fprintf(out, "  \"latency_us\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu},\n",
+            static_cast<unsigned long long>(total.latency_us.percentile(50)),
+            static_cast<unsigned long long>(total.latency_us.percentile(99)),
+            static_cast<unsigned long long>(total.latency_us.percentile(99.9)),
+            static_cast<unsigned long long>(total.latency_us.max));
+    fprintf(out, "  \"bytes_out\": %llu,\n  \"bytes_in\": %llu,\n",
+            static_cast<unsigned long long>(total.bytes_out), static_cast<unsigned long long>(total.bytes_in));
+    fprintf(out, "  \"connect_failures\": %llu,\n  \"disconnects\": %llu,\n  \"skipped_backpressure\": %llu\n",
+            static_cast<unsigned long long>(total.connect_failures), static_cast<unsigned long long>(total.disconnects),
+            static_cast<unsigned long long>(total.skipped_backpressure));
+    fprintf(out, "}\n");
+    fclose(out);
+    std::cout << "Results written to " << opts.output << std::endl;
+
+    for (Worker* w : workers) {
+        delete w;
+    }
+    for (struct addrinfo* server_addr : server_addrs) {
+        freeaddrinfo(server_addr);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+// The line parser the server used before parseMessage, kept so the tools
+// in this directory can check the new one against it and time the two.
+// It is the old IRCServer::parseCommand unchanged apart from being a free
+// function.
+
+#ifndef OLDPARSE_H
+#define OLDPARSE_H
+
+#include <string>
+#include <vector>
+
+static void parseCommand(const std::string& line, std::string& command, std::vector<std::string>& params) {
+    size_t pos = 0;
+    std::string token;
+    std::string s = line;
+    std::string prefix;
+
+    // Skip leading spaces
+    s.erase(0, s.find_first_not_of(" "));
+
+    // Check for prefix
+    if (!s.empty() && s[0] == ':') {
+        pos = s.find(' ');
+        if (pos != std::string::npos) {
+            prefix = s.substr(1, pos - 1);
+            s.erase(0, pos + 1);
+        } else {
+            // Malformed message; no command after prefix
+            return;
+        }
+    }
+
+    // Skip leading spaces
+    s.erase(0, s.find_first_not_of(" "));
+
+    // Extract command
+    pos = s.find(' ');
+    if (pos != std::string::npos) {
+        command = s.substr(0, pos);
+        s.erase(0, pos + 1);
+    } else {
+        command = s;
+        return;
+    }
+
+    // Extract parameters
+    while (!s.empty()) {
+        // Skip leading spaces
+        s.erase(0, s.find_first_not_of(" "));
+        if (s.empty()) break;
+
+        if (s[0] == ':') {
+            params.push_back(s.substr(1));
+            break;
+        }
+
+        pos = s.find(' ');
+        if (pos != std::string::npos) {
+            token = s.substr(0, pos);
+            s.erase(0, pos + 1);
+        } else {
+            token = s;
+            s.clear();
+        }
+        params.push_back(token);
+    }
+}
+
+#endif // OLDPARSE_H
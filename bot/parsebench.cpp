@@ -0,0 +1,133 @@
+// Micro-benchmark for parsing and dispatching a client line.
+//
+// Runs a mix of lines like those a busy server sees (channel and private
+// PRIVMSG, NOTICE, PING, JOIN/PART, a prefixed relay and an unknown
+// command) through each way of turning a line into a handler call. The old
+// way copies the line, splits it with parseCommand (bot/oldparse.h) into a
+// std::string command and a vector of parameters, then compares the
+// command against each name in turn. The new way parses into a Message of
+// string_views and switches on commandHash, as processCommand does. Both
+// count the handler each line reaches, and the counts must match.
+//
+// Build:  g++ -std=c++17 -O2 -Iserver -o parsebench bot/parsebench.cpp server/Message.cpp
+// Run:    ./parsebench [ROUNDS]          (default: 1000000)
+
+#include "Message.h"
+#include "oldparse.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum Handler { NICK, USER, PING, JOIN, PRIVMSG, PART, QUIT, NOTICE, UNKNOWN, HANDLERS };
+
+static const char* const LINES[] = {
+    "PRIVMSG #general :has anyone tried the new build on the staging box yet?",
+    "PRIVMSG #general :yes, looks fine here",
+    "PRIVMSG alice :are you around later?",
+    "PRIVMSG #dev,bob :deploying in five minutes",
+    "NOTICE #general :the server restarts at midnight",
+    "PING :irc.example.net",
+    "JOIN #dev",
+    "PART #dev :back soon",
+    ":relay!relay@link PRIVMSG #general :forwarded from the other network",
+    "WHO #general",
+};
+
+#define LINE_COUNT (sizeof LINES / sizeof LINES[0])
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static Handler oldDispatch(std::string_view line, size_t& param_total) {
+    std::string command;
+    std::vector<std::string> params;
+    parseCommand(std::string(line), command, params);
+    param_total += params.size();
+
+    if (command == "NICK") {
+        return NICK;
+    } else if (command == "USER") {
+        return USER;
+    } else if (command == "PING") {
+        return PING;
+    } else if (command == "JOIN") {
+        return JOIN;
+    } else if (command == "PRIVMSG") {
+        return PRIVMSG;
+    } else if (command == "PART") {
+        return PART;
+    } else if (command == "QUIT") {
+        return QUIT;
+    } else if (command == "NOTICE") {
+        return NOTICE;
+    }
+    return UNKNOWN;
+}
+
+static Handler newDispatch(std::string_view line, size_t& param_total) {
+    Message msg;
+    if (!parseMessage(line, msg)) return UNKNOWN;
+    param_total += msg.param_count;
+
+    Handler handler = UNKNOWN;
+    std::string_view name;
+    switch (commandHash(msg.command)) {
+    case commandHash("NICK"):    handler = NICK;    name = "NICK";    break;
+    case commandHash("USER"):    handler = USER;    name = "USER";    break;
+    case commandHash("PING"):    handler = PING;    name = "PING";    break;
+    case commandHash("JOIN"):    handler = JOIN;    name = "JOIN";    break;
+    case commandHash("PRIVMSG"): handler = PRIVMSG; name = "PRIVMSG"; break;
+    case commandHash("PART"):    handler = PART;    name = "PART";    break;
+    case commandHash("QUIT"):    handler = QUIT;    name = "QUIT";    break;
+    case commandHash("NOTICE"):  handler = NOTICE;  name = "NOTICE";  break;
+    }
+    return handler != UNKNOWN && equalsIgnoreCase(msg.command, name) ? handler : UNKNOWN;
+}
+
+// Returns ns per line, and fills counts with the handler hits
+static double run(Handler (*dispatch)(std::string_view, size_t&), size_t rounds,
+                  size_t counts[HANDLERS], size_t& param_total) {
+    std::vector<std::string_view> lines(LINES, LINES + LINE_COUNT);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        for (std::string_view line : lines) {
+            ++counts[dispatch(line, param_total)];
+        }
+    }
+    return secondsSince(start) * 1e9 / (rounds * LINE_COUNT);
+}
+
+int main(int argc, char* argv[]) {
+    size_t rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    if (rounds == 0) {
+        fprintf(stderr, "Usage: %s [ROUNDS]\n", argv[0]);
+        return 2;
+    }
+
+    size_t old_counts[HANDLERS] = {}, new_counts[HANDLERS] = {};
+    size_t old_params = 0, new_params = 0;
+    // One untimed round of each to fault in code and the allocator
+    run(oldDispatch, 1, old_counts, old_params);
+    run(newDispatch, 1, new_counts, new_params);
+    double old_ns = run(oldDispatch, rounds, old_counts, old_params);
+    double new_ns = run(newDispatch, rounds, new_counts, new_params);
+
+    printf("%zu lines, %zu-line mix\n", rounds * LINE_COUNT, LINE_COUNT);
+    printf("  parseCommand + if chain    %6.1f ns/line\n", old_ns);
+    printf("  parseMessage + hash switch %6.1f ns/line  (%.1fx)\n", new_ns, old_ns / new_ns);
+    for (int h = 0; h < HANDLERS; ++h) {
+        if (old_counts[h] != new_counts[h]) {
+            printf("  dispatch differs for handler %d: %zu vs %zu\n", h, old_counts[h], new_counts[h]);
+            return 1;
+        }
+    }
+    if (old_params != new_params) {
+        printf("  parameter totals differ: %zu vs %zu\n", old_params, new_params);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Differential fuzzer for the server's line parser.
+//
+// Generates random lines from an alphabet heavy in spaces and colons, with
+// prefixes, trailing parameters and long parameter lists, and parses each
+// with parseMessage and with the old parseCommand (bot/oldparse.h). They
+// must agree on the command and, for lines with fewer than MAX_PARAMS
+// parameters, on every parameter; the old parser had no limit, so for
+// longer lines the new one must agree up to the last parameter and give
+// the rest of the line as that. Every view must also point into the line.
+// The first mismatch is printed and the exit status is 1.
+//
+// Build:  g++ -std=c++17 -O2 -Iserver -o parsefuzz bot/parsefuzz.cpp server/Message.cpp
+// Run:    ./parsefuzz [--lines N] [--seed S]
+
+#include "Message.h"
+#include "oldparse.h"
+#include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#define MAX_LINE 200
+
+// Weighted towards the characters the parser splits on
+static const char ALPHABET[] = "    ::::abcAB#,!@.-";
+
+static std::string randomLine(std::mt19937_64& rng) {
+    std::string line;
+    switch (rng() % 4) {
+    case 0:
+        // Pure noise
+        break;
+    case 1:
+        line = ":nick!user@host ";
+        break;
+    case 2:
+        // Many short parameters, to cross MAX_PARAMS
+        line = "CMD";
+        for (size_t i = 0, n = rng() % (MAX_PARAMS * 2); i < n; ++i) {
+            line += ' ';
+            line += static_cast<char>('a' + i % 26);
+        }
+        break;
+    default:
+        line = "privmsg #chan :";
+        break;
+    }
+    for (size_t i = 0, n = rng() % (MAX_LINE - line.size()); i < n; ++i) {
+        line += ALPHABET[rng() % (sizeof ALPHABET - 1)];
+    }
+    return line;
+}
+
+static bool within(std::string_view view, std::string_view line) {
+    return view.empty() ||
+           (view.data() >= line.data() && view.data() + view.size() <= line.data() + line.size());
+}
+
+static void fail(const std::string& line, const char* what) {
+    printf("mismatch (%s) on \"%s\"\n", what, line.c_str());
+    exit(1);
+}
+
+static void check(const std::string& line) {
+    std::string command;
+    std::vector<std::string> params;
+    parseCommand(line, command, params);
+
+    Message msg;
+    bool parsed = parseMessage(line, msg);
+
+    // The old parser left the command empty where the new one gives up
+    if (!parsed) {
+        if (!command.empty()) fail(line, "rejected");
+        return;
+    }
+    if (msg.command != command) fail(line, "command");
+    if (msg.param_count > MAX_PARAMS) fail(line, "parameter count");
+    if (!within(msg.prefix, line) || !within(msg.command, line)) fail(line, "view outside line");
+    for (size_t i = 0; i < msg.param_count; ++i) {
+        if (!within(msg.params[i], line)) fail(line, "view outside line");
+    }
+
+    if (params.size() < MAX_PARAMS) {
+        if (msg.param_count != params.size()) fail(line, "parameter count");
+        for (size_t i = 0; i < params.size(); ++i) {
+            if (msg.params[i] != params[i]) fail(line, "parameter");
+        }
+        return;
+    }
+
+    // The last parameter takes the rest of the line, which starts with
+    // what the old parser saw as that parameter
+    if (msg.param_count != MAX_PARAMS) fail(line, "parameter count");
+    for (size_t i = 0; i + 1 < MAX_PARAMS; ++i) {
+        if (msg.params[i] != params[i]) fail(line, "parameter");
+    }
+    std::string_view last = msg.params[MAX_PARAMS - 1];
+    if (last.data() + last.size() != line.data() + line.size()) fail(line, "last parameter");
+    if (last.substr(0, params[MAX_PARAMS - 1].size()) != params[MAX_PARAMS - 1]) {
+        fail(line, "last parameter");
+    }
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"lines", required_argument, 0, 'n'},
+        {"seed", required_argument, 0, 's'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    unsigned long lines = 2000000;
+    unsigned long seed = 42;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:s:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n': lines = strtoul(optarg, NULL, 10); break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "Usage: %s [--lines N] [--seed S]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::mt19937_64 rng(seed);
+    size_t long_lines = 0;
+    for (unsigned long i = 0; i < lines; ++i) {
+        std::string line = randomLine(rng);
+        check(line);
+        Message msg;
+        if (parseMessage(line, msg) && msg.param_count == MAX_PARAMS) ++long_lines;
+    }
+    printf("%lu lines agree (%zu with %d parameters or more)\n", lines, long_lines, MAX_PARAMS);
+    return 0;
+}
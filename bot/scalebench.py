@@ -0,0 +1,64 @@
+# Throughput against the number of event-loop shards.
+#
+# For each thread count, starts the server with --threads N and runs the
+# same loadgen workload against it: a fixed client count and offered rate
+# of loadgen's default mix. Reported per run: lines sent and deliveries
+# received per second, and delivery latency. Offer more than the server
+# can take, so delivered/s is its capacity rather than the offered rate.
+#
+# Build loadgen first (see bot/loadgen.cpp), then:
+#   python3 bot/scalebench.py --server ./server/myserver --loadgen ./loadgen \
+#       --threads 1,2,4,8 --clients 2000 --rate 200000
+# Shards only help with cores to run them on, and loadgen needs some too;
+# pin the two apart (taskset) on a machine with enough of them.
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+
+def run(args, threads):
+    command = [args.server, "--port", str(args.port), "--threads", str(threads),
+               "--max-per-ip", "0", "--flood-rate", "0"]
+    server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        time.sleep(0.5)
+        output = "/tmp/scalebench.%d.json" % os.getpid()
+        subprocess.run([args.loadgen, "--port", str(args.port), "--clients", str(args.clients),
+                        "--channels", str(args.channels), "--rate", str(args.rate),
+                        "--duration", str(args.duration), "--output", output],
+                       stdout=subprocess.DEVNULL, check=True)
+        with open(output) as f:
+            result = json.load(f)
+        os.unlink(output)
+    finally:
+        server.kill()
+        server.wait()
+    latency = result["latency_us"]
+    return result["sent_per_s"], result["delivered_per_s"], latency["p50"], latency["p99"]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--server", default="./server/myserver")
+    parser.add_argument("--loadgen", default="./loadgen")
+    parser.add_argument("--port", type=int, default=6670)
+    parser.add_argument("--threads", default="1,2,4,8", help="server shard counts to run")
+    parser.add_argument("--clients", type=int, default=2000)
+    parser.add_argument("--channels", type=int, default=50)
+    parser.add_argument("--rate", type=float, default=200000, help="lines per second offered")
+    parser.add_argument("--duration", type=int, default=10)
+    args = parser.parse_args()
+
+    print("%8s  %12s  %14s  %10s  %10s" % ("threads", "sent/s", "delivered/s", "p50 us", "p99 us"))
+    for threads in [int(t) for t in args.threads.split(",")]:
+        sent, delivered, p50, p99 = run(args, threads)
+        print("%8d  %12.0f  %14.0f  %10d  %10d" % (threads, sent, delivered, p50, p99))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,103 @@
+# System calls and CPU time per delivered message, epoll against io_uring.
+#
+# For each backend, runs the same loadgen workload twice against a fresh
+# server. The first run reads the server's CPU time (user + system, from
+# /proc/<pid>/stat) over the traffic phase; the second counts its syscalls
+# over the same phase with bot/syscount.cpp, which slows the server down,
+# so it is kept out of the CPU run. Both are divided by the deliveries
+# loadgen received in that run. The traffic phase starts once loadgen
+# reports every client joined and ends when it exits.
+#
+# Build loadgen and syscount first (see their headers), then:
+#   python3 bot/syscallbench.py --server ./server/myserver --loadgen ./loadgen \
+#       --syscount ./syscount --clients 2000 --rate 20000
+# Channel lines reach many members each, so the default mix makes few
+# syscalls per delivery; --mix 0,100,0,0 (direct messages only) shows the
+# cost when every line has a single recipient.
+#
+# Tracing needs ptrace rights over the server (same user, and
+# kernel.yama.ptrace_scope 0, or root).
+
+import argparse
+import json
+import os
+import signal
+import subprocess
+import sys
+import time
+
+
+def cpuSeconds(pid):
+    with open("/proc/%d/stat" % pid) as f:
+        # The command name may hold spaces; fields resume after its ')'
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def run(args, io_uring, traced):
+    command = [args.server, "--port", str(args.port), "--threads", str(args.threads),
+               "--max-per-ip", "0", "--flood-rate", "0"]
+    if io_uring:
+        command.append("--io-uring")
+    server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    counter = None
+    try:
+        time.sleep(0.5)
+        output = "/tmp/syscallbench.%d.json" % os.getpid()
+        loadgen = subprocess.Popen([args.loadgen, "--port", str(args.port), "--clients", str(args.clients),
+                                    "--channels", str(args.channels), "--rate", str(args.rate),
+                                    "--duration", str(args.duration), "--mix", args.mix, "--output", output],
+                                   stdout=subprocess.PIPE, text=True)
+        for line in loadgen.stdout:
+            if "clients joined" in line:
+                break
+        if traced:
+            counter = subprocess.Popen([args.syscount, str(server.pid)], stdout=subprocess.PIPE, text=True)
+        else:
+            cpu = cpuSeconds(server.pid)
+        loadgen.stdout.read()
+        if loadgen.wait() != 0:
+            sys.exit("loadgen failed")
+        if traced:
+            counter.send_signal(signal.SIGINT)
+            report = counter.communicate()[0]
+            measured = int(report.split()[0])
+        else:
+            measured = cpuSeconds(server.pid) - cpu
+        with open(output) as f:
+            delivered = json.load(f)["delivered"]
+        os.unlink(output)
+    finally:
+        if counter and counter.poll() is None:
+            counter.kill()
+        server.kill()
+        server.wait()
+    return measured, delivered
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--server", default="./server/myserver")
+    parser.add_argument("--loadgen", default="./loadgen")
+    parser.add_argument("--syscount", default="./syscount")
+    parser.add_argument("--port", type=int, default=6670)
+    parser.add_argument("--threads", type=int, default=1, help="server shards")
+    parser.add_argument("--clients", type=int, default=2000)
+    parser.add_argument("--channels", type=int, default=50)
+    parser.add_argument("--rate", type=float, default=20000, help="lines per second offered")
+    parser.add_argument("--duration", type=int, default=10)
+    parser.add_argument("--mix", default="70,20,5,5", help="loadgen's traffic mix")
+    args = parser.parse_args()
+
+    print("%-9s  %12s  %14s  %16s  %14s" % ("backend", "delivered", "cpu ns/msg", "syscalls", "syscalls/msg"))
+    for io_uring in (False, True):
+        cpu, cpu_delivered = run(args, io_uring, False)
+        syscalls, traced_delivered = run(args, io_uring, True)
+        print("%-9s  %12d  %14.0f  %16d  %14.4f" % ("io_uring" if io_uring else "epoll", cpu_delivered,
+                                                    cpu * 1e9 / max(cpu_delivered, 1), syscalls,
+                                                    syscalls / max(traced_delivered, 1)))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
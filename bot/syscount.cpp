@@ -0,0 +1,174 @@
+// Count the system calls a running process makes.
+//
+// Attaches to every thread of PID with ptrace, counts syscall entries
+// until SIGINT or SIGTERM (or --seconds have passed), then detaches and
+// prints the total and the busiest syscall numbers. It does what
+// `strace -c -f -p PID` does for machines that have no strace or perf.
+// Threads the process starts meanwhile are followed too.
+//
+// Every syscall stops the tracee twice, so the traced process runs
+// several times slower: compare counts per unit of work, not timings.
+//
+// Build:  g++ -std=c++17 -O2 -o syscount bot/syscount.cpp
+// Run:    ./syscount [--seconds N] PID
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define TOP_SYSCALLS 10            // Syscall numbers listed after the total
+
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int) {
+    stopping = 1;
+}
+
+static std::vector<pid_t> threadsOf(pid_t pid) {
+    std::vector<pid_t> tids;
+    std::string path = "/proc/" + std::to_string(pid) + "/task";
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return tids;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            tids.push_back(atoi(entry->d_name));
+        }
+    }
+    closedir(dir);
+    return tids;
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"seconds", required_argument, 0, 's'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int seconds = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's': seconds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [--seconds N] PID\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [--seconds N] PID\n", argv[0]);
+        return 2;
+    }
+    pid_t pid = atoi(argv[optind]);
+
+    // No SA_RESTART, so waitpid returns to let us notice
+    struct sigaction sa = {};
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+
+    // Seize every thread; a thread started while we walk the list is
+    // picked up through PTRACE_O_TRACECLONE on its parent
+    std::set<pid_t> traced;
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE;
+    for (bool added = true; added;) {
+        added = false;
+        for (pid_t tid : threadsOf(pid)) {
+            if (traced.count(tid)) continue;
+            if (ptrace(PTRACE_SEIZE, tid, 0, options) == 0) {
+                ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+                traced.insert(tid);
+                added = true;
+            } else if (errno != ESRCH && errno != EPERM) {
+                perror("ptrace(PTRACE_SEIZE)");
+                return 1;
+            }
+            // EPERM: an io_uring worker, which runs in the kernel and
+            // makes no syscalls of its own
+        }
+    }
+    if (traced.empty()) {
+        fprintf(stderr, "Cannot trace process %d\n", pid);
+        return 1;
+    }
+    if (seconds > 0) {
+        alarm(seconds);
+    }
+
+    std::map<long, unsigned long> counts;
+    unsigned long total = 0;
+    bool detaching = false;
+    while (!traced.empty()) {
+        if (stopping && !detaching) {
+            // Each thread must be stopped to be detached
+            detaching = true;
+            for (pid_t tid : traced) {
+                ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+            }
+        }
+        int status;
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            traced.erase(tid);
+            continue;
+        }
+        if (!WIFSTOPPED(status)) continue;
+        if (!traced.count(tid)) {
+            // A new thread reporting in before its parent's clone event
+            traced.insert(tid);
+        }
+        if (detaching) {
+            ptrace(PTRACE_DETACH, tid, 0, 0);
+            traced.erase(tid);
+            continue;
+        }
+
+        int sig = WSTOPSIG(status);
+        int event = status >> 16;
+        int inject = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof info, &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                ++counts[static_cast<long>(info.entry.nr)];
+                ++total;
+            }
+        } else if (event == PTRACE_EVENT_CLONE) {
+            unsigned long child;
+            if (ptrace(PTRACE_GETEVENTMSG, tid, 0, &child) == 0) {
+                traced.insert(static_cast<pid_t>(child));
+            }
+        } else if (event != PTRACE_EVENT_STOP && sig != SIGTRAP) {
+            // A signal for the process itself; deliver it
+            inject = sig;
+        }
+        ptrace(PTRACE_SYSCALL, tid, 0, inject);
+    }
+
+    std::vector<std::pair<unsigned long, long>> busiest;
+    for (const auto& entry : counts) {
+        busiest.push_back({entry.second, entry.first});
+    }
+    std::sort(busiest.rbegin(), busiest.rend());
+    printf("%lu syscalls\n", total);
+    for (size_t i = 0; i < busiest.size() && i < TOP_SYSCALLS; ++i) {
+        printf("  %10lu  syscall %ld\n", busiest[i].first, busiest[i].second);
+    }
+    return 0;
+}
@@ -0,0 +1,122 @@
+// Micro-benchmark for the server's timer wheel.
+//
+// Arms N timers spread over the next ten minutes, as the server does with
+// one liveness timer per client, then measures schedule, reschedule and
+// cancel per operation and the cost of advancing the wheel tick by tick.
+// Expired timers are re-armed two minutes out, like a keepalive, and most
+// reach level 0 through cascades on the way. For comparison the same ticks
+// are run as a scan over every deadline, which is what checking each
+// client once per tick would cost. A quiet tick has all N armed an hour
+// out, so only the wheel's own bookkeeping runs.
+//
+// Build:  g++ -std=c++17 -O2 -Iserver -o timerbench bot/timerbench.cpp server/TimerWheel.cpp
+// Run:    ./timerbench [N ...]          (default: 100000 1000000)
+
+#include "TimerWheel.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#define SPREAD_NS (600 * 1000000000ull)
+#define REARM_NS (120 * 1000000000ull)
+#define TICKS 6000                       // Ten minutes at 100 ms
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void run(size_t n) {
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> when(n);
+    for (uint64_t& w : when) {
+        w = TIMER_TICK_NS + rng() % SPREAD_NS;
+    }
+    std::vector<TimerNode> nodes(n);
+    TimerWheel wheel(0);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        wheel.schedule(&nodes[i], when[i]);
+    }
+    double schedule_s = secondsSince(start);
+
+    // Move every timer, as activity pushing a deadline back would
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        wheel.schedule(&nodes[i], when[n - 1 - i]);
+    }
+    double reschedule_s = secondsSince(start);
+
+    size_t fired = 0;
+    uint64_t now = 0;
+    start = std::chrono::steady_clock::now();
+    for (int tick = 1; tick <= TICKS; ++tick) {
+        now = tick * TIMER_TICK_NS;
+        wheel.advance(now, [&](TimerNode* t) {
+            ++fired;
+            wheel.schedule(t, now + REARM_NS);
+        });
+    }
+    double advance_s = secondsSince(start);
+
+    // The same ticks as a scan over every deadline
+    std::vector<uint64_t> deadlines(when);
+    size_t scanned_fired = 0;
+    start = std::chrono::steady_clock::now();
+    for (int tick = 1; tick <= TICKS; ++tick) {
+        now = tick * TIMER_TICK_NS;
+        for (uint64_t& d : deadlines) {
+            if (d <= now) {
+                ++scanned_fired;
+                d = now + REARM_NS;
+            }
+        }
+    }
+    double scan_s = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        wheel.cancel(&nodes[i]);
+    }
+    double cancel_s = secondsSince(start);
+
+    uint64_t base = now;
+    for (size_t i = 0; i < n; ++i) {
+        wheel.schedule(&nodes[i], base + 3600 * 1000000000ull + when[i]);
+    }
+    start = std::chrono::steady_clock::now();
+    for (int tick = 1; tick <= TICKS; ++tick) {
+        wheel.advance(base + tick * TIMER_TICK_NS, [](TimerNode*) {});
+    }
+    double quiet_s = secondsSince(start);
+    for (size_t i = 0; i < n; ++i) {
+        wheel.cancel(&nodes[i]);
+    }
+
+    printf("%zu timers\n", n);
+    printf("  schedule     %6.1f ns/op\n", schedule_s * 1e9 / n);
+    printf("  reschedule   %6.1f ns/op\n", reschedule_s * 1e9 / n);
+    printf("  cancel       %6.1f ns/op\n", cancel_s * 1e9 / n);
+    printf("  wheel tick   %8.2f us  (%zu fired over %d ticks, %.1f ns each)\n",
+           advance_s * 1e6 / TICKS, fired, TICKS, fired ? advance_s * 1e9 / fired : 0.0);
+    printf("  scan tick    %8.2f us  (%zu fired)\n", scan_s * 1e6 / TICKS, scanned_fired);
+    printf("  quiet tick   %8.3f us\n", quiet_s * 1e6 / TICKS);
+    if (wheel.size() != 0) {
+        printf("  %zu timers left armed after cancelling all\n", wheel.size());
+        exit(1);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            run(strtoul(argv[i], NULL, 10));
+        }
+    } else {
+        run(100000);
+        run(1000000);
+    }
+    return 0;
+}
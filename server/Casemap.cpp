@@ -0,0 +1,19 @@
+#include "Casemap.h"
+
+size_t IrcNameHash::operator()(std::string_view name) const {
+    // FNV-1a over the folded characters
+    size_t hash = 14695981039346656037ull;
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(ircLowerChar(c));
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool IrcNameEqual::operator()(std::string_view a, std::string_view b) const {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (ircLowerChar(a[i]) != ircLowerChar(b[i])) return false;
+    }
+    return true;
+}
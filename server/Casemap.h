@@ -0,0 +1,26 @@
+#ifndef CASEMAP_H
+#define CASEMAP_H
+
+#include <string_view>
+#include <cstddef>
+
+// RFC 1459 casemapping: A-Z and []\^ fold to a-z and {}|~, because
+// those are the upper-case forms of the latter in the Scandinavian
+// charset IRC grew up with.
+inline char ircLowerChar(char c) {
+    if (c >= 'A' && c <= '^') return c + ('a' - 'A');
+    return c;
+}
+
+// Hash and equality under the casemapping, so an index keyed by the names
+// themselves can be searched with whatever case the client typed, without
+// building a folded copy first
+struct IrcNameHash {
+    size_t operator()(std::string_view name) const;
+};
+
+struct IrcNameEqual {
+    bool operator()(std::string_view a, std::string_view b) const;
+};
+
+#endif // CASEMAP_H
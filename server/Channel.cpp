@@ -1,19 +1,118 @@
 #include "Channel.h"
+#include "FanoutPool.h"
+#include "RecvBuffer.h"
+#include "Replies.h"
+#include "Shard.h"
+#include <algorithm>
 
-Channel::Channel(const std::string& channel_name) : name(channel_name) {}
+FanoutPool* Channel::fanout = nullptr;
+
+// Room for names in one 353 line once the part each requester gets is
+// accounted for: ":<server> 353 <nick> = <channel> :" and the CRLF
+static size_t namesBudget(const std::string& channel_name) {
+    size_t fixed = serverPrefix().size() + 4 + NICK_MAX + 3 + channel_name.size() + 2 + 2;
+    // The separator after the last name is not sent
+    size_t budget = fixed < MAX_LINE_LENGTH ? MAX_LINE_LENGTH - fixed + 1 : 0;
+    return std::max<size_t>(budget, NICK_MAX + 1);
+}
+
+Channel::Channel(const std::string& channel_name)
+    : name(channel_name), names(namesBudget(channel_name)) {}
 
 void Channel::broadcast(const std::string& message, Client* sender) {
+    broadcast(makeSharedBuffer(message), sender);
+}
+
+void Channel::broadcast(const SharedBuffer& message, Client* sender) {
+    if (fanout && clients.size() >= fanout->threshold) {
+        // Members on other shards get their copies through the owners'
+        // inboxes, posted from several threads at once. The state lock
+        // keeps the array still meanwhile.
+        Shard* home = Shard::current();
+        bool shared = fanout->tryRun(clients.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                Client* client = clients[i];
+                if (client != sender && !client->via && client->shard != home) {
+                    client->shard->post(client, message);
+                }
+            }
+        });
+        if (shared) {
+            // Only this thread may queue to our own shard's members, and
+            // doing it now keeps them ahead of anything sent later
+            for (auto client : clients) {
+                if (client != sender && !client->via && client->shard == home) {
+                    client->enqueue(message);
+                }
+            }
+            return;
+        }
+    }
+
+    // Every local member queues a reference to the same serialized line
     for (auto client : clients) {
-        if (client != sender) {
-            client->sendmessage(message);
+        if (client != sender && !client->via) {
+            client->sendMessage(message);
+        }
+    }
+}
+
+void Channel::relay(const SharedBuffer& message, Client* from_link) {
+    // Once per link, however many members are behind it
+    for (const ChannelLink& entry : links) {
+        if (entry.link != from_link) {
+            entry.link->sendMessage(message);
         }
     }
 }
 
 void Channel::addClient(Client* client) {
-    clients.insert(client);
+    client->channels.push_back(this);
+    client->channel_slots.push_back(static_cast<uint32_t>(clients.size()));
+    clients.push_back(client);
+    names.add(client);
+
+    if (client->via) {
+        for (ChannelLink& entry : links) {
+            if (entry.link == client->via) {
+                ++entry.members;
+                return;
+            }
+        }
+        links.push_back({client->via, 1});
+    }
 }
 
 void Channel::removeClient(Client* client) {
-    clients.erase(client);
+    auto it = std::find(client->channels.begin(), client->channels.end(), this);
+    if (it == client->channels.end()) return;
+    size_t index = it - client->channels.begin();
+    uint32_t slot = client->channel_slots[index];
+    *it = client->channels.back();
+    client->channels.pop_back();
+    client->channel_slots[index] = client->channel_slots.back();
+    client->channel_slots.pop_back();
+
+    Client* moved = clients.back();
+    clients[slot] = moved;
+    clients.pop_back();
+    if (moved != client) {
+        auto entry = std::find(moved->channels.begin(), moved->channels.end(), this);
+        moved->channel_slots[entry - moved->channels.begin()] = slot;
+    }
+
+    names.remove(client);
+    if (client->via) {
+        for (size_t i = 0; i < links.size(); ++i) {
+            if (links[i].link == client->via && --links[i].members == 0) {
+                links[i] = links.back();
+                links.pop_back();
+                break;
+            }
+        }
+    }
+}
+
+bool Channel::hasClient(Client* client) const {
+    return std::find(client->channels.begin(), client->channels.end(), this) != client->channels.end();
 }
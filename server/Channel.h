@@ -2,18 +2,48 @@
 #define CHANNEL_H
 
 #include <string>
-#include <set>
+#include <vector>
 #include "Client.h"
+#include "History.h"
+#include "NamesCache.h"
+#include "SharedBuffer.h"
+
+#define NICK_MAX 9                 // Longest nickname, RFC 1459
+#define CHANNEL_NAME_MAX 50        // Longest channel name, RFC 2812
+
+class FanoutPool;
+
+// A server link and how many of the channel's members are behind it
+struct ChannelLink {
+    Client* link;
+    int members;
+};
 
 class Channel {
 public:
     std::string name;
-    std::set<Client*> clients;
+    // Members in no particular order, contiguous so a broadcast walks an
+    // array. Each member knows its slot (Client::channel_slots), so leaving
+    // swaps the last member into the gap.
+    std::vector<Client*> clients;
+    HistoryRing history;               // Guarded by IRCServer::history
+    // Links with members here. Remote members are in clients too, but
+    // lines reach them through their link, never one by one.
+    std::vector<ChannelLink> links;
+    NamesCache names;
+
+    // Splits broadcasts to the largest channels across threads; null to
+    // always deliver on the sender's thread. Set once at startup.
+    static FanoutPool* fanout;
 
     Channel(const std::string& channel_name);
+    void broadcast(const SharedBuffer& message, Client* sender = nullptr);
     void broadcast(const std::string& message, Client* sender = nullptr);
+    // Pass message on to every link with members, except the one it came from
+    void relay(const SharedBuffer& message, Client* from_link);
     void addClient(Client* client);
     void removeClient(Client* client);
+    bool hasClient(Client* client) const;
 };
 
 #endif // CHANNEL_H
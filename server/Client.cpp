@@ -1,13 +1,218 @@
 #include "Client.h"
+#include "Shard.h"
+#include <algorithm>
+#include <atomic>
 #include <unistd.h>
 #include <cstring>
 #include <cstdio>
+#include <cerrno>
+#include <mutex>
 #include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
 
-Client::Client(int socket_fd) : fd(socket_fd), registered(false), disconnecting(false) {}
+static std::atomic<uint64_t> next_client_id(1);
+
+#define CLIENT_SLAB_SLOTS 256      // Clients per slab
+
+// Clients are packed into slabs of exactly-sized slots rather than
+// allocated one by one, so an idle client costs no allocator header or
+// rounding, and a closed connection's slot goes to the next one. Slabs are
+// never returned. Clients come and go on every shard, hence the lock.
+static std::mutex slab_lock;
+static void* free_slots = nullptr;         // Chained through the slots
+
+void* Client::operator new(size_t size) {
+    std::lock_guard<std::mutex> lock(slab_lock);
+    if (!free_slots) {
+        char* slab = static_cast<char*>(::operator new(size * CLIENT_SLAB_SLOTS));
+        for (size_t i = CLIENT_SLAB_SLOTS; i-- > 0;) {
+            *reinterpret_cast<void**>(slab + i * size) = free_slots;
+            free_slots = slab + i * size;
+        }
+    }
+    void* slot = free_slots;
+    free_slots = *static_cast<void**>(slot);
+    return slot;
+}
+
+void Client::operator delete(void* slot) {
+    std::lock_guard<std::mutex> lock(slab_lock);
+    *static_cast<void**>(slot) = free_slots;
+    free_slots = slot;
+}
+
+Client::Client(int socket_fd, Shard* owner, size_t limit)
+    : fd(socket_fd), id(next_client_id.fetch_add(1, std::memory_order_relaxed)), shard(owner),
+      registered(false), oper(false), disconnecting(false),
+      is_link(false), link_outgoing(false), via(nullptr), nick_ts(0), visit_mark(0),
+      flood_tokens(0), flood_refill_ns(0), flood_resume_ns(0), throttled(false), fanout(0), targets(1),
+      sendq_offset(0), sendq_bytes(0), sendq_limit(limit), flush_pending(false), send_inflight(false),
+      ssl(nullptr), tls_handshaking(false), ktls_send(false), tls_want_write(false), tls_poll_out(false),
+      connected_ns(0), last_active_ns(0), last_message_ns(0), ping_sent_ns(0),
+      bytes_queued(0), bytes_sent(0), messages_dropped(0), sendq_exceeded(false) {
+    timer.owner = this;
+}
+
+Client::~Client() {
+    SSL_free(ssl);
+}
 
 void Client::sendMessage(const std::string& message) {
-    if (send(fd, message.c_str(), message.length(), 0) == -1) {
-        perror("Failed to send message");
+    sendMessage(makeSharedBuffer(message));
+}
+
+void Client::sendMessage(const SharedBuffer& message) {
+    if (via) {
+        via->sendMessage(message);
+    } else if (shard == Shard::current()) {
+        enqueue(message);
+    } else {
+        shard->post(this, message);
+    }
+}
+
+void Client::enqueue(const SharedBuffer& message) {
+    size_t length = message.length();
+    if (!sendq_exceeded && sendq_bytes + length > sendq_limit) {
+        // Only a peer that is really not reading counts as slow: give the
+        // socket a chance to take what is queued before giving up
+        if (!flush()) {
+            disconnecting = true;
+        }
+    }
+
+    if (sendq_exceeded || sendq_bytes + length > sendq_limit) {
+        // Slow consumer: drop the message and have the shard disconnect us
+        ++messages_dropped;
+        sendq_exceeded = true;
+        disconnecting = true;
+    } else {
+        sendq.push_back(message);
+        sendq_bytes += length;
+        bytes_queued += length;
+    }
+
+    scheduleFlush();
+}
+
+void Client::closeWith(const SharedBuffer& message) {
+    if (shard == Shard::current()) {
+        enqueue(message);
+        disconnect("Killed");
+    } else {
+        shard->post(this, message, true);
+    }
+}
+
+void Client::disconnect(const std::string& reason) {
+    if (disconnecting) return;
+    disconnecting = true;
+    quit_reason = reason;
+    scheduleFlush();
+}
+
+void Client::scheduleFlush() {
+    if (!flush_pending) {
+        flush_pending = true;
+        shard->flush_list.push_back(this);
+    }
+}
+
+bool Client::flush() {
+    struct iovec iov[IOV_BATCH];
+
+    // An asynchronous send still owns the queue head
+    if (send_inflight) return true;
+    if (tlsWrites()) return flushTls();
+
+    while (!sendq.empty()) {
+        int count = gatherOutput(iov, IOV_BATCH);
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Resume when the socket reports writable again
+                return true;
+            }
+            perror("Failed to send message");
+            return false;
+        }
+
+        consumeOutput(n);
+
+        if (count < IOV_BATCH && sendq_bytes > 0) {
+            // Short write: the socket buffer is full
+            return true;
+        }
+    }
+    return true;
+}
+
+bool Client::flushTls() {
+    // Lines are written once the handshake is done
+    if (tls_handshaking) return true;
+
+    // Coalesce queued lines into full records instead of one per line. A
+    // retry after WANT_WRITE gathers the same leading bytes again, which is
+    // all OpenSSL asks of it.
+    static thread_local char record[TLS_WRITE_SIZE];
+    tls_want_write = false;
+    while (!sendq.empty()) {
+        size_t length = 0;
+        for (size_t i = 0; i < sendq.size() && length < sizeof record; ++i) {
+            const SharedBuffer& line = sendq[i];
+            size_t skip = i == 0 ? sendq_offset : 0;
+            size_t n = std::min(line.length() - skip, sizeof record - length);
+            memcpy(record + length, line.data() + skip, n);
+            length += n;
+        }
+
+        ERR_clear_error();
+        int n = SSL_write(ssl, record, static_cast<int>(length));
+        if (n <= 0) {
+            int err = SSL_get_error(ssl, n);
+            if (err == SSL_ERROR_WANT_WRITE) {
+                tls_want_write = true;
+                return true;
+            }
+            if (err == SSL_ERROR_WANT_READ) {
+                // Waits for the next read
+                return true;
+            }
+            return false;
+        }
+        consumeOutput(n);
+    }
+    return true;
+}
+
+bool Client::wantsWrite() const {
+    return tlsWrites() ? tls_want_write : hasPendingOutput();
+}
+
+int Client::gatherOutput(struct iovec* iov, int max) const {
+    // The first line may be partially written already
+    int count = 0;
+    for (; static_cast<size_t>(count) < sendq.size() && count < max; ++count) {
+        const SharedBuffer& data = sendq[count];
+        size_t skip = count == 0 ? sendq_offset : 0;
+        iov[count].iov_base = const_cast<char*>(data.data()) + skip;
+        iov[count].iov_len = data.length() - skip;
+    }
+    return count;
+}
+
+void Client::consumeOutput(size_t n) {
+    sendq_bytes -= n;
+    bytes_sent += n;
+    shard->metrics.bytes_out.add(n);
+
+    // Release fully written lines and remember where the next one starts
+    size_t written = n + sendq_offset;
+    while (!sendq.empty() && written >= sendq.front().length()) {
+        written -= sendq.front().length();
+        sendq.pop_front();
     }
+    sendq_offset = written;
 }
@@ -2,19 +2,129 @@
 #define CLIENT_H
 
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <sys/uio.h>
+#include "InternedString.h"
+#include "RecvBuffer.h"
+#include "RingQueue.h"
+#include "SharedBuffer.h"
+#include "TimerWheel.h"
+
+#define IOV_BATCH 64               // Queue entries gathered per write
+#define TLS_WRITE_SIZE 16384       // Plaintext per SSL_write, one full record
+
+typedef struct ssl_st SSL;
+
+class Channel;
+class Shard;
 
 class Client {
 public:
     int fd;                        // Socket file descriptor
+    uint64_t id;                   // Unique for the life of the process
+    Shard* shard;                  // Owns this client's I/O
     std::string nickname;
     std::string username;
     std::string realname;
-    std::string hostname;
+    InternedString hostname;
+    InternedString ip;             // Peer address, for per-IP admission
     bool registered;
+    bool oper;                     // Authenticated with OPER
     bool disconnecting;
+    std::string quit_reason;       // Sent to peers when the client is removed
+
+    // Server linking. A link is a connection to another server; a remote
+    // user has no socket and is reached through the link it came from.
+    bool is_link;
+    bool link_outgoing;            // We connected and have sent PASS/SERVER
+    std::string link_password;     // From PASS, checked when SERVER arrives
+    Client* via;                   // Remote users only; null for local clients
+    InternedString server;         // A remote user's home server, or a link's peer
+    time_t nick_ts;                // When the nickname was taken; older wins a collision
+
+    std::vector<Channel*> channels;  // Channels this client has joined; a handful at most
+    std::vector<uint32_t> channel_slots;  // Our index in each one's clients, parallel to channels
+    uint64_t visit_mark;           // Epoch of the last peer walk that reached us
+
+    RecvBuffer recvbuf;            // Reused across reads; holds partial lines
+
+    // Flood control: a token bucket charged by command cost. While it is
+    // empty, received lines wait in recvbuf.
+    double flood_tokens;
+    uint64_t flood_refill_ns;      // When flood_tokens was last topped up
+    uint64_t flood_resume_ns;      // When a throttled client may go again
+    bool throttled;                // On the shard's throttled list
+    size_t fanout;                 // Recipients of the command being handled
+    size_t targets;                // Targets it named; each costs as much as a line
 
-    Client(int socket_fd);
+    // Outbound queue of shared lines, drained with writev() when writable
+    RingQueue<SharedBuffer> sendq;
+    size_t sendq_offset;           // Bytes of sendq.front() already written
+    size_t sendq_bytes;            // Bytes currently queued
+    size_t sendq_limit;            // Slow consumers are disconnected past this
+    bool flush_pending;            // Already on the shard's flush list
+    bool send_inflight;            // An io_uring send owns the head of sendq
+
+    // TLS connections. Once kTLS has taken over sending, queued lines go
+    // out with the plain socket path; until then, and for reads, OpenSSL
+    // does the I/O.
+    SSL* ssl;                      // Null for plaintext connections
+    bool tls_handshaking;
+    bool ktls_send;                // The kernel encrypts what we write
+    bool tls_want_write;           // OpenSSL is waiting for the socket to drain
+    bool tls_poll_out;             // io_uring: a POLLOUT request is armed
+
+    // Liveness, checked when timer fires. Reads only update the times, so
+    // a busy client never touches the shard's timer wheel.
+    TimerNode timer;
+    uint64_t connected_ns;
+    uint64_t last_active_ns;       // Last time anything was received
+    uint64_t last_message_ns;      // Last command other than PING/PONG
+    uint64_t ping_sent_ns;         // Our last PING; unanswered while after last_active_ns
+
+    // Lag counters
+    uint64_t bytes_queued;         // Total bytes ever queued
+    uint64_t bytes_sent;           // Total bytes written to the socket
+    uint64_t messages_dropped;     // Messages discarded because the queue was full
+    bool sendq_exceeded;
+
+    Client(int socket_fd, Shard* shard, size_t sendq_limit);
+    ~Client();
+    static void* operator new(size_t size);
+    static void operator delete(void* slot);
+
+    // Queue a message; it is written when the owning shard flushes this
+    // client. Safe from any shard: lines for another shard's client go
+    // through that shard's inbox. A remote user's lines go to its link.
+    void sendMessage(const SharedBuffer& message);
     void sendMessage(const std::string& message);
+    // Append to the outbound queue. Owning shard only.
+    void enqueue(const SharedBuffer& message);
+    // Mark for removal once the current batch has been flushed. Owning
+    // shard only.
+    void disconnect(const std::string& reason);
+    // Queue a last line and disconnect. Safe from any shard; for clients
+    // already removed from shared state, so the reason is never seen.
+    void closeWith(const SharedBuffer& message);
+    // Write as much queued data as the socket accepts. Returns false on a
+    // fatal socket error.
+    bool flush();
+    // Describe up to max queued lines, starting at the unwritten offset
+    int gatherOutput(struct iovec* iov, int max) const;
+    // Release n bytes that have been written to the socket
+    void consumeOutput(size_t n);
+    bool hasPendingOutput() const { return sendq_bytes > 0; }
+    // Whether the socket must report writable before flush() can progress
+    bool wantsWrite() const;
+    // True while writes have to go through SSL_write
+    bool tlsWrites() const { return ssl && (tls_handshaking || !ktls_send); }
+    // Put the client on its shard's flush list. Owning shard only.
+    void scheduleFlush();
+
+private:
+    bool flushTls();
 };
 
 #endif // CLIENT_H
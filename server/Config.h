@@ -0,0 +1,60 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define PORT 6667
+#define TLS_PORT 6697
+#define SENDQ_LIMIT (256 * 1024)   // Default per-client outbound queue cap in bytes
+#define FLOOD_RATE 20              // Flood-control tokens refilled per second
+#define FLOOD_BURST 40             // Bucket size, i.e. the largest burst
+#define MAX_CLIENTS_PER_IP 16
+#define HISTORY_BUDGET (64 * 1024 * 1024)  // Bytes of channel history kept in total
+#define LOG_FSYNC_MS 1000          // Message log group-commit interval
+#define LINK_SENDQ_LIMIT (32 * 1024 * 1024)  // Send queue of a server link
+#define LINK_RETRY_MS 2000         // Delay before reconnecting a configured link
+#define PING_INTERVAL_S 120        // Silence before the server sends a PING
+#define PONG_TIMEOUT_S 60          // Further silence before the client is dropped
+#define LINK_PING_INTERVAL_S 30    // Silence before a server link is sent a PING
+#define REGISTRATION_TIMEOUT_S 60  // Time allowed to complete NICK/USER
+#define MAX_TARGETS 8              // Comma-separated targets per PRIVMSG/NOTICE/JOIN/PART
+#define FANOUT_THRESHOLD 10000     // Channel size from which broadcasts use the fan-out pool
+
+// Runtime settings, filled from the command line in main()
+struct ServerConfig {
+    int port = PORT;
+    int tls_port = TLS_PORT;       // Listened on only when a certificate is set
+    std::string tls_cert;          // PEM certificate chain; no TLS if empty
+    std::string tls_key;           // PEM private key
+    bool ktls = true;              // Let the kernel encrypt TLS records when it can
+    size_t sendq_limit = SENDQ_LIMIT;
+    int threads = 1;               // Event-loop shards, one thread each
+    bool io_uring = false;         // Use the io_uring backend when the kernel has it
+    double flood_rate = FLOOD_RATE;    // 0 disables flood control
+    double flood_burst = FLOOD_BURST;
+    int max_per_ip = MAX_CLIENTS_PER_IP;  // 0 for no limit
+    int max_targets = MAX_TARGETS;
+    int fanout_workers = 0;        // Threads sharing out large broadcasts; 0 for none, unused with one shard
+    size_t fanout_threshold = FANOUT_THRESHOLD;
+    size_t history_budget = HISTORY_BUDGET;  // 0 disables channel history
+    std::string log_dir;           // Message log directory; no log if empty
+    int log_fsync_ms = LOG_FSYNC_MS;   // 0 syncs after every write
+    std::string oper_name;         // OPER credentials; no operators if empty
+    std::string oper_password;
+    std::string metrics_socket;    // Unix socket for Prometheus scrapes, if set
+    std::string server_name = "miniircd";  // Unique within a network of linked servers
+    std::vector<std::string> links;    // HOST:PORT of servers to connect to
+    std::string link_password;     // Shared by both ends of a link; no linking if empty
+    std::string upgrade_socket;    // Unix socket for hot restarts; see HotRestart
+    std::string motd_file;         // Read once at startup; built-in MOTD if empty
+    // Liveness, in seconds; 0 turns each check off
+    int ping_interval = PING_INTERVAL_S;
+    int pong_timeout = PONG_TIMEOUT_S;     // Links too
+    int link_ping_interval = LINK_PING_INTERVAL_S;
+    int registration_timeout = REGISTRATION_TIMEOUT_S;
+    int idle_timeout = 0;          // Drop clients that send nothing but PING/PONG this long
+};
+
+#endif // CONFIG_H
@@ -0,0 +1,122 @@
+#include "EventLoop.h"
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#ifdef USE_SELECT
+
+EventLoop::EventLoop() {}
+
+EventLoop::~EventLoop() {}
+
+bool EventLoop::add(int fd, bool) {
+    if (fd >= FD_SETSIZE) {
+        // select() cannot watch descriptors beyond FD_SETSIZE
+        return false;
+    }
+    fds.insert(fd);
+    return true;
+}
+
+void EventLoop::remove(int fd) {
+    fds.erase(fd);
+    write_fds.erase(fd);
+}
+
+void EventLoop::watchWrite(int fd, bool enable) {
+    if (enable) {
+        write_fds.insert(fd);
+    } else {
+        write_fds.erase(fd);
+    }
+}
+
+int EventLoop::wait(std::vector<IOEvent>& events, int timeout_ms) {
+    fd_set readfds, writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    int max_sd = -1;
+    for (int fd : fds) {
+        FD_SET(fd, &readfds);
+        max_sd = fd;
+    }
+    for (int fd : write_fds) {
+        FD_SET(fd, &writefds);
+    }
+
+    struct timeval tv;
+    struct timeval* tvp = NULL;
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    events.clear();
+    int activity = select(max_sd + 1, &readfds, &writefds, NULL, tvp);
+    if (activity <= 0) {
+        return activity;
+    }
+
+    for (int fd : fds) {
+        bool readable = FD_ISSET(fd, &readfds);
+        bool writable = FD_ISSET(fd, &writefds);
+        if (readable || writable) {
+            events.push_back({fd, readable, writable, false});
+        }
+    }
+    return static_cast<int>(events.size());
+}
+
+#else
+
+EventLoop::EventLoop() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+}
+
+EventLoop::~EventLoop() {
+    close(epoll_fd);
+}
+
+bool EventLoop::add(int fd, bool edge_triggered) {
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (edge_triggered) {
+        // Registered once for both directions; edges only fire on change
+        ev.events |= EPOLLOUT | EPOLLET;
+    }
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl add");
+        return false;
+    }
+    return true;
+}
+
+void EventLoop::watchWrite(int, bool) {}
+
+void EventLoop::remove(int fd) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1 && errno != EBADF) {
+        perror("epoll_ctl del");
+    }
+}
+
+int EventLoop::wait(std::vector<IOEvent>& events, int timeout_ms) {
+    events.clear();
+    int n = epoll_wait(epoll_fd, ready, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; ++i) {
+        uint32_t e = ready[i].events;
+        events.push_back({ready[i].data.fd,
+                          (e & (EPOLLIN | EPOLLRDHUP)) != 0,
+                          (e & EPOLLOUT) != 0,
+                          (e & (EPOLLERR | EPOLLHUP)) != 0});
+    }
+    return n;
+}
+
+#endif
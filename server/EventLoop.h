@@ -0,0 +1,52 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <vector>
+#ifdef USE_SELECT
+#include <set>
+#include <sys/select.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+#define MAX_EVENTS 256
+
+// Readiness notification for a single file descriptor
+struct IOEvent {
+    int fd;
+    bool readable;
+    bool writable;
+    bool error;                    // Hangup or socket error
+};
+
+// Readiness reactor. Built on edge-triggered epoll by default; compile with
+// -DUSE_SELECT to fall back to select() for benchmarking.
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+
+    // Register fd once for read (and write) readiness. Listening sockets
+    // should pass edge_triggered = false so a partial accept loop is retried.
+    bool add(int fd, bool edge_triggered = true);
+    void remove(int fd);
+    // Ask for write readiness while output is queued. A no-op for epoll,
+    // where client fds are registered for both directions up front.
+    void watchWrite(int fd, bool enable);
+
+    // Block until at least one fd is ready or timeout_ms expires (-1 waits
+    // forever). Fills events with the ready fds only and returns their count,
+    // or -1 on error with errno set.
+    int wait(std::vector<IOEvent>& events, int timeout_ms);
+
+private:
+#ifdef USE_SELECT
+    std::set<int> fds;
+    std::set<int> write_fds;
+#else
+    int epoll_fd;
+    epoll_event ready[MAX_EVENTS];
+#endif
+};
+
+#endif // EVENTLOOP_H
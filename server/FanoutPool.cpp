@@ -0,0 +1,79 @@
+#include "FanoutPool.h"
+#include <algorithm>
+
+FanoutPool::FanoutPool(int workers, size_t min_members)
+    : threshold(min_members), job(nullptr), job_count(0), job_slices(0), next_slice(0),
+      remaining(0), active(0), generation(0), stopping(false) {
+    for (int i = 0; i < workers; ++i) {
+        threads.emplace_back(&FanoutPool::workerLoop, this);
+    }
+}
+
+FanoutPool::~FanoutPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+bool FanoutPool::tryRun(size_t count, const std::function<void(size_t, size_t)>& work) {
+    if (!busy.try_lock()) return false;
+
+    std::unique_lock<std::mutex> guard(lock);
+    // A worker that woke too late for the last job may still be on its way
+    // out; it must not see this job's counters change under it
+    settled.wait(guard, [this] { return active == 0; });
+    job = &work;
+    job_count = count;
+    job_slices = (count + FANOUT_SLICE - 1) / FANOUT_SLICE;
+    next_slice.store(0, std::memory_order_relaxed);
+    remaining = job_slices;
+    ++generation;
+    guard.unlock();
+    wake.notify_all();
+
+    size_t done = runSlices();
+
+    // Whatever the workers did happened before they counted it off here
+    guard.lock();
+    remaining -= done;
+    settled.wait(guard, [this] { return remaining == 0; });
+    job = nullptr;
+    guard.unlock();
+    busy.unlock();
+    return true;
+}
+
+size_t FanoutPool::runSlices() {
+    size_t done = 0;
+    while (true) {
+        size_t slice = next_slice.fetch_add(1, std::memory_order_relaxed);
+        if (slice >= job_slices) return done;
+        size_t begin = slice * FANOUT_SLICE;
+        (*job)(begin, std::min(begin + FANOUT_SLICE, job_count));
+        ++done;
+    }
+}
+
+void FanoutPool::workerLoop() {
+    std::unique_lock<std::mutex> guard(lock);
+    uint64_t seen = 0;
+    while (true) {
+        wake.wait(guard, [&] { return stopping || generation != seen; });
+        if (stopping) return;
+        seen = generation;
+        ++active;
+        guard.unlock();
+        size_t done = runSlices();
+        guard.lock();
+        --active;
+        remaining -= done;
+        if (remaining == 0 || active == 0) {
+            settled.notify_all();
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef FANOUTPOOL_H
+#define FANOUTPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define FANOUT_SLICE 2048          // Members handed out per unit of work
+
+// Threads that share out the delivery of one line to a very large
+// channel. The caller splits the member array into slices and works on
+// them alongside the pool until all are done, so everything was handed on
+// by the time it returns: a sender's next line cannot overtake this one.
+// One job at a time; a caller that finds the pool busy delivers serially.
+class FanoutPool {
+public:
+    FanoutPool(int workers, size_t min_members);
+    ~FanoutPool();
+
+    size_t threshold;              // Channel size from which to use the pool
+
+    // Run work(begin, end) over slices of [0, count). Returns false, having
+    // run nothing, if another caller has the pool.
+    bool tryRun(size_t count, const std::function<void(size_t, size_t)>& work);
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex busy;               // Held by the caller for a whole job
+    std::mutex lock;               // Guards everything below but next_slice
+    std::condition_variable wake;      // Workers: a new job, or stop
+    std::condition_variable settled;   // Caller: slices done, workers out
+    const std::function<void(size_t, size_t)>* job;
+    size_t job_count;
+    size_t job_slices;
+    std::atomic<size_t> next_slice;
+    size_t remaining;              // Slices not yet finished
+    int active;                    // Workers between taking and finishing slices
+    uint64_t generation;           // Bumped per job
+    bool stopping;
+
+    void workerLoop();
+    size_t runSlices();
+};
+
+#endif // FANOUTPOOL_H
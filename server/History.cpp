@@ -0,0 +1,119 @@
+#include "History.h"
+#include "Channel.h"
+#include <algorithm>
+
+History::History(size_t max_bytes) : budget(max_bytes), bytes(0) {}
+
+size_t History::footprint(const SharedBuffer& line) {
+    return sizeof(BufferBlock) + line.capacity();
+}
+
+void History::touch(Channel* channel) {
+    // Move to the most recently used end
+    lru.splice(lru.end(), lru, channel->history.lru);
+}
+
+void History::record(Channel* channel, const SharedBuffer& line, uint64_t time_ms) {
+    if (!enabled()) return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    HistoryRing& ring = channel->history;
+    if (ring.entries.empty()) {
+        ring.entries.resize(HISTORY_LINES);
+        bytes += HISTORY_LINES * sizeof(HistoryEntry);
+    }
+
+    if (ring.count == 0) {
+        ring.lru = lru.insert(lru.end(), channel);
+    } else {
+        touch(channel);
+    }
+    if (ring.count == HISTORY_LINES) {
+        dropOldest(channel);
+    }
+
+    HistoryEntry& slot = ring.entries[(ring.head + ring.count) % HISTORY_LINES];
+    slot.time_ms = time_ms;
+    slot.line = line;
+    ++ring.count;
+    bytes += footprint(line);
+
+    // Over budget: shed the oldest lines of whichever channel has been
+    // quiet the longest, possibly this one
+    while (bytes > budget && !lru.empty()) {
+        dropOldest(lru.front());
+    }
+}
+
+void History::dropOldest(Channel* channel) {
+    HistoryRing& ring = channel->history;
+    HistoryEntry& oldest = ring.entries[ring.head];
+    bytes -= footprint(oldest.line);
+    oldest.line.reset();
+    ring.head = (ring.head + 1) % HISTORY_LINES;
+    --ring.count;
+
+    if (ring.count == 0) {
+        // Release the slots too; the channel may never speak again
+        lru.erase(ring.lru);
+        bytes -= ring.entries.size() * sizeof(HistoryEntry);
+        std::vector<HistoryEntry>().swap(ring.entries);
+        ring.head = 0;
+    }
+}
+
+void History::latest(Channel* channel, size_t limit, std::pmr::vector<HistoryEntry>& out) {
+    std::lock_guard<std::mutex> guard(lock);
+    HistoryRing& ring = channel->history;
+    if (ring.count == 0) return;
+    touch(channel);
+
+    size_t n = std::min(limit, ring.count);
+    for (size_t i = ring.count - n; i < ring.count; ++i) {
+        out.push_back(ring.entries[(ring.head + i) % HISTORY_LINES]);
+    }
+}
+
+void History::before(Channel* channel, uint64_t time_ms, size_t limit, std::pmr::vector<HistoryEntry>& out) {
+    std::lock_guard<std::mutex> guard(lock);
+    HistoryRing& ring = channel->history;
+    if (ring.count == 0) return;
+    touch(channel);
+
+    // Entries are in time order; find the end of the range, then take the
+    // limit entries preceding it
+    size_t end = 0;
+    while (end < ring.count && ring.entries[(ring.head + end) % HISTORY_LINES].time_ms < time_ms) {
+        ++end;
+    }
+    size_t begin = end > limit ? end - limit : 0;
+    for (size_t i = begin; i < end; ++i) {
+        out.push_back(ring.entries[(ring.head + i) % HISTORY_LINES]);
+    }
+}
+
+void History::after(Channel* channel, uint64_t time_ms, size_t limit, std::pmr::vector<HistoryEntry>& out) {
+    std::lock_guard<std::mutex> guard(lock);
+    HistoryRing& ring = channel->history;
+    if (ring.count == 0) return;
+    touch(channel);
+
+    for (size_t i = 0; i < ring.count && out.size() < limit; ++i) {
+        const HistoryEntry& entry = ring.entries[(ring.head + i) % HISTORY_LINES];
+        if (entry.time_ms > time_ms) {
+            out.push_back(entry);
+        }
+    }
+}
+
+void History::forget(Channel* channel) {
+    std::lock_guard<std::mutex> guard(lock);
+    while (channel->history.count > 0) {
+        dropOldest(channel);
+    }
+}
+
+size_t History::bytesUsed() {
+    std::lock_guard<std::mutex> guard(lock);
+    return bytes;
+}
@@ -0,0 +1,68 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <list>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "SharedBuffer.h"
+
+#define HISTORY_LINES 100          // Ring capacity per channel
+#define HISTORY_REPLAY_LINES 20    // Sent to a client when it joins
+
+class Channel;
+
+// A remembered line: the exact bytes that were broadcast, so replaying it
+// is a reference-count bump rather than a re-format
+struct HistoryEntry {
+    uint64_t time_ms;              // Wall-clock time it was sent
+    SharedBuffer line;
+};
+
+// Fixed-capacity ring of one channel's recent PRIVMSG/NOTICE lines. Lives
+// in the Channel but is only touched under History's lock.
+struct HistoryRing {
+    std::vector<HistoryEntry> entries;   // HISTORY_LINES slots once used
+    size_t head = 0;                     // Oldest entry
+    size_t count = 0;
+    std::list<Channel*>::iterator lru;   // Valid while count > 0
+};
+
+// Channel history under one memory budget. When the budget is exceeded,
+// the oldest lines of the least recently used channel go first. Appends
+// come from PRIVMSG/NOTICE under the shared state lock, so this has its
+// own mutex.
+class History {
+public:
+    History(size_t budget);
+
+    bool enabled() const { return budget > 0; }
+
+    void record(Channel* channel, const SharedBuffer& line, uint64_t time_ms);
+
+    // Up to limit entries, oldest first: the newest ones, those sent
+    // strictly before time_ms, or those sent strictly after it. Callers
+    // send the copies after the lock is released.
+    void latest(Channel* channel, size_t limit, std::pmr::vector<HistoryEntry>& out);
+    void before(Channel* channel, uint64_t time_ms, size_t limit, std::pmr::vector<HistoryEntry>& out);
+    void after(Channel* channel, uint64_t time_ms, size_t limit, std::pmr::vector<HistoryEntry>& out);
+
+    // Drop a channel's history before the channel is deleted
+    void forget(Channel* channel);
+
+    size_t bytesUsed();
+
+private:
+    std::mutex lock;
+    size_t budget;
+    size_t bytes;                        // Ring storage plus the lines they hold
+    std::list<Channel*> lru;             // Least recently used first
+
+    void touch(Channel* channel);
+    void dropOldest(Channel* channel);
+    static size_t footprint(const SharedBuffer& line);
+};
+
+#endif // HISTORY_H
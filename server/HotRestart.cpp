@@ -0,0 +1,254 @@
+#include "HotRestart.h"
+#include "IRCServer.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct HandoffHeader {
+    char magic[8];
+    uint64_t snapshot_size;
+    uint32_t fd_count;
+    uint32_t reserved;
+};
+
+bool SnapshotReader::take(void* dest, size_t n) {
+    if (!ok || in.size() < n) {
+        ok = false;
+        return false;
+    }
+    memcpy(dest, in.data(), n);
+    in.remove_prefix(n);
+    return true;
+}
+
+std::string_view SnapshotReader::str() {
+    uint32_t length = u32();
+    if (!ok || in.size() < length) {
+        ok = false;
+        return std::string_view();
+    }
+    std::string_view s = in.substr(0, length);
+    in.remove_prefix(length);
+    return s;
+}
+
+static bool fillAddress(const std::string& path, struct sockaddr_un& addr) {
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        std::cerr << "Upgrade socket path too long: " << path << std::endl;
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+static bool sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool recvAll(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = recv(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+HotRestart::HotRestart(IRCServer* srv, const std::string& socket_path)
+    : server(srv), path(socket_path), listen_fd(-1) {}
+
+HotRestart::~HotRestart() {
+    if (listen_fd >= 0) {
+        // Wakes the blocking accept so the thread can exit
+        shutdown(listen_fd, SHUT_RDWR);
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+}
+
+bool HotRestart::start() {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr)) {
+        return false;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("upgrade socket");
+        return false;
+    }
+
+    // Left behind by a previous run, or by the server we just took over from
+    unlink(path.c_str());
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(listen_fd, 1) == -1) {
+        perror("upgrade bind");
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    thread = std::thread(&HotRestart::run, this);
+    std::cout << "Accepting upgrades on unix socket " << path << std::endl;
+    return true;
+}
+
+void HotRestart::run() {
+    while (true) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        // Only returns if the handoff failed and we are still serving
+        server->handOff(fd);
+        close(fd);
+    }
+}
+
+bool HotRestart::send(int conn, const std::string& snapshot, const std::vector<int>& fds) {
+    HandoffHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, HANDOFF_MAGIC, sizeof header.magic);
+    header.snapshot_size = snapshot.size();
+    header.fd_count = static_cast<uint32_t>(fds.size());
+    if (!sendAll(conn, reinterpret_cast<const char*>(&header), sizeof header)) {
+        perror("handoff send");
+        return false;
+    }
+
+    // Each batch rides on a single byte, so the receiver can read the
+    // stream one byte per batch and never merge two batches' rights
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+    for (size_t at = 0; at < fds.size(); at += HANDOFF_FDS_PER_MESSAGE) {
+        size_t count = std::min(fds.size() - at, static_cast<size_t>(HANDOFF_FDS_PER_MESSAGE));
+        char byte = 'F';
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), &fds[at], sizeof(int) * count);
+
+        ssize_t n;
+        do {
+            n = sendmsg(conn, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n != 1) {
+            perror("handoff sendmsg");
+            return false;
+        }
+    }
+
+    if (!sendAll(conn, snapshot.data(), snapshot.size())) {
+        perror("handoff send");
+        return false;
+    }
+    return true;
+}
+
+bool HotRestart::waitForAck(int conn) {
+    struct pollfd pfd = {conn, POLLIN, 0};
+    int ready;
+    do {
+        ready = poll(&pfd, 1, HANDOFF_ACK_TIMEOUT_S * 1000);
+    } while (ready < 0 && errno == EINTR);
+    char byte;
+    return ready > 0 && recv(conn, &byte, 1, 0) == 1;
+}
+
+bool HotRestart::receive(const std::string& path, int& conn, std::string& snapshot, std::vector<int>& fds) {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr)) {
+        return false;
+    }
+    conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn == -1) {
+        perror("upgrade socket");
+        return false;
+    }
+    if (connect(conn, (struct sockaddr *)&addr, sizeof addr) == -1) {
+        // Nobody to take over from: a cold start
+        close(conn);
+        conn = -1;
+        return false;
+    }
+
+    HandoffHeader header;
+    if (!recvAll(conn, reinterpret_cast<char*>(&header), sizeof header)
+        || memcmp(header.magic, HANDOFF_MAGIC, sizeof header.magic) != 0) {
+        std::cerr << "Handoff from " << path << " failed: bad header" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    fds.reserve(header.fd_count);
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+    while (fds.size() < header.fd_count) {
+        char byte;
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        ssize_t n;
+        do {
+            n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n != 1 || (msg.msg_flags & MSG_CTRUNC)) {
+            // Typically the descriptor limit; raise it to match the old process
+            std::cerr << "Handoff from " << path << " failed after " << fds.size() << " of "
+                      << header.fd_count << " sockets" << (n == 1 ? " (fd limit?)" : "") << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+                fds.insert(fds.end(), received, received + count);
+            }
+        }
+    }
+
+    snapshot.resize(header.snapshot_size);
+    if (!recvAll(conn, &snapshot[0], snapshot.size())) {
+        std::cerr << "Handoff from " << path << " failed: snapshot truncated" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool HotRestart::acknowledge(int conn) {
+    char byte = 'R';
+    bool ok = sendAll(conn, &byte, 1);
+    close(conn);
+    return ok;
+}
@@ -0,0 +1,78 @@
+#ifndef HOTRESTART_H
+#define HOTRESTART_H
+
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+#define HANDOFF_MAGIC "IRCHOT2"
+#define HANDOFF_FDS_PER_MESSAGE 250      // Below the kernel's SCM_MAX_FD of 253
+#define HANDOFF_ACK_TIMEOUT_S 60         // How long the new process may take to restore
+
+class IRCServer;
+
+// Flat little-endian encoding for the handoff snapshot
+struct SnapshotWriter {
+    std::string out;
+
+    void u8(uint8_t v) { out.push_back(static_cast<char>(v)); }
+    void u32(uint32_t v) { out.append(reinterpret_cast<const char*>(&v), sizeof v); }
+    void u64(uint64_t v) { out.append(reinterpret_cast<const char*>(&v), sizeof v); }
+    void str(std::string_view s) { u32(static_cast<uint32_t>(s.size())); out.append(s); }
+};
+
+// Reads what SnapshotWriter wrote. Running past the end clears ok and
+// yields zeros, so callers check ok once at the end.
+struct SnapshotReader {
+    std::string_view in;
+    bool ok = true;
+
+    bool take(void* dest, size_t n);
+    uint8_t u8() { uint8_t v = 0; take(&v, sizeof v); return v; }
+    uint32_t u32() { uint32_t v = 0; take(&v, sizeof v); return v; }
+    uint64_t u64() { uint64_t v = 0; take(&v, sizeof v); return v; }
+    std::string_view str();
+};
+
+// Zero-downtime upgrade. The running server listens on a Unix socket; a
+// new binary started with the same --upgrade-socket connects to it, and
+// the old server pauses its shards, sends a snapshot of the IRC state plus
+// every listening and client socket (SCM_RIGHTS), and exits once the new
+// one has restored them. Connections never close, so clients see nothing
+// but a short pause. TLS connections are the exception: their session
+// state cannot leave OpenSSL, so they drop, and resume on reconnect with
+// tickets the successor can still open.
+//
+// Protocol, old to new: a HandoffHeader, the fds in batches of
+// HANDOFF_FDS_PER_MESSAGE (each riding on one byte), then the snapshot.
+// New to old: one byte once the state is restored. If the new process
+// goes away before that, the old one resumes.
+class HotRestart {
+public:
+    HotRestart(IRCServer* server, const std::string& path);
+    ~HotRestart();
+
+    // Bind the socket and wait for a successor; false if it cannot be set up
+    bool start();
+
+    // Successor side: take over from a server listening on path. False,
+    // with nothing received, if no server is listening there.
+    static bool receive(const std::string& path, int& conn, std::string& snapshot, std::vector<int>& fds);
+    static bool acknowledge(int conn);
+
+    // Predecessor side, used by IRCServer::handOff
+    static bool send(int conn, const std::string& snapshot, const std::vector<int>& fds);
+    static bool waitForAck(int conn);
+
+private:
+    IRCServer* server;
+    std::string path;
+    int listen_fd;
+    std::thread thread;
+
+    void run();
+};
+
+#endif // HOTRESTART_H
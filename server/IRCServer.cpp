@@ -1,580 +1,1207 @@
 #include "IRCServer.h"
 #include <iostream>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <algorithm>
+#include <cstdio>
 #include <cstring>
-#include <sys/socket.h>
-#include <sys/select.h>
-#include <cerrno>
+#include <algorithm>
+#include <memory_resource>
+#include <mutex>
+#include <thread>
 #include <netdb.h>
+#include <unistd.h>
 
-IRCServer::IRCServer() : server_fd(0), max_sd(0) {}
+// Flood-control cost of each command, in tokens. Broadcasts also cost one
+// token per FANOUT_PER_TOKEN recipients, so a line to a big channel
+// drains the bucket faster than one to a small channel.
+static const unsigned command_costs[CMD_COUNT] = {
+    1,  // NICK
+    1,  // USER
+    1,  // PING
+    2,  // JOIN
+    1,  // PRIVMSG
+    1,  // PART
+    0,  // QUIT
+    1,  // NOTICE
+    1,  // OPER
+    2,  // STATS
+    2,  // CHATHISTORY
+    1,  // PASS
+    1,  // SERVER
+    0,  // PONG
+    1,  // NAMES
+    1,  // UNKNOWN
+};
+#define FANOUT_PER_TOKEN 32
+
+IRCServer::IRCServer(const ServerConfig& cfg)
+    : config(cfg), metrics_endpoint(nullptr), message_log(nullptr), fanout(nullptr), hot_restart(nullptr), tls(nullptr), start_time(time(NULL)),
+      visit_epoch(0), history(cfg.history_budget), pausing(false), parked(0) {}
 
 IRCServer::~IRCServer() {
-    for (auto client : clients) {
-        close(client->fd);
-        delete client;
+    delete hot_restart;
+    delete metrics_endpoint;
+    for (Shard* shard : shards) {
+        delete shard;
     }
+    delete message_log;
+    Channel::fanout = nullptr;
+    delete fanout;
+    delete tls;
     for (auto& pair : channels) {
         delete pair.second;
     }
-    if (server_fd > 0) {
-        close(server_fd);
-    }
 }
 
 void IRCServer::start() {
-    setupServerSocket();
-    std::cout << "IRC Server started, listening on port " << PORT << std::endl;
-
-    while (true) {
-        prepareSelect();
-        int activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
-
-        if (activity < 0 && errno != EINTR) {
-            perror("select error");
-            break;
+    setServerName(config.server_name);
+    for (const std::string& link : config.links) {
+        // Looked up now rather than on each attempt: shard 0 makes the
+        // attempts, and a slow resolver would stall it
+        size_t colon = link.rfind(':');
+        OutgoingLink entry = {link.substr(0, colon), {}, 0, nullptr, 0};
+        struct addrinfo hints = {}, *res;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int rv = getaddrinfo(entry.host.c_str(), link.c_str() + colon + 1, &hints, &res);
+        if (rv != 0) {
+            std::cerr << "Cannot resolve link " << link << ": " << gai_strerror(rv) << std::endl;
+            exit(EXIT_FAILURE);
         }
-
-        handleNewConnections();
-        handleClientMessages();
+        memcpy(&entry.address, res->ai_addr, res->ai_addrlen);
+        entry.address_length = res->ai_addrlen;
+        freeaddrinfo(res);
+        outgoing.push_back(entry);
     }
-}
-
-void IRCServer::setupServerSocket() {
-    struct addrinfo hints, *res, *p;
-    int yes = 1;
-    int rv;
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET6; // Use AF_INET6 for IPv6
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE; // Use my IP
-
-    if ((rv = getaddrinfo(NULL, std::to_string(PORT).c_str(), &hints, &res)) != 0) {
-        std::cerr << "getaddrinfo: " << gai_strerror(rv) << std::endl;
+    if (!registration_burst.load(config.motd_file)) {
         exit(EXIT_FAILURE);
     }
-
-    // Loop through all the results and bind to the first we can
-    for(p = res; p != NULL; p = p->ai_next) {
-        if ((server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("socket");
-            continue;
+    // With one shard every member is the sender's own, which only the
+    // sender's thread may queue to, so the pool would have nothing to do
+    if (config.fanout_workers > 0 && config.threads > 1) {
+        fanout = new FanoutPool(config.fanout_workers, config.fanout_threshold);
+        Channel::fanout = fanout;
+    }
+    if (!config.tls_cert.empty()) {
+        tls = new TlsContext();
+        if (!tls->init(config.tls_cert, config.tls_key, config.ktls)) {
+            exit(EXIT_FAILURE);
         }
+    }
 
-        // Allow both IPv4 and IPv6
-        if (p->ai_family == AF_INET6) {
-            if (setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(int)) == -1) {
-                perror("setsockopt");
-                exit(EXIT_FAILURE);
-            }
+    // A server already listening on the upgrade socket hands over to us
+    int handoff = -1;
+    std::string state;
+    std::vector<int> inherited;
+    if (!config.upgrade_socket.empty() && HotRestart::receive(config.upgrade_socket, handoff, state, inherited)) {
+        restore(state, inherited);
+        // The previous server stopped its log before sending its state, so
+        // its last segment is closed and ours comes after it. Failing here
+        // leaves it unacknowledged, and it carries on serving.
+        startMessageLog();
+        if (!HotRestart::acknowledge(handoff)) {
+            // It may still be serving; two processes on one socket is worse than none
+            std::cerr << "Previous server went away during the handoff" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        startMessageLog();
+        for (int i = 0; i < config.threads; ++i) {
+            shards.push_back(new Shard(this, i, config, tls));
         }
+    }
 
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-            perror("setsockopt");
+    if (!config.metrics_socket.empty()) {
+        metrics_endpoint = new MetricsEndpoint(this, config.metrics_socket);
+        if (!metrics_endpoint->start()) {
             exit(EXIT_FAILURE);
         }
-
-        if (bind(server_fd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(server_fd);
-            perror("bind");
-            continue;
+    }
+    if (!config.upgrade_socket.empty()) {
+        hot_restart = new HotRestart(this, config.upgrade_socket);
+        if (!hot_restart->start()) {
+            exit(EXIT_FAILURE);
         }
-
-        break;
     }
+    std::cout << "IRC Server started, listening on port " << config.port;
+    if (tls) {
+        std::cout << " (TLS " << config.tls_port << ")";
+    }
+    std::cout << " with " << shards.size() << " thread(s)" << std::endl;
 
-    if (p == NULL)  {
-        std::cerr << "Failed to bind" << std::endl;
-        exit(EXIT_FAILURE);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < shards.size(); ++i) {
+        threads.emplace_back(&Shard::run, shards[i]);
     }
+    shards[0]->run();
 
-    freeaddrinfo(res); // All done with this structure
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
 
-    if (listen(server_fd, SOMAXCONN) == -1) {
-        perror("listen");
+void IRCServer::startMessageLog() {
+    if (config.log_dir.empty()) return;
+    message_log = new MessageLog(config.log_dir, config.log_fsync_ms);
+    if (!message_log->start()) {
         exit(EXIT_FAILURE);
     }
-
-    max_sd = server_fd;
 }
 
-void IRCServer::prepareSelect() {
-    FD_ZERO(&readfds);
-    FD_SET(server_fd, &readfds);
-    max_sd = server_fd;
+void IRCServer::unlinkClient(Client* client) {
+    std::unique_lock<std::shared_mutex> lock(state_lock);
 
-    for (auto client : clients) {
-        int sd = client->fd;
-        if (sd > 0) {
-            FD_SET(sd, &readfds);
-        }
-        if (sd > max_sd) {
-            max_sd = sd;
+    if (client->is_link) {
+        dropLink(client);
+    }
+    for (OutgoingLink& link : outgoing) {
+        if (link.client == client) {
+            link.client = nullptr;
+            link.next_attempt = monotonicNs() + LINK_RETRY_MS * 1000000ull;
         }
     }
+
+    // A killed client has already been removed, nickname and all
+    SharedBuffer quit_line = formatLine({":", client->nickname, " QUIT :", client->quit_reason, "\r\n"});
+    if (client->registered && !client->nickname.empty()) {
+        propagate(quit_line, nullptr);
+    }
+    removeUser(client, quit_line);
 }
 
-void IRCServer::handleNewConnections() {
-    if (FD_ISSET(server_fd, &readfds)) {
-        struct sockaddr_storage remoteaddr; // Generic address structure
-        socklen_t addrlen = sizeof remoteaddr;
+// Tell everyone who shares a channel, once each, then leave only the
+// channels the user is actually in and release the nickname
+void IRCServer::removeUser(Client* user, const SharedBuffer& quit_line) {
+    if (!user->channels.empty()) {
+        broadcastToPeers(user, quit_line, false);
 
-        int new_socket = accept(server_fd, (struct sockaddr *)&remoteaddr, &addrlen);
-        if (new_socket == -1) {
-            perror("accept");
-            return;
+        while (!user->channels.empty()) {
+            leaveChannel(user, user->channels.back());
         }
+    }
 
-        // Create new client
-        Client* new_client = new Client(new_socket);
-
-        // Get the remote IP address
-        char remoteIP[INET6_ADDRSTRLEN];
-        void *addr;
-        if (remoteaddr.ss_family == AF_INET) {
-            struct sockaddr_in *s = (struct sockaddr_in *)&remoteaddr;
-            addr = &(s->sin_addr);
-        } else { // AF_INET6
-            struct sockaddr_in6 *s = (struct sockaddr_in6 *)&remoteaddr;
-            addr = &(s->sin6_addr);
+    if (!user->nickname.empty()) {
+        auto it = nicknames.find(user->nickname);
+        if (it != nicknames.end() && it->second == user) {
+            nicknames.erase(it);
         }
-        inet_ntop(remoteaddr.ss_family, addr, remoteIP, sizeof remoteIP);
-        new_client->hostname = remoteIP;
-
-        clients.push_back(new_client);
+    }
+}
 
-        std::cout << "New connection, socket fd: " << new_socket
-                  << ", IP: " << new_client->hostname << std::endl;
+bool IRCServer::admitConnection(const std::string& ip) {
+    if (config.max_per_ip <= 0) return true;
+    std::lock_guard<std::mutex> lock(admission_lock);
+    int& count = connections_per_ip[ip];
+    if (count >= config.max_per_ip) {
+        return false;
+    }
+    ++count;
+    return true;
+}
 
-        std::string welcome = ":miniircd NOTICE AUTH :Welcome to miniircd!\r\n";
-        new_client->sendMessage(welcome);
+void IRCServer::releaseConnection(const std::string& ip) {
+    if (config.max_per_ip <= 0) return;
+    std::lock_guard<std::mutex> lock(admission_lock);
+    auto it = connections_per_ip.find(ip);
+    if (it != connections_per_ip.end() && --it->second <= 0) {
+        connections_per_ip.erase(it);
     }
 }
 
-void IRCServer::handleClientMessages() {
-    char buffer[BUFFER_SIZE + 1];
+void IRCServer::pauseShards() {
+    std::unique_lock<std::mutex> lock(pause_lock);
+    pausing.store(true, std::memory_order_relaxed);
+    for (Shard* shard : shards) {
+        shard->wake();
+    }
+    pause_cv.wait(lock, [this] { return parked == shards.size(); });
+}
 
-    for (auto it = clients.begin(); it != clients.end();) {
-        Client* client = *it;
-        int sd = client->fd;
+void IRCServer::resumeShards() {
+    std::lock_guard<std::mutex> lock(pause_lock);
+    pausing.store(false, std::memory_order_relaxed);
+    pause_cv.notify_all();
+}
 
-        if (FD_ISSET(sd, &readfds)) {
-            int valread = recv(sd, buffer, BUFFER_SIZE, 0);
+void IRCServer::parkShard() {
+    std::unique_lock<std::mutex> lock(pause_lock);
+    ++parked;
+    pause_cv.notify_all();
+    pause_cv.wait(lock, [this] { return !pausing.load(std::memory_order_relaxed); });
+    --parked;
+}
 
-            if (valread <= 0) {
-                // Client disconnected or error
-                std::cout << "Client disconnected, fd: " << sd << std::endl;
-                client->disconnecting = true;
-            } else {
-                buffer[valread] = '\0';
-                std::string data(buffer);
-
-                // Handle multiple commands separated by \r\n
-                size_t pos = 0;
-                std::string delimiter = "\r\n";
-                while ((pos = data.find(delimiter)) != std::string::npos) {
-                    std::string line = data.substr(0, pos);
-                    data.erase(0, pos + delimiter.length());
-                    processCommand(client, line);
-
-                    if (client->disconnecting) {
-                        // Client marked for disconnection
-                        break;
-                    }
-                }
-            }
-        }
+void IRCServer::handOff(int conn) {
+    std::cout << "Successor connected, handing off" << std::endl;
+    uint64_t started = monotonicNs();
+    pauseShards();
+    // The successor opens its log segment once it has our state, and must
+    // not find us still writing to the directory
+    if (message_log) {
+        message_log->stop();
+    }
 
-        if (client->disconnecting) {
-            // Remove client from all channels
-            for (auto it_channel = channels.begin(); it_channel != channels.end();) {
-                Channel* channel = it_channel->second;
-                channel->removeClient(client);
+    std::vector<int> fds;
+    size_t client_count;
+    std::string state;
+    {
+        // Parked shards hold no locks; this keeps metrics scrapes out too.
+        // Only shard threads change shared state, so it stays as captured
+        // without the lock while the successor takes its time.
+        std::unique_lock<std::shared_mutex> lock(state_lock);
+        state = snapshot(fds, client_count);
+    }
+    uint64_t captured = monotonicNs();
+
+    if (HotRestart::send(conn, state, fds) && HotRestart::waitForAck(conn)) {
+        uint64_t done = monotonicNs();
+        std::cout << "Handed off " << client_count << " clients in a " << state.size() << " byte snapshot; paused "
+                  << (done - started) / 1e6 << " ms (snapshot " << (captured - started) / 1e6 << " ms)" << std::endl;
+        // Every socket belongs to the successor now; leave without
+        // destructors, which would close what it is using
+        _exit(0);
+    }
 
-                // Notify other channel members
-                std::string part_msg = ":" + client->nickname + " PART " + channel->name + "\r\n";
-                channel->broadcast(part_msg, client);
+    std::cerr << "Handoff failed, resuming service" << std::endl;
+    // In a new segment, in case the successor got as far as opening one
+    if (message_log && !message_log->start()) {
+        std::cerr << "Cannot restart the message log; channel traffic is not logged" << std::endl;
+    }
+    resumeShards();
+}
 
-                // If channel is empty, delete it
-                if (channel->clients.empty()) {
-                    delete channel;
-                    it_channel = channels.erase(it_channel);
-                } else {
-                    ++it_channel;
-                }
-            }
+// What a successor needs to carry on serving our own clients: each shard's
+// listeners, each client's socket, identity and unsent bytes, and each
+// channel's local members and history. Links, and the users behind them,
+// are left out; the successor links up again and gets a fresh burst. So
+// are TLS clients, whose session keys live in OpenSSL: they are closed
+// with this process and reconnect, and the ticket keys go along so that
+// they can resume their sessions.
+// Shards must be parked and state_lock held exclusively.
+std::string IRCServer::snapshot(std::vector<int>& fds, size_t& client_count) {
+    SnapshotWriter out;
+    out.u32(static_cast<uint32_t>(shards.size()));
+    out.u8(tls != nullptr);
+    if (tls) {
+        out.str(tls->ticketKeys());
+    }
+    for (Shard* shard : shards) {
+        fds.push_back(shard->listener());
+    }
+    if (tls) {
+        for (Shard* shard : shards) {
+            fds.push_back(shard->tlsListener());
+        }
+    }
 
-            // Remove client
-            close(sd);
-            delete client;
-            it = clients.erase(it);
-        } else {
-            ++it;
+    std::vector<Client*> local;
+    std::unordered_map<Client*, uint32_t> numbers;
+    for (Shard* shard : shards) {
+        shard->settle();
+        for (const auto& pair : shard->connections()) {
+            Client* client = pair.second;
+            if (client->is_link || client->link_outgoing || client->disconnecting || client->ssl) continue;
+            numbers[client] = static_cast<uint32_t>(local.size());
+            local.push_back(client);
+            fds.push_back(client->fd);
         }
     }
-}
 
-void IRCServer::disconnectClient(std::vector<Client*>::iterator& it) {
-    Client* client = *it;
-    std::cout << "Client disconnected, fd: " << client->fd << ", nickname: " << client->nickname << std::endl;
+    out.u32(static_cast<uint32_t>(local.size()));
+    std::string pending;
+    for (Client* client : local) {
+        out.u32(static_cast<uint32_t>(client->shard->index));
+        out.str(client->nickname);
+        out.str(client->username);
+        out.str(client->realname);
+        out.str(client->hostname);
+        out.str(client->ip);
+        out.str(client->link_password);
+        out.u8(client->registered);
+        out.u8(client->oper);
+        out.u64(static_cast<uint64_t>(client->nick_ts));
+        uint64_t tokens;
+        memcpy(&tokens, &client->flood_tokens, sizeof tokens);
+        out.u64(tokens);
+        out.str(client->recvbuf.unread());
+
+        // Output not yet written, from where the last write stopped
+        pending.clear();
+        for (size_t i = 0; i < client->sendq.size(); ++i) {
+            const SharedBuffer& line = client->sendq[i];
+            size_t skip = i == 0 ? client->sendq_offset : 0;
+            pending.append(line.data() + skip, line.length() - skip);
+        }
+        out.str(pending);
+    }
 
-    // Notify other clients
-    std::string quit_msg = ":" + client->nickname + " QUIT :Client disconnected\r\n";
-    broadcastToAll(quit_msg, client);
+    std::vector<Channel*> kept;
+    for (const auto& pair : channels) {
+        for (Client* member : pair.second->clients) {
+            if (numbers.count(member)) {
+                kept.push_back(pair.second);
+                break;
+            }
+        }
+    }
+    out.u32(static_cast<uint32_t>(kept.size()));
+    std::vector<uint32_t> members;
+    std::pmr::vector<HistoryEntry> entries;
+    for (Channel* channel : kept) {
+        out.str(channel->name);
+        members.clear();
+        for (Client* member : channel->clients) {
+            auto it = numbers.find(member);
+            if (it != numbers.end()) {
+                members.push_back(it->second);
+            }
+        }
+        out.u32(static_cast<uint32_t>(members.size()));
+        for (uint32_t number : members) {
+            out.u32(number);
+        }
 
-    // Remove from all channels
-    for (auto& pair : channels) {
-        pair.second->removeClient(client);
-        // Delete empty channels
-        if (pair.second->clients.empty()) {
-            delete pair.second;
-            channels.erase(pair.first);
-        }
-    }
-
-    close(client->fd);
-    delete client;
-    it = clients.erase(it);
-}
-
-void IRCServer::disconnectClient(Client* client) {
-    client->disconnecting = true;
-}
-
-void IRCServer::processCommand(Client* client, const std::string& command_line) {
-    if (command_line.empty()) return;
-
-    std::string command;
-    std::vector<std::string> params;
-    parseCommand(command_line, command, params);
-
-    if (command == "NICK") {
-        handleNICK(client, params);
-    } else if (command == "USER") {
-        handleUSER(client, params);
-    } else if (command == "PING") {
-        handlePING(client, params);
-    } else if (command == "JOIN") {
-        handleJOIN(client, params);
-    } else if (command == "PRIVMSG") {
-        handlePRIVMSG(client, params);
-    } else if (command == "PART") {
-        handlePART(client, params);
-    } else if (command == "QUIT") {
-        handleQUIT(client, params);
-    } else if (command == "NOTICE") {
-        handleNOTICE(client, params);
-    } else {
-        std::string unknown = ":miniircd 421 " + client->nickname + " " + command + " :Unknown command\r\n";
-        client->sendMessage(unknown);
+        entries.clear();
+        history.latest(channel, HISTORY_LINES, entries);
+        out.u32(static_cast<uint32_t>(entries.size()));
+        for (const HistoryEntry& entry : entries) {
+            out.u64(entry.time_ms);
+            out.str(std::string_view(entry.line.data(), entry.line.length()));
+        }
     }
+
+    client_count = local.size();
+    return std::move(out.out);
 }
 
-void IRCServer::parseCommand(const std::string& line, std::string& command, std::vector<std::string>& params) {
-    size_t pos = 0;
-    std::string token;
-    std::string s = line;
-    std::string prefix;
+// Rebuild shards, clients, nicknames and channels from a predecessor's
+// snapshot, on the sockets it passed. Runs before any shard thread starts;
+// a bad snapshot exits, and the predecessor resumes.
+void IRCServer::restore(const std::string& state, const std::vector<int>& fds) {
+    SnapshotReader in{state};
+    uint32_t shard_count = in.u32();
+    bool had_tls = in.u8() != 0;
+    if (had_tls) {
+        std::string_view keys = in.str();
+        if (tls && !tls->setTicketKeys(keys)) {
+            std::cerr << "Cannot reuse the previous server's session ticket keys" << std::endl;
+        }
+    }
+    size_t listeners = static_cast<size_t>(shard_count) * (had_tls ? 2 : 1);
+    if (shard_count == 0 || listeners > fds.size()) {
+        std::cerr << "Handoff snapshot is corrupt" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (static_cast<int>(shard_count) != config.threads) {
+        // Clients stay on the shard that owned them
+        std::cout << "Keeping the previous server's " << shard_count << " thread(s)" << std::endl;
+    }
+    for (uint32_t i = 0; i < shard_count; ++i) {
+        // TLS listeners are kept if we serve TLS too, bound afresh if only we do
+        int tls_fd = had_tls ? fds[shard_count + i] : -1;
+        if (tls_fd >= 0 && !tls) {
+            close(tls_fd);
+            tls_fd = -1;
+        }
+        shards.push_back(new Shard(this, static_cast<int>(i), config, tls, fds[i], tls_fd));
+    }
 
-    // Skip leading spaces
-    s.erase(0, s.find_first_not_of(" "));
+    uint32_t client_count = in.u32();
+    if (listeners + client_count != fds.size()) {
+        in.ok = false;
+    }
+    std::vector<Client*> restored;
+    restored.reserve(client_count);
+    uint64_t now = monotonicNs();
+    for (uint32_t i = 0; i < client_count && in.ok; ++i) {
+        uint32_t shard = in.u32();
+        if (shard >= shard_count) {
+            in.ok = false;
+            break;
+        }
+        Client* client = new Client(fds[listeners + i], shards[shard], config.sendq_limit);
+        client->nickname = std::string(in.str());
+        client->username = std::string(in.str());
+        client->realname = std::string(in.str());
+        client->hostname = std::string(in.str());
+        client->ip = std::string(in.str());
+        client->link_password = std::string(in.str());
+        client->registered = in.u8() != 0;
+        client->oper = in.u8() != 0;
+        client->nick_ts = static_cast<time_t>(in.u64());
+        uint64_t tokens = in.u64();
+        memcpy(&client->flood_tokens, &tokens, sizeof tokens);
+        client->flood_refill_ns = now;
+
+        std::string_view input = in.str();
+        while (!input.empty()) {
+            char* dest = client->recvbuf.writePtr();
+            size_t n = std::min(input.size(), client->recvbuf.writable());
+            if (n == 0) break;
+            memcpy(dest, input.data(), n);
+            client->recvbuf.commit(n);
+            input.remove_prefix(n);
+        }
+        std::string_view output = in.str();
+        if (!output.empty()) {
+            client->enqueue(makeSharedBuffer(output));
+        }
 
-    // Check for prefix
-    if (!s.empty() && s[0] == ':') {
-        pos = s.find(' ');
-        if (pos != std::string::npos) {
-            prefix = s.substr(1, pos - 1);
-            s.erase(0, pos + 1);
-        } else {
-            // Malformed message; no command after prefix
-            return;
+        if (!client->nickname.empty()) {
+            nicknames[client->nickname] = client;
+        }
+        if (config.max_per_ip > 0 && !client->ip.empty()) {
+            ++connections_per_ip[client->ip];
         }
+        shards[shard]->adopt(client);
+        restored.push_back(client);
     }
 
-    // Skip leading spaces
-    s.erase(0, s.find_first_not_of(" "));
+    uint32_t channel_count = in.u32();
+    for (uint32_t i = 0; i < channel_count && in.ok; ++i) {
+        Channel* channel = new Channel(std::string(in.str()));
+        channels[channel->name] = channel;
+        uint32_t member_count = in.u32();
+        for (uint32_t j = 0; j < member_count && in.ok; ++j) {
+            uint32_t number = in.u32();
+            if (number < restored.size()) {
+                channel->addClient(restored[number]);
+            } else {
+                in.ok = false;
+            }
+        }
+        uint32_t line_count = in.u32();
+        for (uint32_t j = 0; j < line_count && in.ok; ++j) {
+            uint64_t time_ms = in.u64();
+            std::string_view line = in.str();
+            if (in.ok) {
+                history.record(channel, makeSharedBuffer(line), time_ms);
+            }
+        }
+    }
 
-    // Extract command
-    pos = s.find(' ');
-    if (pos != std::string::npos) {
-        command = s.substr(0, pos);
-        s.erase(0, pos + 1);
-    } else {
-        command = s;
-        return;
+    if (!in.ok) {
+        std::cerr << "Handoff snapshot is corrupt" << std::endl;
+        exit(EXIT_FAILURE);
     }
+    std::cout << "Took over " << restored.size() << " clients and " << channel_count
+              << " channels from the previous server" << std::endl;
+}
 
-    // Extract parameters
-    while (!s.empty()) {
-        // Skip leading spaces
-        s.erase(0, s.find_first_not_of(" "));
-        if (s.empty()) break;
+unsigned IRCServer::processCommand(Client* client, std::string_view command_line) {
+    if (client->is_link) {
+        processLinkLine(client, command_line);
+        return 0;
+    }
 
-        if (s[0] == ':') {
-            params.push_back(s.substr(1));
-            break;
-        }
+    Message msg;
+    if (!parseMessage(command_line, msg)) return 1;
+
+    // Perfect-hash dispatch; the name check rejects unknown commands that
+    // happen to share a hash with a known one
+    CommandHandler handler = nullptr;
+    CommandId id = CMD_UNKNOWN;
+    bool exclusive = true;
+    switch (commandHash(msg.command)) {
+    case commandHash("NICK"):    handler = &IRCServer::handleNICK;    id = CMD_NICK;    break;
+    case commandHash("USER"):    handler = &IRCServer::handleUSER;    id = CMD_USER;    break;
+    case commandHash("PING"):    handler = &IRCServer::handlePING;    id = CMD_PING;    exclusive = false; break;
+    case commandHash("JOIN"):    handler = &IRCServer::handleJOIN;    id = CMD_JOIN;    break;
+    case commandHash("PRIVMSG"): handler = &IRCServer::handlePRIVMSG; id = CMD_PRIVMSG; exclusive = false; break;
+    case commandHash("PART"):    handler = &IRCServer::handlePART;    id = CMD_PART;    break;
+    case commandHash("QUIT"):    handler = &IRCServer::handleQUIT;    id = CMD_QUIT;    break;
+    case commandHash("NOTICE"):  handler = &IRCServer::handleNOTICE;  id = CMD_NOTICE;  exclusive = false; break;
+    case commandHash("OPER"):    handler = &IRCServer::handleOPER;    id = CMD_OPER;    exclusive = false; break;
+    case commandHash("STATS"):   handler = &IRCServer::handleSTATS;   id = CMD_STATS;   exclusive = false; break;
+    case commandHash("CHATHISTORY"): handler = &IRCServer::handleCHATHISTORY; id = CMD_CHATHISTORY; exclusive = false; break;
+    case commandHash("PASS"):    handler = &IRCServer::handlePASS;    id = CMD_PASS;    break;
+    case commandHash("SERVER"):  handler = &IRCServer::handleSERVER;  id = CMD_SERVER;  break;
+    case commandHash("PONG"):    handler = &IRCServer::handlePONG;    id = CMD_PONG;    exclusive = false; break;
+    case commandHash("NAMES"):   handler = &IRCServer::handleNAMES;   id = CMD_NAMES;   exclusive = false; break;
+    }
 
-        pos = s.find(' ');
-        if (pos != std::string::npos) {
-            token = s.substr(0, pos);
-            s.erase(0, pos + 1);
+    uint64_t started = monotonicNs();
+    client->fanout = 0;
+    client->targets = 1;
+    if (id != CMD_PING && id != CMD_PONG) {
+        client->last_message_ns = started;
+    }
+    if (handler && equalsIgnoreCase(msg.command, command_names[id])) {
+        // Commands that only read shared state run concurrently across shards
+        if (exclusive) {
+            std::unique_lock<std::shared_mutex> lock(state_lock);
+            (this->*handler)(client, msg);
         } else {
-            token = s;
-            s.clear();
+            std::shared_lock<std::shared_mutex> lock(state_lock);
+            (this->*handler)(client, msg);
         }
-        params.push_back(token);
+    } else {
+        client->sendMessage(formatReply(ERR_UNKNOWNCOMMAND, client->nickname, msg.command));
+        id = CMD_UNKNOWN;
     }
+#ifndef NO_COMMAND_METRICS
+    // -DNO_COMMAND_METRICS leaves this out, to measure what it costs
+    // (bot/metricsbench.cpp)
+    client->shard->metrics.command_ns[id].record(monotonicNs() - started);
+#endif
+    return command_costs[id] * static_cast<unsigned>(client->targets) + static_cast<unsigned>(client->fanout / FANOUT_PER_TOKEN);
 }
 
-void IRCServer::handleNICK(Client* client, const std::vector<std::string>& params) {
-    if (params.empty()) {
-        std::string error = ":miniircd 431 * :No nickname given\r\n";
-        client->sendMessage(error);
+void IRCServer::handleNICK(Client* client, const Message& msg) {
+    if (msg.param_count == 0) {
+        client->sendMessage(formatReply(ERR_NONICKNAMEGIVEN, "*"));
         return;
     }
 
-    std::string nick = params[0];
+    std::string_view nick = msg.params[0];
 
     // Validate nickname format
     if (!isValidNickname(nick)) {
-        std::string error = ":miniircd 432 * " + nick + " :Erroneous nickname\r\n";
-        client->sendMessage(error);
+        client->sendMessage(formatReply(ERR_ERRONEUSNICKNAME, "*", nick));
         return;
     }
 
-    // Check if nickname is already in use
-    for (auto c : clients) {
-        if (c->nickname == nick && c != client) {
-            std::string error = ":miniircd 433 * " + nick + " :Nickname is already in use\r\n";
-            client->sendMessage(error);
-            return;
-        }
+    // Check if nickname is already in use, ignoring case
+    auto it = nicknames.find(nick);
+    if (it != nicknames.end() && it->second != client) {
+        client->sendMessage(formatReply(ERR_NICKNAMEINUSE, "*", nick));
+        return;
     }
 
-    // Notify others if nickname changes
+    // Notify the client, everyone sharing a channel with it, and the rest
+    // of the network
+    time_t now = time(NULL);
     if (!client->nickname.empty() && client->registered) {
-        std::string nick_change = ":" + client->nickname + " NICK :" + nick + "\r\n";
-        broadcastToAll(nick_change, client);
+        std::string nick_change = ":" + client->nickname + " NICK :" + std::string(nick) + "\r\n";
+        broadcastToPeers(client, makeSharedBuffer(nick_change), true);
+        propagate(formatLine({":", client->nickname, " NICK ", nick, " ", std::to_string(now), "\r\n"}), nullptr);
     }
 
-    client->nickname = nick;
+    // The index key views the nickname, so drop it before the name changes
+    if (!client->nickname.empty()) {
+        nicknames.erase(client->nickname);
+    }
+    client->nickname = std::string(nick);
+    client->nick_ts = now;
+    nicknames[client->nickname] = client;
+    renamed(client);
     checkRegistration(client);
 }
 
-void IRCServer::handleUSER(Client* client, const std::vector<std::string>& params) {
-    if (params.size() < 4) {
-        std::string error = ":miniircd 461 * USER :Not enough parameters\r\n";
-        client->sendMessage(error);
+void IRCServer::handleUSER(Client* client, const Message& msg) {
+    if (msg.param_count < 4) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, "*", "USER"));
         return;
     }
 
     if (client->registered) {
-        std::string error = ":miniircd 462 * :You may not reregister\r\n";
-        client->sendMessage(error);
+        client->sendMessage(formatReply(ERR_ALREADYREGISTRED, "*"));
         return;
     }
 
-    client->username = params[0];
-    client->hostname = params[1]; // Typically the hostname
-    client->realname = params[3];
+    client->username = std::string(msg.params[0]);
+    client->hostname = std::string(msg.params[1]); // Typically the hostname
+    client->realname = std::string(msg.params[3]);
     checkRegistration(client);
 }
 
-void IRCServer::handlePING(Client* client, const std::vector<std::string>& params) {
-    if (params.empty()) {
-        std::string error = ":miniircd 409 " + client->nickname + " :No origin specified\r\n";
-        client->sendMessage(error);
+void IRCServer::handlePING(Client* client, const Message& msg) {
+    if (msg.param_count == 0) {
+        client->sendMessage(formatReply(ERR_NOORIGIN, client->nickname));
         return;
     }
-    std::string response = ":" + client->nickname + " PONG miniircd :" + params[0] + "\r\n";
-    client->sendMessage(response);
+    client->sendMessage(formatLine({":", client->nickname, " PONG ", config.server_name, " :", msg.params[0], "\r\n"}));
 }
 
-void IRCServer::handleJOIN(Client* client, const std::vector<std::string>& params) {
-    if (params.empty()) {
-        std::string error = ":miniircd 461 " + client->nickname + " JOIN :Not enough parameters\r\n";
-        client->sendMessage(error);
-        return;
+void IRCServer::handlePONG(Client*, const Message&) {
+    // Any input proves the client alive, and the shard has already noted
+    // it; accepting PONG just keeps it from being an unknown command
+}
+
+// Takes the next item of a comma-separated list, skipping empty ones
+static bool nextItem(std::string_view& list, std::string_view& item) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        item = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        if (!item.empty()) return true;
     }
+    return false;
+}
 
-    std::string channel_name = params[0];
-    if (channel_name[0] != '#') {
-        std::string error = ":miniircd 476 " + client->nickname + " " + channel_name + " :Invalid channel name\r\n";
-        client->sendMessage(error);
+// JOIN, PRIVMSG and NOTICE are the hot path: replies are formatted straight
+// into pooled line buffers and any scratch space comes from the shard's
+// per-batch arena, so steady-state traffic does not touch the heap.
+void IRCServer::handleJOIN(Client* client, const Message& msg) {
+    if (msg.param_count == 0) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, client->nickname, "JOIN"));
         return;
     }
 
-    if (channels.find(channel_name) == channels.end()) {
-        channels[channel_name] = new Channel(channel_name);
+    // A list is joined channel by channel, as separate JOINs would be
+    std::string_view list = msg.params[0];
+    std::string_view channel_name;
+    size_t count = 0;
+    size_t fanout = 0;
+    while (nextItem(list, channel_name)) {
+        if (count == static_cast<size_t>(config.max_targets)) {
+            client->sendMessage(formatReply(ERR_TOOMANYTARGETS, client->nickname, channel_name));
+            break;
+        }
+        ++count;
+        joinChannel(client, channel_name);
+        fanout += client->fanout;
+    }
+    client->fanout = fanout;
+    client->targets = std::max<size_t>(count, 1);
+}
+
+void IRCServer::joinChannel(Client* client, std::string_view channel_name) {
+    client->fanout = 0;
+    if (!isValidChannelName(channel_name)) {
+        client->sendMessage(formatReply(ERR_BADCHANMASK, client->nickname, channel_name));
+        return;
     }
 
-    Channel* channel = channels[channel_name];
+    Channel* channel = findChannel(channel_name);
+    if (!channel) {
+        channel = new Channel(std::string(channel_name));
+        channels[channel->name] = channel;
+    }
 
-    if (channel->clients.find(client) != channel->clients.end()) {
+    if (channel->hasClient(client)) {
         // User is already in the channel
         return;
     }
 
     channel->addClient(client);
 
-    std::string join_msg = ":" + client->nickname + " JOIN :" + channel_name + "\r\n";
-    channel->broadcast(join_msg);
+    SharedBuffer join_line = formatLine({":", client->nickname, " JOIN :", channel_name, "\r\n"});
+    channel->broadcast(join_line);
+    client->fanout = channel->clients.size();
+    if (client->registered) {
+        propagate(join_line, nullptr);
+    }
 
     // Send channel topic (not set in this implementation)
-    std::string topic = ":miniircd 332 " + client->nickname + " " + channel_name + " :No topic is set\r\n";
-    client->sendMessage(topic);
+    client->sendMessage(formatReply(RPL_TOPIC, client->nickname, channel_name));
 
-    // Send current user list
-    std::string names = ":miniircd 353 " + client->nickname + " = " + channel_name + " :";
-    for (auto c : channel->clients) {
-        names += c->nickname + " ";
-    }
-    names += "\r\n";
-    client->sendMessage(names);
+    sendNames(client, channel);
 
-    // End of NAMES list
-    std::string end_names = ":miniircd 366 " + client->nickname + " " + channel_name + " :End of /NAMES list.\r\n";
-    client->sendMessage(end_names);
+    // Replay recent conversation exactly as it was sent
+    if (history.enabled()) {
+        std::pmr::vector<HistoryEntry> replay(&Shard::current()->arena);
+        history.latest(channel, HISTORY_REPLAY_LINES, replay);
+        for (const HistoryEntry& entry : replay) {
+            client->sendMessage(entry.line);
+        }
+    }
 }
 
-void IRCServer::handlePART(Client* client, const std::vector<std::string>& params) {
-    if (params.empty()) {
-        std::string error = ":miniircd 461 " + client->nickname + " PART :Not enough parameters\r\n";
-        client->sendMessage(error);
+void IRCServer::handleNAMES(Client* client, const Message& msg) {
+    if (msg.param_count == 0) {
+        // Listing every channel is not offered
+        client->sendMessage(formatReply(RPL_ENDOFNAMES, client->nickname, "*"));
         return;
     }
 
-    std::string channel_name = params[0];
-    auto it = channels.find(channel_name);
-    if (it == channels.end()) {
-        std::string error = ":miniircd 403 " + client->nickname + " " + channel_name + " :No such channel\r\n";
-        client->sendMessage(error);
+    std::string_view list = msg.params[0];
+    std::string_view channel_name;
+    size_t count = 0;
+    while (nextItem(list, channel_name)) {
+        if (count == static_cast<size_t>(config.max_targets)) {
+            client->sendMessage(formatReply(ERR_TOOMANYTARGETS, client->nickname, channel_name));
+            break;
+        }
+        ++count;
+        Channel* channel = findChannel(channel_name);
+        if (channel) {
+            sendNames(client, channel);
+            client->fanout += channel->names.lines().size();
+        } else {
+            client->sendMessage(formatReply(RPL_ENDOFNAMES, client->nickname, channel_name));
+        }
+    }
+    client->targets = std::max<size_t>(count, 1);
+}
+
+// 353 lines from the channel's cache, then 366. Only the prefix naming the
+// requester is formatted; each line is that prefix and a shared list queued
+// back to back, which nothing can come between as the client is ours.
+void IRCServer::sendNames(Client* client, Channel* channel) {
+    std::string_view nick = client->nickname.empty() ? std::string_view("*") : client->nickname;
+    SharedBuffer prefix = formatLine({serverPrefix(), "353 ", nick, " = ", channel->name, " :"});
+    for (const SharedBuffer& names : channel->names.lines()) {
+        // Two bytes is just the CRLF: only unnamed members in this chunk
+        if (names.length() > 2) {
+            client->enqueue(prefix);
+            client->enqueue(names);
+        }
+    }
+    client->enqueue(formatReply(RPL_ENDOFNAMES, nick, channel->name));
+}
+
+void IRCServer::handlePART(Client* client, const Message& msg) {
+    if (msg.param_count == 0) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, client->nickname, "PART"));
         return;
     }
 
-    Channel* channel = it->second;
-    if (channel->clients.find(client) == channel->clients.end()) {
-        std::string error = ":miniircd 442 " + client->nickname + " " + channel_name + " :You're not on that channel\r\n";
-        client->sendMessage(error);
+    std::string_view list = msg.params[0];
+    std::string_view channel_name;
+    size_t count = 0;
+    while (nextItem(list, channel_name)) {
+        if (count == static_cast<size_t>(config.max_targets)) {
+            client->sendMessage(formatReply(ERR_TOOMANYTARGETS, client->nickname, channel_name));
+            break;
+        }
+        ++count;
+        partChannel(client, channel_name);
+    }
+    client->targets = std::max<size_t>(count, 1);
+}
+
+void IRCServer::partChannel(Client* client, std::string_view channel_name) {
+    Channel* channel = findChannel(channel_name);
+    if (!channel) {
+        client->sendMessage(formatReply(ERR_NOSUCHCHANNEL, client->nickname, channel_name));
         return;
     }
 
-    channel->removeClient(client);
-    std::string part_msg = ":" + client->nickname + " PART " + channel_name + "\r\n";
-    channel->broadcast(part_msg);
+    if (!channel->hasClient(client)) {
+        client->sendMessage(formatReply(ERR_NOTONCHANNEL, client->nickname, channel_name));
+        return;
+    }
 
-    if (channel->clients.empty()) {
-        delete channel;
-        channels.erase(it);
+    // The parting client sees its own PART too
+    SharedBuffer part_line = formatLine({":", client->nickname, " PART ", channel->name, "\r\n"});
+    channel->broadcast(part_line);
+    if (client->registered) {
+        propagate(part_line, nullptr);
     }
+    leaveChannel(client, channel);
 }
 
-void IRCServer::handlePRIVMSG(Client* client, const std::vector<std::string>& params) {
-    if (params.size() < 2) {
-        std::string error = ":miniircd 461 " + client->nickname + " PRIVMSG :Not enough parameters\r\n";
-        client->sendMessage(error);
+void IRCServer::handlePRIVMSG(Client* client, const Message& msg) {
+    if (msg.param_count < 2) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, client->nickname, "PRIVMSG"));
         return;
     }
 
-    std::string target = params[0];
-    std::string message = params[1];
-
-    if (message.empty()) {
-        std::string error = ":miniircd 412 " + client->nickname + " :No text to send\r\n";
-        client->sendMessage(error);
+    if (msg.params[1].empty()) {
+        client->sendMessage(formatReply(ERR_NOTEXTTOSEND, client->nickname));
         return;
     }
+    sendText(client, "PRIVMSG", msg.params[0], msg.params[1], true);
+}
 
-    // Message to channel
-    if (target[0] == '#') {
-        auto it = channels.find(target);
-        if (it == channels.end()) {
-            std::string error = ":miniircd 401 " + client->nickname + " " + target + " :No such nick/channel\r\n";
-            client->sendMessage(error);
+void IRCServer::handleQUIT(Client* client, const Message& msg) {
+    std::string reason = "Quit";
+    if (msg.param_count > 0) {
+        reason += ": " + std::string(msg.params[0]);
+    }
+
+    // Mark client for disconnection instead of deleting immediately; peers
+    // get the QUIT when it is removed
+    client->disconnect(reason);
+}
+
+void IRCServer::handleNOTICE(Client* client, const Message& msg) {
+    if (msg.param_count < 2 || msg.params[1].empty()) {
+        return; // NOTICE does not return errors
+    }
+    sendText(client, "NOTICE", msg.params[0], msg.params[1], false);
+}
+
+// PRIVMSG and NOTICE. A list of targets is sent as one line naming every
+// target that resolved, and whoever shares several of them gets it once.
+void IRCServer::sendText(Client* client, std::string_view command, std::string_view targets,
+                         std::string_view text, bool replies) {
+    if (targets.find(',') == std::string_view::npos) {
+        // A single target, by far the common case, needs no recipient set
+        if (targets.empty()) {
+            if (replies) client->sendMessage(formatReply(ERR_NORECIPIENT, client->nickname));
             return;
         }
+        if (targets[0] == '#') {
+            Channel* channel = findChannel(targets);
+            if (!channel) {
+                if (replies) client->sendMessage(formatReply(ERR_NOSUCHNICK, client->nickname, targets));
+                return;
+            }
+            if (!channel->hasClient(client)) {
+                if (replies) client->sendMessage(formatReply(ERR_NOTONCHANNEL, client->nickname, targets));
+                return;
+            }
+            SharedBuffer line = formatLine({":", client->nickname, " ", command, " ", targets, " :", text, "\r\n"});
+            channel->broadcast(line, client);
+            channel->relay(line, nullptr);
+            client->fanout = channel->clients.size();
+            recordLine(channel, line);
+        } else {
+            Client* target_client = getClientByNickname(targets);
+            if (!target_client) {
+                if (replies) client->sendMessage(formatReply(ERR_NOSUCHNICK, client->nickname, targets));
+                return;
+            }
+            target_client->sendMessage(formatLine({":", client->nickname, " ", command, " ", targets, " :", text, "\r\n"}));
+        }
+        return;
+    }
 
-        Channel* channel = it->second;
-        if (channel->clients.find(client) == channel->clients.end()) {
-            std::string error = ":miniircd 442 " + client->nickname + " " + target + " :You're not on that channel\r\n";
-            client->sendMessage(error);
-            return;
+    std::pmr::vector<MessageTarget> resolved(&Shard::current()->arena);
+    std::pmr::string names(&Shard::current()->arena);
+    std::string_view target;
+    size_t count = 0;
+    while (nextItem(targets, target)) {
+        // Every name counts, so a list of unknown ones is limited too
+        if (count == static_cast<size_t>(config.max_targets)) {
+            if (replies) client->sendMessage(formatReply(ERR_TOOMANYTARGETS, client->nickname, target));
+            break;
+        }
+        ++count;
+        MessageTarget entry = {nullptr, nullptr};
+        if (target[0] == '#') {
+            entry.channel = findChannel(target);
+            if (!entry.channel) {
+                if (replies) client->sendMessage(formatReply(ERR_NOSUCHNICK, client->nickname, target));
+                continue;
+            }
+            if (!entry.channel->hasClient(client)) {
+                if (replies) client->sendMessage(formatReply(ERR_NOTONCHANNEL, client->nickname, target));
+                continue;
+            }
+        } else {
+            entry.user = getClientByNickname(target);
+            if (!entry.user) {
+                if (replies) client->sendMessage(formatReply(ERR_NOSUCHNICK, client->nickname, target));
+                continue;
+            }
         }
+        if (std::find(resolved.begin(), resolved.end(), entry) != resolved.end()) {
+            // Named twice
+            continue;
+        }
+        resolved.push_back(entry);
+        if (!names.empty()) names += ',';
+        names.append(target);
+    }
+    // A list of nothing but commas still costs a line
+    client->targets = std::max<size_t>(count, 1);
+    if (count == 0) {
+        if (replies) client->sendMessage(formatReply(ERR_NORECIPIENT, client->nickname));
+        return;
+    }
+    if (resolved.empty()) return;
+
+    SharedBuffer line = formatLine({":", client->nickname, " ", command, " ", names, " :", text, "\r\n"});
+    client->fanout = deliver(client, resolved, line, nullptr);
+}
 
-        std::string msg = ":" + client->nickname + " PRIVMSG " + target + " :" + message + "\r\n";
-        channel->broadcast(msg, client);
+// Hands line to everyone the targets reach: each local recipient once, and
+// each link with recipients behind it once. This runs under the shared
+// lock, where visit marks cannot be written, so recipients are marked in
+// the shard's own table instead. Returns how many connections the line was
+// queued for.
+size_t IRCServer::deliver(Client* sender, const std::pmr::vector<MessageTarget>& targets,
+                          const SharedBuffer& line, Client* from_link) {
+    Shard* shard = Shard::current();
+    shard->startDelivery();
+    if (from_link) {
+        shard->markDelivered(from_link->fd);
     }
-    // Message to user
-    else {
-        Client* target_client = getClientByNickname(target);
 
-        if (!target_client) {
-            std::string error = ":miniircd 401 " + client->nickname + " " + target + " :No such nick/channel\r\n";
-            client->sendMessage(error);
-            return;
+    size_t count = 0;
+    auto send = [&](Client* recipient) {
+        if (shard->markDelivered(recipient->fd)) {
+            recipient->sendMessage(line);
+            ++count;
         }
+    };
+    for (const MessageTarget& target : targets) {
+        if (target.channel) {
+            // Remote members are reached through their links
+            for (Client* member : target.channel->clients) {
+                if (member != sender && !member->via) {
+                    send(member);
+                }
+            }
+            for (const ChannelLink& entry : target.channel->links) {
+                send(entry.link);
+            }
+            recordLine(target.channel, line);
+        } else {
+            send(target.user->via ? target.user->via : target.user);
+        }
+    }
+    return count;
+}
+
+void IRCServer::handleOPER(Client* client, const Message& msg) {
+    if (msg.param_count < 2) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, client->nickname, "OPER"));
+        return;
+    }
 
-        std::string msg = ":" + client->nickname + " PRIVMSG " + target + " :" + message + "\r\n";
-        target_client->sendMessage(msg);
+    if (config.oper_name.empty() || msg.params[0] != config.oper_name || msg.params[1] != config.oper_password) {
+        client->sendMessage(formatReply(ERR_PASSWDMISMATCH, client->nickname));
+        return;
     }
+
+    client->oper = true;
+    client->sendMessage(formatReply(RPL_YOUREOPER, client->nickname));
 }
 
-void IRCServer::handleQUIT(Client* client, const std::vector<std::string>& params) {
-    std::string quit_msg = ":" + client->nickname + " QUIT :Quit";
-    if (!params.empty()) {
-        quit_msg += " :" + params[0];
+// Parses an IRCv3 "timestamp=YYYY-MM-DDThh:mm:ss.sssZ" selector
+static bool parseTimestamp(std::string_view selector, uint64_t& time_ms) {
+    const std::string_view prefix = "timestamp=";
+    if (selector.substr(0, prefix.size()) != prefix) return false;
+    std::string text(selector.substr(prefix.size()));
+
+    struct tm tm = {};
+    int millis = 0;
+    int consumed = 0;
+    if (sscanf(text.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6) {
+        return false;
+    }
+    const char* rest = text.c_str() + consumed;
+    if (*rest == '.') {
+        int digits = 0;
+        if (sscanf(rest, ".%3d%n", &millis, &digits) != 1) return false;
+        rest += digits;
+    }
+    if (strcmp(rest, "Z") != 0) return false;
+
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    time_t seconds = timegm(&tm);
+    if (seconds < 0) return false;
+    time_ms = static_cast<uint64_t>(seconds) * 1000 + millis;
+    return true;
+}
+
+void IRCServer::handleCHATHISTORY(Client* client, const Message& msg) {
+    if (msg.param_count < 4) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, client->nickname, "CHATHISTORY"));
+        return;
     }
-    quit_msg += "\r\n";
 
-    // Notify everyone
-    broadcastToAll(quit_msg, client);
+    std::string_view subcommand = msg.params[0];
+    std::string_view target = msg.params[1];
+    std::string_view selector = msg.params[2];
+    int limit = atoi(std::string(msg.params[3]).c_str());
 
-    // Mark client for disconnection instead of deleting immediately
-    client->disconnecting = true;
+    // Only channel history is kept, and only members may read it
+    Channel* channel = target[0] == '#' ? findChannel(target) : nullptr;
+    if (!channel || !channel->hasClient(client)) {
+        client->sendMessage(formatLine({serverPrefix(), "FAIL CHATHISTORY INVALID_TARGET ", subcommand, " ", target,
+                                        " :Messages could not be retrieved\r\n"}));
+        return;
+    }
+    if (limit <= 0) {
+        client->sendMessage(formatLine({serverPrefix(), "FAIL CHATHISTORY INVALID_PARAMS ", subcommand, " ", msg.params[3],
+                                        " :Invalid limit\r\n"}));
+        return;
+    }
+
+    std::pmr::vector<HistoryEntry> entries(&Shard::current()->arena);
+    uint64_t time_ms = 0;
+    if (equalsIgnoreCase(subcommand, "LATEST") && selector == "*") {
+        history.latest(channel, limit, entries);
+    } else if (equalsIgnoreCase(subcommand, "BEFORE") && parseTimestamp(selector, time_ms)) {
+        history.before(channel, time_ms, limit, entries);
+    } else if (equalsIgnoreCase(subcommand, "AFTER") && parseTimestamp(selector, time_ms)) {
+        history.after(channel, time_ms, limit, entries);
+    } else {
+        client->sendMessage(formatLine({serverPrefix(), "FAIL CHATHISTORY INVALID_PARAMS ", subcommand, " ", selector,
+                                        " :Unsupported subcommand or selector\r\n"}));
+        return;
+    }
+
+    for (const HistoryEntry& entry : entries) {
+        client->sendMessage(entry.line);
+    }
 }
 
-void IRCServer::handleNOTICE(Client* client, const std::vector<std::string>& params) {
-    if (params.size() < 2) {
-        return; // NOTICE does not return errors
+template <typename F>
+static HistogramSnapshot collect(const std::vector<Shard*>& shards, F field) {
+    HistogramSnapshot snapshot;
+    for (Shard* shard : shards) {
+        snapshot.add(field(shard->metrics));
+    }
+    return snapshot;
+}
+
+template <typename F>
+static uint64_t total(const std::vector<Shard*>& shards, F field) {
+    uint64_t sum = 0;
+    for (Shard* shard : shards) {
+        sum += field(shard->metrics).get();
     }
+    return sum;
+}
 
-    std::string target = params[0];
-    std::string message = params[1];
+static std::string describe(const HistogramSnapshot& h, const char* unit, uint64_t divisor) {
+    char text[160];
+    snprintf(text, sizeof text, "count %llu p50 %llu%s p99 %llu%s p999 %llu%s",
+             static_cast<unsigned long long>(h.count),
+             static_cast<unsigned long long>(h.percentile(50) / divisor), unit,
+             static_cast<unsigned long long>(h.percentile(99) / divisor), unit,
+             static_cast<unsigned long long>(h.percentile(99.9) / divisor), unit);
+    return text;
+}
 
-    if (message.empty()) {
+// STATS m: per-command counts and latency; u: uptime; z: event loops,
+// traffic and gauges. Operators only.
+void IRCServer::handleSTATS(Client* client, const Message& msg) {
+    if (!client->oper) {
+        client->sendMessage(formatReply(ERR_NOPRIVILEGES, client->nickname));
+        return;
+    }
+    if (msg.param_count == 0 || msg.params[0].empty()) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, client->nickname, "STATS"));
         return;
     }
 
-    // Notice to channel
-    if (target[0] == '#') {
-        auto it = channels.find(target);
-        if (it == channels.end()) {
-            return;
+    char query = msg.params[0][0];
+    const std::string& prefix = serverPrefix();
+    std::string reply;
+    if (query == 'm') {
+        for (int id = 0; id < CMD_COUNT; ++id) {
+            HistogramSnapshot h = collect(shards, [id](Metrics& m) -> Histogram& { return m.command_ns[id]; });
+            if (h.count == 0) continue;
+            reply += prefix + "212 " + client->nickname + " " + command_names[id] + " " + std::to_string(h.count)
+                   + " :" + describe(h, "us", 1000) + "\r\n";
         }
+    } else if (query == 'u') {
+        long up = static_cast<long>(time(NULL) - start_time);
+        char text[64];
+        snprintf(text, sizeof text, ":Server Up %ld days %ld:%02ld:%02ld", up / 86400, up / 3600 % 24, up / 60 % 60, up % 60);
+        reply += prefix + "242 " + client->nickname + " " + text + "\r\n";
+    } else if (query == 'z') {
+        std::string debug = prefix + "249 " + client->nickname + " z :";
+        reply += debug + "loop busy " + describe(collect(shards, [](Metrics& m) -> Histogram& { return m.loop_busy_ns; }), "us", 1000) + "\r\n";
+        reply += debug + "loop lag " + describe(collect(shards, [](Metrics& m) -> Histogram& { return m.loop_lag_ns; }), "us", 1000) + "\r\n";
+        reply += debug + "ready per wakeup " + describe(collect(shards, [](Metrics& m) -> Histogram& { return m.ready_events; }), "", 1) + "\r\n";
+        reply += debug + "bytes in " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.bytes_in; }))
+               + " out " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.bytes_out; })) + "\r\n";
+        uint64_t accepted = total(shards, [](Metrics& m) -> Counter& { return m.connections_accepted; });
+        uint64_t closed = total(shards, [](Metrics& m) -> Counter& { return m.connections_closed; });
+        reply += debug + "connections " + std::to_string(accepted - closed) + " users " + std::to_string(nicknames.size())
+               + " channels " + std::to_string(channels.size()) + " shards " + std::to_string(shards.size()) + "\r\n";
+        reply += debug + "flood deferrals " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.flood_deferrals; }))
+               + " refused connections " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.connections_rejected; })) + "\r\n";
+        reply += debug + "slow consumers " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.slow_consumer_disconnects; }))
+               + " dropped lines " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.sendq_drops; })) + "\r\n";
+        reply += debug + "ping timeouts " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.ping_timeouts; }))
+               + " registration timeouts " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.registration_timeouts; }))
+               + " idle " + std::to_string(total(shards, [](Metrics& m) -> Counter& { return m.idle_disconnects; })) + "\r\n";
+    }
+    reply += prefix + "219 " + client->nickname + " " + query + " :End of /STATS report\r\n";
+    client->sendMessage(reply);
+}
 
-        Channel* channel = it->second;
-        if (channel->clients.find(client) == channel->clients.end()) {
-            return;
-        }
+static void appendSummary(std::string& out, const char* name, const std::string& labels,
+                          const HistogramSnapshot& h, double scale) {
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    char line[256];
+    for (double q : quantiles) {
+        snprintf(line, sizeof line, "%s{%s%squantile=\"%g\"} %.9g\n", name, labels.c_str(),
+                 labels.empty() ? "" : ",", q, h.percentile(q * 100) * scale);
+        out += line;
+    }
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    snprintf(line, sizeof line, "%s_sum%s %.9g\n%s_count%s %llu\n", name, braces.c_str(), h.sum * scale,
+             name, braces.c_str(), static_cast<unsigned long long>(h.count));
+    out += line;
+}
 
-        std::string msg = ":" + client->nickname + " NOTICE " + target + " :" + message + "\r\n";
-        channel->broadcast(msg, client);
+std::string IRCServer::metricsText() {
+    size_t users, channel_count, server_count;
+    {
+        std::shared_lock<std::shared_mutex> lock(state_lock);
+        users = nicknames.size();
+        channel_count = channels.size();
+        server_count = servers.size();
     }
-    // Notice to user
-    else {
-        Client* target_client = getClientByNickname(target);
 
-        if (!target_client) {
-            return;
-        }
+    std::string out;
+    out += "# HELP ircd_command_duration_seconds Time to handle one command, including lock wait.\n";
+    out += "# TYPE ircd_command_duration_seconds summary\n";
+    for (int id = 0; id < CMD_COUNT; ++id) {
+        HistogramSnapshot h = collect(shards, [id](Metrics& m) -> Histogram& { return m.command_ns[id]; });
+        appendSummary(out, "ircd_command_duration_seconds", std::string("command=\"") + command_names[id] + "\"", h, 1e-9);
+    }
+
+    out += "# HELP ircd_loop_busy_seconds Time an event loop spends handling one wakeup.\n";
+    out += "# TYPE ircd_loop_busy_seconds summary\n";
+    appendSummary(out, "ircd_loop_busy_seconds", "", collect(shards, [](Metrics& m) -> Histogram& { return m.loop_busy_ns; }), 1e-9);
+    out += "# HELP ircd_loop_lag_seconds How late an event loop runs a periodic probe.\n";
+    out += "# TYPE ircd_loop_lag_seconds summary\n";
+    appendSummary(out, "ircd_loop_lag_seconds", "", collect(shards, [](Metrics& m) -> Histogram& { return m.loop_lag_ns; }), 1e-9);
+    out += "# HELP ircd_loop_ready_events Ready descriptors or completions per wakeup.\n";
+    out += "# TYPE ircd_loop_ready_events summary\n";
+    appendSummary(out, "ircd_loop_ready_events", "", collect(shards, [](Metrics& m) -> Histogram& { return m.ready_events; }), 1);
+    if (message_log) {
+        HistogramSnapshot fsync;
+        fsync.add(message_log->fsync_ns);
+        out += "# HELP ircd_log_fsync_duration_seconds Time to fdatasync the message log.\n";
+        out += "# TYPE ircd_log_fsync_duration_seconds summary\n";
+        appendSummary(out, "ircd_log_fsync_duration_seconds", "", fsync, 1e-9);
+    }
 
-        std::string msg = ":" + client->nickname + " NOTICE " + target + " :" + message + "\r\n";
-        target_client->sendMessage(msg);
+    uint64_t accepted = total(shards, [](Metrics& m) -> Counter& { return m.connections_accepted; });
+    uint64_t closed = total(shards, [](Metrics& m) -> Counter& { return m.connections_closed; });
+    struct { const char* name; const char* type; const char* help; uint64_t value; } scalars[] = {
+        {"ircd_received_bytes_total", "counter", "Bytes read from clients.",
+         total(shards, [](Metrics& m) -> Counter& { return m.bytes_in; })},
+        {"ircd_sent_bytes_total", "counter", "Bytes written to clients.",
+         total(shards, [](Metrics& m) -> Counter& { return m.bytes_out; })},
+        {"ircd_connections_accepted_total", "counter", "Connections accepted.", accepted},
+        {"ircd_slow_consumer_disconnects_total", "counter", "Clients dropped for exceeding their send queue.",
+         total(shards, [](Metrics& m) -> Counter& { return m.slow_consumer_disconnects; })},
+        {"ircd_sendq_dropped_lines_total", "counter", "Lines discarded for slow consumers.",
+         total(shards, [](Metrics& m) -> Counter& { return m.sendq_drops; })},
+        {"ircd_flood_deferrals_total", "counter", "Times a client's input was held back by flood control.",
+         total(shards, [](Metrics& m) -> Counter& { return m.flood_deferrals; })},
+        {"ircd_connections_rejected_total", "counter", "Connections refused by the per-IP limit.",
+         total(shards, [](Metrics& m) -> Counter& { return m.connections_rejected; })},
+        {"ircd_tls_handshakes_total", "counter", "TLS handshakes completed.",
+         total(shards, [](Metrics& m) -> Counter& { return m.tls_handshakes; })},
+        {"ircd_tls_resumed_handshakes_total", "counter", "TLS handshakes that resumed a session.",
+         total(shards, [](Metrics& m) -> Counter& { return m.tls_resumptions; })},
+        {"ircd_tls_ktls_connections_total", "counter", "TLS connections whose sends the kernel encrypts.",
+         total(shards, [](Metrics& m) -> Counter& { return m.tls_ktls_sends; })},
+        {"ircd_tls_handshake_failures_total", "counter", "TLS handshakes that failed.",
+         total(shards, [](Metrics& m) -> Counter& { return m.tls_failures; })},
+        {"ircd_keepalive_pings_total", "counter", "PINGs sent to clients that had gone quiet.",
+         total(shards, [](Metrics& m) -> Counter& { return m.pings_sent; })},
+        {"ircd_ping_timeouts_total", "counter", "Clients dropped for not answering a PING.",
+         total(shards, [](Metrics& m) -> Counter& { return m.ping_timeouts; })},
+        {"ircd_registration_timeouts_total", "counter", "Connections dropped before registering.",
+         total(shards, [](Metrics& m) -> Counter& { return m.registration_timeouts; })},
+        {"ircd_idle_disconnects_total", "counter", "Clients dropped by the idle timeout.",
+         total(shards, [](Metrics& m) -> Counter& { return m.idle_disconnects; })},
+        {"ircd_connections", "gauge", "Open client connections.", accepted - closed},
+        {"ircd_users", "gauge", "Clients holding a nickname.", users},
+        {"ircd_channels", "gauge", "Channels with at least one member.", channel_count},
+        {"ircd_linked_servers", "gauge", "Other servers in the network.", server_count},
+        {"ircd_history_bytes", "gauge", "Memory held by channel history.", history.bytesUsed()},
+        {"ircd_log_records_total", "counter", "Lines written to the message log.",
+         message_log ? message_log->records_written.get() : 0},
+        {"ircd_log_written_bytes_total", "counter", "Bytes written to the message log.",
+         message_log ? message_log->bytes_written.get() : 0},
+        {"ircd_log_dropped_records_total", "counter", "Lines not logged because the writer fell behind.",
+         message_log ? message_log->records_dropped.load(std::memory_order_relaxed) : 0},
+        {"ircd_log_write_errors_total", "counter", "Failed message log writes and syncs.",
+         message_log ? message_log->write_errors.get() : 0},
+        {"ircd_uptime_seconds", "gauge", "Seconds since the server started.", static_cast<uint64_t>(time(NULL) - start_time)},
+    };
+    for (const auto& scalar : scalars) {
+        out += std::string("# HELP ") + scalar.name + " " + scalar.help + "\n";
+        out += std::string("# TYPE ") + scalar.name + " " + scalar.type + "\n";
+        out += std::string(scalar.name) + " " + std::to_string(scalar.value) + "\n";
     }
+    return out;
 }
 
 void IRCServer::checkRegistration(Client* client) {
@@ -582,27 +1209,73 @@ void IRCServer::checkRegistration(Client* client) {
 
     if (!client->nickname.empty() && !client->username.empty()) {
         client->registered = true;
-        std::string welcome = ":miniircd 001 " + client->nickname + " :Welcome to the mini IRC server\r\n";
-        client->sendMessage(welcome);
-
-        // Send MOTD (Message of the Day)
-        std::string motd_start = ":miniircd 375 " + client->nickname + " :- miniircd Message of the day - \r\n";
-        std::string motd = ":miniircd 372 " + client->nickname + " :- Welcome to the mini IRC server!\r\n";
-        std::string motd_end = ":miniircd 376 " + client->nickname + " :End of /MOTD command.\r\n";
-        client->sendMessage(motd_start + motd + motd_end);
+        introduce(client, nullptr);
+        // 001 and the MOTD, pre-serialized at startup
+        client->sendMessage(registration_burst.format(client->nickname));
     }
 }
 
-void IRCServer::broadcastToAll(const std::string& message, Client* sender) {
-    for (auto client : clients) {
-        if (client != sender) {
-            client->sendMessage(message);
+void IRCServer::broadcastToPeers(Client* client, const SharedBuffer& message, bool include_self) {
+    // A peer sharing several channels with client is reached once per epoch.
+    // Remote peers hear about it from the line passed along the links.
+    ++visit_epoch;
+    client->visit_mark = visit_epoch;
+    if (include_self) {
+        client->sendMessage(message);
+    }
+
+    for (Channel* channel : client->channels) {
+        for (Client* peer : channel->clients) {
+            if (peer->visit_mark != visit_epoch) {
+                peer->visit_mark = visit_epoch;
+                if (!peer->via) {
+                    peer->sendMessage(message);
+                }
+            }
         }
     }
 }
 
-bool IRCServer::isValidNickname(const std::string& nick) {
-    if (nick.empty() || nick.length() > 9) return false;
+Channel* IRCServer::findChannel(std::string_view name) {
+    auto it = channels.find(name);
+    return it != channels.end() ? it->second : nullptr;
+}
+
+// Remembers a channel line for replay and hands it to the message log
+void IRCServer::recordLine(Channel* channel, const SharedBuffer& line) {
+    if (!history.enabled() && !message_log) return;
+
+    uint64_t now_ms = wallClockMs();
+    history.record(channel, line, now_ms);
+    if (message_log) {
+        // Batched per event loop iteration; see Shard::submitLog
+        Shard::current()->log_batch.push_back({now_ms, IrcNameHash()(channel->name), line});
+    }
+}
+
+void IRCServer::submitLog(std::vector<LogRecord>&& batch) {
+    message_log->submit(std::move(batch));
+}
+
+void IRCServer::leaveChannel(Client* client, Channel* channel) {
+    channel->removeClient(client);
+
+    // If channel is empty, delete it
+    if (channel->clients.empty()) {
+        channels.erase(channel->name);
+        history.forget(channel);
+        delete channel;
+    }
+}
+
+void IRCServer::renamed(Client* client) {
+    for (Channel* channel : client->channels) {
+        channel->names.renamed(client);
+    }
+}
+
+bool IRCServer::isValidNickname(std::string_view nick) {
+    if (nick.empty() || nick.length() > NICK_MAX) return false;
     if (!isalpha(nick[0])) return false;
     for (char c : nick) {
         if (!isalnum(c) && c != '-' && c != '_') return false;
@@ -610,11 +1283,473 @@ bool IRCServer::isValidNickname(const std::string& nick) {
     return true;
 }
 
-Client* IRCServer::getClientByNickname(const std::string& nickname) {
-    for (auto client : clients) {
-        if (client->nickname == nickname) {
-            return client;
+// Names go into list parameters and 353 lines, so no separators or
+// control characters, and short enough that a 353 always has room
+bool IRCServer::isValidChannelName(std::string_view name) {
+    if (name.empty() || name.size() > CHANNEL_NAME_MAX || name[0] != '#') return false;
+    for (char c : name) {
+        if (c == ' ' || c == ',' || static_cast<unsigned char>(c) < 0x20 || c == 0x7f) return false;
+    }
+    return true;
+}
+
+Client* IRCServer::getClientByNickname(std::string_view nickname) {
+    auto it = nicknames.find(nickname);
+    return it != nicknames.end() ? it->second : nullptr;
+}
+
+// --- Server links ---
+
+void IRCServer::handlePASS(Client* client, const Message& msg) {
+    if (msg.param_count == 0) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, "*", "PASS"));
+        return;
+    }
+    client->link_password = std::string(msg.params[0]);
+}
+
+void IRCServer::handleSERVER(Client* client, const Message& msg) {
+    if (client->registered) {
+        client->sendMessage(formatReply(ERR_ALREADYREGISTRED, client->nickname));
+        return;
+    }
+    if (msg.param_count == 0) {
+        client->sendMessage(formatReply(ERR_NEEDMOREPARAMS, "*", "SERVER"));
+        return;
+    }
+
+    std::string name(msg.params[0]);
+    if (config.link_password.empty() || client->link_password != config.link_password) {
+        client->sendMessage(formatLine({"ERROR :Closing Link: Bad password\r\n"}));
+        client->disconnect("Bad link password");
+        return;
+    }
+    if (name == config.server_name || servers.count(name)) {
+        // Already reachable another way; a second path would form a loop
+        client->sendMessage(formatLine({"ERROR :Closing Link: Server ", name, " already exists\r\n"}));
+        client->disconnect("Server exists");
+        return;
+    }
+    acceptLink(client, name);
+}
+
+void IRCServer::acceptLink(Client* link, const std::string& name) {
+    // A nickname picked before SERVER does not belong to anyone
+    if (!link->nickname.empty()) {
+        auto it = nicknames.find(link->nickname);
+        if (it != nicknames.end() && it->second == link) {
+            nicknames.erase(it);
+        }
+        link->nickname.clear();
+        renamed(link);
+    }
+
+    link->is_link = true;
+    link->server = name;
+    link->sendq_limit = LINK_SENDQ_LIMIT;
+    if (!link->link_outgoing) {
+        sendHandshake(link);
+    }
+    // From here on it is pinged on the link interval
+    link->shard->checkLiveness(link, monotonicNs());
+
+    // The rest of the network learns about the new server before it is
+    // added, so it is not told about itself
+    propagate(formatLine({":", config.server_name, " SERVER ", name, " 2\r\n"}), nullptr);
+    servers[name] = {link, config.server_name, 1};
+    links.push_back(link);
+    sendBurst(link);
+    std::cout << "Linked with server " << name << std::endl;
+}
+
+void IRCServer::sendHandshake(Client* link) {
+    link->sendMessage(formatLine({"PASS ", config.link_password, "\r\nSERVER ", config.server_name, " 1 :miniircd\r\n"}));
+}
+
+// Everything the new neighbour needs to know about our side of the
+// network: servers (uplinks first), users, then channel membership
+void IRCServer::sendBurst(Client* link) {
+    std::string burst;
+
+    std::vector<std::pair<int, std::string>> known;
+    for (const auto& pair : servers) {
+        if (pair.second.via != link) {
+            known.push_back({pair.second.hops, pair.first});
+        }
+    }
+    std::sort(known.begin(), known.end());
+    for (const auto& entry : known) {
+        const RemoteServer& server = servers[entry.second];
+        burst += ":" + server.uplink + " SERVER " + entry.second + " " + std::to_string(server.hops + 1) + "\r\n";
+    }
+
+    for (const auto& pair : nicknames) {
+        Client* user = pair.second;
+        if (user->via == link || (!user->via && !user->registered)) continue;
+        int hops = user->via ? servers[user->server].hops + 1 : 1;
+        burst += "NICK " + user->nickname + " " + std::to_string(hops) + " " + std::to_string(user->nick_ts) + " "
+               + user->username + " " + user->hostname.str() + " " + homeServer(user) + " :" + user->realname + "\r\n";
+    }
+
+    for (const auto& pair : channels) {
+        Channel* channel = pair.second;
+        for (Client* member : channel->clients) {
+            if (member->via != link && (member->via || member->registered)) {
+                burst += ":" + member->nickname + " JOIN :" + channel->name + "\r\n";
+            }
+        }
+    }
+
+    if (!burst.empty()) {
+        link->sendMessage(burst);
+    }
+}
+
+void IRCServer::dropLink(Client* link) {
+    links.erase(std::remove(links.begin(), links.end(), link), links.end());
+    if (link->server.empty()) return;
+
+    // Everything behind the link is gone. The rest of the network is told
+    // which servers split off and drops their users itself.
+    for (auto it = servers.begin(); it != servers.end();) {
+        if (it->second.via == link) {
+            propagate(formatLine({":", config.server_name, " SQUIT ", it->first, " :", link->quit_reason, "\r\n"}), link);
+            it = servers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    std::vector<Client*> lost;
+    for (const auto& pair : nicknames) {
+        if (pair.second->via == link) {
+            lost.push_back(pair.second);
+        }
+    }
+    for (Client* user : lost) {
+        // Netsplit style: the two servers either side of the break
+        removeUser(user, formatLine({":", user->nickname, " QUIT :", config.server_name, " ", link->server, "\r\n"}));
+        delete user;
+    }
+    std::cout << "Lost link with server " << link->server << ": " << link->quit_reason
+              << " (" << lost.size() << " users)" << std::endl;
+}
+
+void IRCServer::maintainLinks(Shard* shard) {
+    if (outgoing.empty()) return;
+
+    uint64_t now = monotonicNs();
+    for (OutgoingLink& link : outgoing) {
+        {
+            std::unique_lock<std::shared_mutex> lock(state_lock);
+            if (link.client || now < link.next_attempt) continue;
+            link.next_attempt = now + LINK_RETRY_MS * 1000000ull;
+        }
+        // Connecting needs no shared state, and the new client is ours
+        // alone until it has sent SERVER, so nothing can drop it before
+        // it is recorded
+        Client* client = shard->connectTo(link.host, reinterpret_cast<const sockaddr*>(&link.address),
+                                          link.address_length);
+        if (!client) continue;
+        client->link_outgoing = true;
+        // Queued until the connection completes
+        sendHandshake(client);
+        std::unique_lock<std::shared_mutex> lock(state_lock);
+        link.client = client;
+    }
+}
+
+void IRCServer::propagate(const SharedBuffer& line, Client* except) {
+    for (Client* link : links) {
+        if (link != except) {
+            link->sendMessage(line);
+        }
+    }
+}
+
+void IRCServer::introduce(Client* user, Client* except) {
+    if (links.empty()) return;
+    int hops = user->via ? servers[user->server].hops + 1 : 1;
+    propagate(formatLine({"NICK ", user->nickname, " ", std::to_string(hops), " ", std::to_string(user->nick_ts), " ",
+                          user->username, " ", user->hostname, " ", homeServer(user), " :", user->realname, "\r\n"}),
+              except);
+}
+
+const std::string& IRCServer::homeServer(const Client* client) const {
+    return client->via ? client->server.str() : config.server_name;
+}
+
+// The user a link line is from. Only users behind that link may speak
+// through it, which also discards lines that raced with a collision.
+Client* IRCServer::remoteSender(Client* link, const Message& msg) {
+    Client* user = getClientByNickname(msg.prefix);
+    return user && user->via == link ? user : nullptr;
+}
+
+// Every server settles a nickname collision the same way: the older claim
+// wins, and on a tie the server whose name sorts first. Returns true if the
+// newcomer (ts, server) wins, in which case the caller removes existing.
+bool IRCServer::resolveCollision(Client* existing, time_t ts, const std::string& server) {
+    if (!existing->via && !existing->registered) {
+        // Still registering here, so nobody else knows it; just take the name back
+        existing->sendMessage(formatReply(ERR_NICKCOLLISION, "*", existing->nickname));
+        nicknames.erase(existing->nickname);
+        existing->nickname.clear();
+        renamed(existing);
+        return true;
+    }
+
+    const std::string& existing_server = homeServer(existing);
+    bool newcomer_wins = ts != existing->nick_ts ? ts < existing->nick_ts : server < existing_server;
+    return newcomer_wins;
+}
+
+void IRCServer::killUser(Client* user, Client* from_link, const std::string& reason) {
+    // Identified by nickname and timestamp, so a KILL that crosses a
+    // rename or a collision never takes out the wrong user
+    propagate(formatLine({":", config.server_name, " KILL ", user->nickname, " ", std::to_string(user->nick_ts),
+                          " :", reason, "\r\n"}), from_link);
+    removeUser(user, formatLine({":", user->nickname, " QUIT :Killed (", reason, ")\r\n"}));
+    if (user->via) {
+        delete user;
+    } else {
+        user->closeWith(formatLine({"ERROR :Closing Link: Killed (", reason, ")\r\n"}));
+        user->nickname.clear();
+    }
+}
+
+void IRCServer::processLinkLine(Client* link, std::string_view line) {
+    Message msg;
+    if (!parseMessage(line, msg)) return;
+
+    switch (commandHash(msg.command)) {
+    case commandHash("PRIVMSG"):
+    case commandHash("NOTICE"): {
+        // The bulk of link traffic; only reads shared state
+        std::shared_lock<std::shared_mutex> lock(state_lock);
+        linkMessage(link, msg, line);
+        return;
+    }
+    case commandHash("PING"):
+        link->sendMessage(formatLine({":", config.server_name, " PONG ", config.server_name, " :",
+                                      msg.param_count ? msg.params[0] : std::string_view(), "\r\n"}));
+        return;
+    case commandHash("PONG"):
+        // Arriving at all was the point
+        return;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(state_lock);
+    switch (commandHash(msg.command)) {
+    case commandHash("SERVER"): linkSERVER(link, msg); break;
+    case commandHash("SQUIT"):  linkSQUIT(link, msg); break;
+    case commandHash("NICK"):   linkNICK(link, msg, line); break;
+    case commandHash("KILL"):   linkKILL(link, msg); break;
+    case commandHash("JOIN"):
+    case commandHash("PART"):   linkMembership(link, msg, line); break;
+    case commandHash("QUIT"):   linkQUIT(link, msg, line); break;
+    case commandHash("ERROR"):
+        std::cout << "Link error from " << link->server << ": "
+                  << (msg.param_count ? msg.params[0] : std::string_view()) << std::endl;
+        link->disconnect("Link closed by peer");
+        break;
+    }
+}
+
+void IRCServer::linkSERVER(Client* link, const Message& msg) {
+    if (msg.param_count < 2) return;
+    std::string name(msg.params[0]);
+    int hops = atoi(std::string(msg.params[1]).c_str());
+
+    if (name == config.server_name || servers.count(name)) {
+        link->sendMessage(formatLine({"ERROR :Server ", name, " already exists\r\n"}));
+        link->disconnect("Server " + name + " already exists");
+        return;
+    }
+    servers[name] = {link, std::string(msg.prefix), hops};
+    propagate(formatLine({":", msg.prefix, " SERVER ", name, " ", std::to_string(hops + 1), "\r\n"}), link);
+}
+
+void IRCServer::linkSQUIT(Client* link, const Message& msg) {
+    if (msg.param_count == 0) return;
+    std::string name(msg.params[0]);
+    auto it = servers.find(name);
+    if (it == servers.end() || it->second.via != link) return;
+
+    std::string uplink = it->second.uplink;
+    servers.erase(it);
+    propagate(formatLine({":", msg.prefix, " SQUIT ", name, " :",
+                          msg.param_count > 1 ? msg.params[1] : std::string_view(), "\r\n"}), link);
+
+    std::vector<Client*> lost;
+    for (const auto& pair : nicknames) {
+        if (pair.second->via == link && pair.second->server == name) {
+            lost.push_back(pair.second);
+        }
+    }
+    for (Client* user : lost) {
+        removeUser(user, formatLine({":", user->nickname, " QUIT :", uplink, " ", name, "\r\n"}));
+        delete user;
+    }
+}
+
+void IRCServer::linkNICK(Client* link, const Message& msg, std::string_view line) {
+    if (msg.prefix.empty()) {
+        // NICK <nick> <hops> <ts> <user> <host> <server> :<realname>
+        if (msg.param_count < 7) return;
+        std::string_view nick = msg.params[0];
+        time_t ts = strtoll(std::string(msg.params[2]).c_str(), NULL, 10);
+        std::string server(msg.params[5]);
+        auto origin = servers.find(server);
+        if (origin == servers.end() || origin->second.via != link) return;
+        if (!isValidNickname(nick)) {
+            // Peers may allow names we cannot fit in replies; theirs goes
+            link->sendMessage(formatLine({":", config.server_name, " KILL ", nick, " ",
+                                          std::string(msg.params[2]), " :Erroneous nickname\r\n"}));
+            return;
+        }
+
+        Client* existing = getClientByNickname(nick);
+        if (existing) {
+            if (!resolveCollision(existing, ts, server)) {
+                // The newcomer loses here, and by the same rule everywhere
+                link->sendMessage(formatLine({":", config.server_name, " KILL ", nick, " ",
+                                              std::string(msg.params[2]), " :Nick collision\r\n"}));
+                return;
+            }
+            if (!existing->nickname.empty()) {
+                killUser(existing, link, "Nick collision");
+            }
+        }
+
+        Client* user = new Client(-1, link->shard, 0);
+        user->via = link;
+        user->server = server;
+        user->nick_ts = ts;
+        user->nickname = std::string(nick);
+        user->username = std::string(msg.params[3]);
+        user->hostname = std::string(msg.params[4]);
+        user->realname = std::string(msg.params[6]);
+        user->registered = true;
+        nicknames[user->nickname] = user;
+        introduce(user, link);
+        return;
+    }
+
+    // :<old> NICK <new> <ts>
+    Client* user = remoteSender(link, msg);
+    if (!user || msg.param_count < 2) return;
+    std::string_view nick = msg.params[0];
+    time_t ts = strtoll(std::string(msg.params[1]).c_str(), NULL, 10);
+    if (!isValidNickname(nick)) {
+        link->sendMessage(formatLine({":", config.server_name, " KILL ", nick, " ",
+                                      std::string(msg.params[1]), " :Erroneous nickname\r\n"}));
+        killUser(user, link, "Erroneous nickname");
+        return;
+    }
+
+    Client* existing = getClientByNickname(nick);
+    if (existing && existing != user) {
+        if (!resolveCollision(existing, ts, user->server)) {
+            // Its home has already renamed it, so it is known by the new
+            // name that way and by the old one everywhere else
+            link->sendMessage(formatLine({":", config.server_name, " KILL ", nick, " ",
+                                          std::string(msg.params[1]), " :Nick collision\r\n"}));
+            killUser(user, link, "Nick collision");
+            return;
+        }
+        if (!existing->nickname.empty()) {
+            killUser(existing, link, "Nick collision");
+        }
+    }
+
+    broadcastToPeers(user, formatLine({":", user->nickname, " NICK :", nick, "\r\n"}), false);
+    nicknames.erase(user->nickname);
+    user->nickname = std::string(nick);
+    user->nick_ts = ts;
+    nicknames[user->nickname] = user;
+    renamed(user);
+    propagate(formatLine({line, "\r\n"}), link);
+}
+
+void IRCServer::linkKILL(Client* link, const Message& msg) {
+    if (msg.param_count < 2) return;
+    Client* user = getClientByNickname(msg.params[0]);
+    time_t ts = strtoll(std::string(msg.params[1]).c_str(), NULL, 10);
+    // Gone already, or this is the user that won the collision
+    if (!user || user->nick_ts != ts || user->via == link) return;
+    killUser(user, link, msg.param_count > 2 ? std::string(msg.params[2]) : "Killed");
+}
+
+void IRCServer::linkMembership(Client* link, const Message& msg, std::string_view line) {
+    Client* user = remoteSender(link, msg);
+    if (!user || msg.param_count == 0 || !isValidChannelName(msg.params[0])) return;
+    std::string_view channel_name = msg.params[0];
+    bool join = msg.command.size() == 4 && equalsIgnoreCase(msg.command, "JOIN");
+
+    Channel* channel = findChannel(channel_name);
+    if (join) {
+        if (!channel) {
+            channel = new Channel(std::string(channel_name));
+            channels[channel->name] = channel;
+        }
+        if (channel->hasClient(user)) return;
+        channel->addClient(user);
+    } else if (!channel || !channel->hasClient(user)) {
+        return;
+    }
+
+    // Local members see the line exactly as the user's own server sent it
+    SharedBuffer shared = formatLine({line, "\r\n"});
+    channel->broadcast(shared, user);
+    propagate(shared, link);
+    if (!join) {
+        leaveChannel(user, channel);
+    }
+}
+
+void IRCServer::linkQUIT(Client* link, const Message& msg, std::string_view line) {
+    Client* user = remoteSender(link, msg);
+    if (!user) return;
+    SharedBuffer shared = formatLine({line, "\r\n"});
+    propagate(shared, link);
+    removeUser(user, shared);
+    delete user;
+}
+
+void IRCServer::linkMessage(Client* link, const Message& msg, std::string_view line) {
+    Client* user = remoteSender(link, msg);
+    if (!user || msg.param_count < 2 || msg.params[0].empty()) return;
+    std::string_view target = msg.params[0];
+    SharedBuffer shared = formatLine({line, "\r\n"});
+
+    if (target.find(',') != std::string_view::npos) {
+        // The sending server resolved the list; whatever no longer
+        // resolves here is skipped
+        std::pmr::vector<MessageTarget> resolved(&Shard::current()->arena);
+        std::string_view list = target;
+        while (nextItem(list, target)) {
+            MessageTarget entry = {nullptr, nullptr};
+            if (target[0] == '#') {
+                entry.channel = findChannel(target);
+            } else {
+                entry.user = getClientByNickname(target);
+            }
+            if ((entry.channel || entry.user) && std::find(resolved.begin(), resolved.end(), entry) == resolved.end()) {
+                resolved.push_back(entry);
+            }
+        }
+        deliver(user, resolved, shared, link);
+    } else if (target[0] == '#') {
+        Channel* channel = findChannel(target);
+        if (!channel) return;
+        channel->broadcast(shared, user);
+        channel->relay(shared, link);
+        recordLine(channel, shared);
+    } else {
+        Client* target_client = getClientByNickname(target);
+        if (target_client && target_client->via != link) {
+            target_client->sendMessage(shared);
         }
     }
-    return nullptr;
 }
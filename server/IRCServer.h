@@ -2,49 +2,198 @@
 #define IRCSERVER_H
 
 #include <vector>
-#include <map>
+#include <unordered_map>
 #include <string>
-#include <netinet/in.h>
+#include <string_view>
+#include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <memory_resource>
+#include <sys/socket.h>
+#include "Casemap.h"
 #include "Client.h"
 #include "Channel.h"
+#include "Config.h"
+#include "FanoutPool.h"
+#include "History.h"
+#include "HotRestart.h"
+#include "MessageLog.h"
+#include "Message.h"
+#include "MetricsEndpoint.h"
+#include "Replies.h"
+#include "Shard.h"
+#include "TlsContext.h"
 
-#define PORT 6667
-#define BUFFER_SIZE 512
+class IRCServer;
 
+// One resolved target of a PRIVMSG or NOTICE: a channel or a user
+struct MessageTarget {
+    Channel* channel;
+    Client* user;
+
+    bool operator==(const MessageTarget& other) const {
+        return channel == other.channel && user == other.user;
+    }
+};
+
+typedef void (IRCServer::*CommandHandler)(Client* client, const Message& msg);
+
+// Shared IRC state and command handling. Socket I/O runs on the shards;
+// nicknames, channels and membership are guarded by state_lock. Commands
+// that only read that state (PRIVMSG, NOTICE, PING, PONG, CHATHISTORY) take it
+// shared, the rest take it exclusively.
+//
+// Servers can be linked into a network that shares nicknames, membership
+// and channel traffic. The links form a tree, so every other server sits
+// behind exactly one direct link, and passing a line to every link but the
+// one it came in on delivers it to each server once. Users on other
+// servers are Client objects without a socket (see Client::via).
 class IRCServer {
 private:
-    int server_fd;
-    std::vector<Client*> clients;
-    std::map<std::string, Channel*> channels;
-
-    fd_set readfds;
-    int max_sd;
-
-    void setupServerSocket();
-    void prepareSelect();
-    void handleNewConnections();
-    void handleClientMessages();
-    void disconnectClient(std::vector<Client*>::iterator& it);
-    void disconnectClient(Client* client);
-    void processCommand(Client* client, const std::string& command_line);
-    void parseCommand(const std::string& line, std::string& command, std::vector<std::string>& params);
-    void handleNICK(Client* client, const std::vector<std::string>& params);
-    void handleUSER(Client* client, const std::vector<std::string>& params);
-    void handlePING(Client* client, const std::vector<std::string>& params);
-    void handleJOIN(Client* client, const std::vector<std::string>& params);
-    void handlePART(Client* client, const std::vector<std::string>& params);
-    void handlePRIVMSG(Client* client, const std::vector<std::string>& params);
-    void handleQUIT(Client* client, const std::vector<std::string>& params);
-    void handleNOTICE(Client* client, const std::vector<std::string>& params);
+    ServerConfig config;
+    std::vector<Shard*> shards;
+    MetricsEndpoint* metrics_endpoint;   // Null unless a metrics socket is configured
+    MessageLog* message_log;             // Null unless a log directory is configured
+    FanoutPool* fanout;                  // Null unless fan-out workers are configured
+    HotRestart* hot_restart;             // Null unless an upgrade socket is configured
+    TlsContext* tls;                     // Null unless a certificate is configured
+    RegistrationBurst registration_burst;
+    time_t start_time;
+
+    std::shared_mutex state_lock;
+    // Keys view the client's nickname and the channel's name; both are
+    // compared under the casemapping, so lookups need no folded copy
+    std::unordered_map<std::string_view, Client*, IrcNameHash, IrcNameEqual> nicknames;
+    std::unordered_map<std::string_view, Channel*, IrcNameHash, IrcNameEqual> channels;
+    uint64_t visit_epoch;                // Deduplicates peer walks; exclusive lock only
+    History history;                     // Recent channel lines, for JOIN and CHATHISTORY
+
+    // Every other server in the network, and the direct link it is behind
+    struct RemoteServer {
+        Client* via;
+        std::string uplink;        // Server it is attached to
+        int hops;
+    };
+    std::unordered_map<std::string, RemoteServer> servers;
+    std::vector<Client*> links;          // Established direct links
+
+    // Links this server initiates (--link), reconnected by maintainLinks
+    struct OutgoingLink {
+        std::string host;
+        struct sockaddr_storage address;   // Resolved once at startup
+        socklen_t address_length;
+        Client* client;            // Null while not connected
+        uint64_t next_attempt;     // monotonicNs
+    };
+    std::vector<OutgoingLink> outgoing;
+
+    // Shards stop at the end of their batch while pausing is set
+    std::atomic<bool> pausing;
+    std::mutex pause_lock;
+    std::condition_variable pause_cv;
+    size_t parked;
+
+    // Open connections per peer address, for admission
+    std::mutex admission_lock;
+    std::unordered_map<std::string, int> connections_per_ip;
+
+    void handleNICK(Client* client, const Message& msg);
+    void handleUSER(Client* client, const Message& msg);
+    void handlePING(Client* client, const Message& msg);
+    void handlePONG(Client* client, const Message& msg);
+    void handleJOIN(Client* client, const Message& msg);
+    void joinChannel(Client* client, std::string_view channel_name);
+    void handlePART(Client* client, const Message& msg);
+    void partChannel(Client* client, std::string_view channel_name);
+    void handleNAMES(Client* client, const Message& msg);
+    void sendNames(Client* client, Channel* channel);
+    void handlePRIVMSG(Client* client, const Message& msg);
+    void handleQUIT(Client* client, const Message& msg);
+    void handleNOTICE(Client* client, const Message& msg);
+    void sendText(Client* client, std::string_view command, std::string_view targets,
+                  std::string_view text, bool replies);
+    size_t deliver(Client* sender, const std::pmr::vector<MessageTarget>& targets,
+                   const SharedBuffer& line, Client* from_link);
+    void handleOPER(Client* client, const Message& msg);
+    void handleSTATS(Client* client, const Message& msg);
+    void handleCHATHISTORY(Client* client, const Message& msg);
+    void handlePASS(Client* client, const Message& msg);
+    void handleSERVER(Client* client, const Message& msg);
     void checkRegistration(Client* client);
-    void broadcastToAll(const std::string& message, Client* sender = nullptr);
-    bool isValidNickname(const std::string& nick);
-    Client* getClientByNickname(const std::string& nickname);
+    void broadcastToPeers(Client* client, const SharedBuffer& message, bool include_self);
+    void removeUser(Client* user, const SharedBuffer& quit_line);
+
+    // Server-to-server protocol, on the link's shard. Lines from a link name
+    // their sender in the prefix and are passed on byte for byte.
+    void processLinkLine(Client* link, std::string_view line);
+    void linkSERVER(Client* link, const Message& msg);
+    void linkSQUIT(Client* link, const Message& msg);
+    void linkNICK(Client* link, const Message& msg, std::string_view line);
+    void linkKILL(Client* link, const Message& msg);
+    void linkMembership(Client* link, const Message& msg, std::string_view line);
+    void linkQUIT(Client* link, const Message& msg, std::string_view line);
+    void linkMessage(Client* link, const Message& msg, std::string_view line);
+    void acceptLink(Client* link, const std::string& name);
+    void sendHandshake(Client* link);
+    void sendBurst(Client* link);
+    void dropLink(Client* link);
+    void propagate(const SharedBuffer& line, Client* except);
+    void introduce(Client* user, Client* except);
+    void killUser(Client* user, Client* from_link, const std::string& reason);
+    bool resolveCollision(Client* existing, time_t ts, const std::string& server);
+    Client* remoteSender(Client* link, const Message& msg);
+    const std::string& homeServer(const Client* client) const;
+    Channel* findChannel(std::string_view name);
+    void recordLine(Channel* channel, const SharedBuffer& line);
+    void leaveChannel(Client* client, Channel* channel);
+    void renamed(Client* client);
+    bool isValidNickname(std::string_view nick);
+    bool isValidChannelName(std::string_view name);
+    Client* getClientByNickname(std::string_view nickname);
+
+    // Hot restart
+    void pauseShards();
+    void resumeShards();
+    std::string snapshot(std::vector<int>& fds, size_t& client_count);
+    void restore(const std::string& snapshot, const std::vector<int>& fds);
+    // Open the message log, if there is one; exits on failure
+    void startMessageLog();
 
 public:
-    IRCServer();
+    IRCServer(const ServerConfig& config);
     ~IRCServer();
     void start();
+
+    // Called from the shard that owns client. Returns the flood-control
+    // cost of the command.
+    unsigned processCommand(Client* client, std::string_view command_line);
+    void unlinkClient(Client* client);
+
+    // Hands a shard's batch of channel lines to the message log; thread-safe
+    void submitLog(std::vector<LogRecord>&& batch);
+
+    // Connect configured links that are down. Called periodically from the
+    // first shard's thread.
+    void maintainLinks(Shard* shard);
+
+    // Hot restart, old side: pause every shard, send the state and sockets
+    // to the successor on conn and exit. Returns, with service resumed, if
+    // the successor fails. Called from the HotRestart thread.
+    void handOff(int conn);
+    bool pauseRequested() const { return pausing.load(std::memory_order_relaxed); }
+    // Called by a shard's own thread; blocks until the pause ends
+    void parkShard();
+
+    // Per-IP admission; thread-safe. Every admitted connection must be
+    // released when it closes.
+    bool admitConnection(const std::string& ip);
+    void releaseConnection(const std::string& ip);
+
+    // Every shard's metrics plus server gauges, in Prometheus text format.
+    // Safe from any thread.
+    std::string metricsText();
 };
 
 #endif // IRCSERVER_H
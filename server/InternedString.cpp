@@ -0,0 +1,52 @@
+#include "InternedString.h"
+#include <mutex>
+#include <unordered_map>
+
+struct InternedString::Entry {
+    std::string value;
+    size_t refs;
+};
+
+// Keyed by views of the entries' own strings. Reference counts change
+// under the same lock, so a lookup never finds an entry on its way out.
+static std::mutex table_lock;
+static std::unordered_map<std::string_view, InternedString::Entry*>* table;
+
+static const std::string empty_string;
+
+InternedString::Entry* InternedString::acquire(std::string_view value) {
+    if (value.empty()) return nullptr;
+    std::lock_guard<std::mutex> lock(table_lock);
+    if (!table) {
+        // Never freed: interned strings live in objects destroyed at exit
+        table = new std::unordered_map<std::string_view, Entry*>();
+    }
+    auto it = table->find(value);
+    if (it != table->end()) {
+        ++it->second->refs;
+        return it->second;
+    }
+    Entry* entry = new Entry{std::string(value), 1};
+    table->emplace(entry->value, entry);
+    return entry;
+}
+
+void InternedString::release(Entry* entry) {
+    if (!entry) return;
+    std::lock_guard<std::mutex> lock(table_lock);
+    if (--entry->refs == 0) {
+        table->erase(entry->value);
+        delete entry;
+    }
+}
+
+InternedString::InternedString(const InternedString& other) : entry(other.entry) {
+    if (entry) {
+        std::lock_guard<std::mutex> lock(table_lock);
+        ++entry->refs;
+    }
+}
+
+const std::string& InternedString::str() const {
+    return entry ? entry->value : empty_string;
+}
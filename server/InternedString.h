@@ -0,0 +1,50 @@
+#ifndef INTERNEDSTRING_H
+#define INTERNEDSTRING_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+// A string kept once for every holder of the same value. Connections from
+// one address, or remote users of one server, each hold a pointer to a
+// shared entry rather than their own copy; the entry goes with its last
+// holder. Assigning takes a global lock, so this is for values that are
+// set once per connection, not per message.
+class InternedString {
+public:
+    InternedString() : entry(nullptr) {}
+    InternedString(std::string_view value) : entry(acquire(value)) {}
+    InternedString(const std::string& value) : entry(acquire(value)) {}
+    InternedString(const char* value) : entry(acquire(value)) {}
+    InternedString(const InternedString& other);
+    InternedString(InternedString&& other) noexcept : entry(other.entry) { other.entry = nullptr; }
+    InternedString& operator=(InternedString other) noexcept {
+        std::swap(entry, other.entry);
+        return *this;
+    }
+    ~InternedString() { release(entry); }
+
+    const std::string& str() const;
+    operator const std::string&() const { return str(); }
+    operator std::string_view() const { return str(); }
+    bool empty() const { return str().empty(); }
+    size_t size() const { return str().size(); }
+
+    bool operator==(const InternedString& other) const { return entry == other.entry; }
+    bool operator!=(const InternedString& other) const { return entry != other.entry; }
+
+    struct Entry;                  // Defined in InternedString.cpp
+
+private:
+    Entry* entry;                  // Null for the empty string
+
+    static Entry* acquire(std::string_view value);
+    static void release(Entry* entry);
+};
+
+inline std::ostream& operator<<(std::ostream& out, const InternedString& value) {
+    return out << value.str();
+}
+
+#endif // INTERNEDSTRING_H
@@ -0,0 +1,73 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Lock-free multi-producer, single-consumer queue. Producers push onto an
+// atomic list head with CAS; the consumer takes the whole list in one
+// exchange and reverses it, so items come out in push order and every
+// producer's items keep their relative order.
+template <typename T>
+class MPSCQueue {
+public:
+    MPSCQueue() : head(nullptr) {}
+
+    ~MPSCQueue() {
+        drain([](T&) {});
+    }
+
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    // Thread-safe. Returns true if the queue was empty, in which case the
+    // producer is responsible for waking the consumer.
+    bool push(T value) {
+        Node* node = new Node{std::move(value), nullptr};
+        Node* old = head.load(std::memory_order_relaxed);
+        do {
+            node->next = old;
+        } while (!head.compare_exchange_weak(old, node,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+        return old == nullptr;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_relaxed) == nullptr;
+    }
+
+    // Consumer only. Hands every queued item to fn in push order.
+    template <typename F>
+    size_t drain(F&& fn) {
+        Node* list = head.exchange(nullptr, std::memory_order_acquire);
+
+        Node* ordered = nullptr;
+        while (list) {
+            Node* next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+        }
+
+        size_t count = 0;
+        while (ordered) {
+            Node* next = ordered->next;
+            fn(ordered->value);
+            delete ordered;
+            ordered = next;
+            ++count;
+        }
+        return count;
+    }
+
+private:
+    struct Node {
+        T value;
+        Node* next;
+    };
+
+    std::atomic<Node*> head;
+};
+
+#endif // MPSCQUEUE_H
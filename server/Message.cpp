@@ -0,0 +1,60 @@
+#include "Message.h"
+
+bool parseMessage(std::string_view line, Message& msg) {
+    size_t pos = 0;
+    size_t len = line.size();
+    msg.param_count = 0;
+    msg.prefix = std::string_view();
+    msg.command = std::string_view();
+
+    // Skip leading spaces
+    while (pos < len && line[pos] == ' ') ++pos;
+
+    // Check for prefix
+    if (pos < len && line[pos] == ':') {
+        size_t start = ++pos;
+        while (pos < len && line[pos] != ' ') ++pos;
+        if (pos == len) {
+            // Malformed message; no command after prefix
+            return false;
+        }
+        msg.prefix = line.substr(start, pos - start);
+        while (pos < len && line[pos] == ' ') ++pos;
+    }
+
+    // Extract command
+    size_t start = pos;
+    while (pos < len && line[pos] != ' ') ++pos;
+    msg.command = line.substr(start, pos - start);
+    if (msg.command.empty()) return false;
+
+    // Extract parameters
+    while (pos < len) {
+        while (pos < len && line[pos] == ' ') ++pos;
+        if (pos == len) break;
+
+        // A ':' marks the trailing parameter, and the 15th parameter always
+        // takes the rest of the line
+        if (line[pos] == ':' || msg.param_count == MAX_PARAMS - 1) {
+            if (line[pos] == ':') ++pos;
+            msg.params[msg.param_count++] = line.substr(pos);
+            break;
+        }
+
+        start = pos;
+        while (pos < len && line[pos] != ' ') ++pos;
+        msg.params[msg.param_count++] = line.substr(start, pos - start);
+    }
+    return true;
+}
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        char x = a[i], y = b[i];
+        if (x >= 'a' && x <= 'z') x = x - 'a' + 'A';
+        if (y >= 'a' && y <= 'z') y = y - 'a' + 'A';
+        if (x != y) return false;
+    }
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+
+#define MAX_PARAMS 15              // RFC 1459/2812 parameter limit
+
+// A parsed IRC line. Every field is a view into the line it was parsed
+// from, so a Message must not outlive that line.
+struct Message {
+    std::string_view prefix;
+    std::string_view command;
+    std::string_view params[MAX_PARAMS];
+    size_t param_count = 0;
+};
+
+// Split line into prefix, command and parameters in a single pass without
+// allocating. Returns false if the line carries no command.
+bool parseMessage(std::string_view line, Message& msg);
+
+// Case-insensitive FNV-1a over a command name. It is constexpr so command
+// names can be used as switch labels; duplicate labels fail to compile,
+// which makes the hash perfect over the dispatched command set.
+constexpr uint32_t commandHash(std::string_view name) {
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        if (c >= 'a' && c <= 'z') c = c - 'a' + 'A';
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b);
+
+#endif // MESSAGE_H
@@ -0,0 +1,270 @@
+#include "MessageLog.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+MessageLog::MessageLog(const std::string& dir, int fsync_ms)
+    : records_dropped(0), directory(dir),
+      fsync_interval_ns(static_cast<uint64_t>(fsync_ms) * 1000000),
+      queued(0), stopping(false), stop_fd(-1),
+      segment_seq(0), segment_fd(-1), index_fd(-1), segment_bytes(0), pending_records(0) {}
+
+MessageLog::~MessageLog() {
+    stop();
+    closeSegment();
+    if (stop_fd >= 0) {
+        close(stop_fd);
+    }
+}
+
+void MessageLog::stop() {
+    if (writer.joinable()) {
+        // The writer drains and syncs everything queued before it exits
+        stopping.store(true, std::memory_order_release);
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof one) == -1) {
+            perror("log eventfd write");
+        }
+        writer.join();
+        closeSegment();
+    }
+}
+
+bool MessageLog::start() {
+    if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST) {
+        perror("log mkdir");
+        return false;
+    }
+
+    // Never append to an existing segment; start after the newest one
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        perror("log opendir");
+        return false;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        char* end;
+        uint64_t seq = strtoull(entry->d_name, &end, 10);
+        if (end != entry->d_name && strcmp(end, ".log") == 0 && seq > segment_seq) {
+            segment_seq = seq;
+        }
+    }
+    closedir(dir);
+
+    if (stop_fd < 0) {
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (stop_fd == -1) {
+            perror("log eventfd");
+            return false;
+        }
+    } else {
+        // Left over from the last stop()
+        uint64_t count;
+        if (read(stop_fd, &count, sizeof count) == -1) {
+            perror("log eventfd read");
+        }
+    }
+    if (!openSegment()) {
+        return false;
+    }
+
+    stopping.store(false, std::memory_order_relaxed);
+    writer = std::thread(&MessageLog::run, this);
+    std::cout << "Logging channel traffic to " << directory << std::endl;
+    return true;
+}
+
+void MessageLog::submit(std::vector<LogRecord>&& batch) {
+    size_t n = batch.size();
+    if (queued.load(std::memory_order_relaxed) + n > LOG_QUEUE_LIMIT) {
+        records_dropped.fetch_add(n, std::memory_order_relaxed);
+        batch.clear();
+        return;
+    }
+    queued.fetch_add(n, std::memory_order_relaxed);
+    // No wakeup: the writer polls on its own schedule, so a producer never
+    // makes a system call here
+    queue.push(std::move(batch));
+}
+
+void MessageLog::run() {
+    uint64_t last_sync = monotonicNs();
+    bool dirty = false;
+
+    while (true) {
+        bool stop = stopping.load(std::memory_order_acquire);
+
+        size_t records = 0;
+        queue.drain([&](std::vector<LogRecord>& batch) {
+            for (const LogRecord& record : batch) {
+                append(record);
+            }
+            records += batch.size();
+        });
+        if (records > 0) {
+            writeOut();
+            queued.fetch_sub(records, std::memory_order_relaxed);
+            dirty = true;
+        }
+
+        uint64_t now = monotonicNs();
+        if (dirty && (stop || now - last_sync >= fsync_interval_ns)) {
+            sync();
+            dirty = false;
+            last_sync = now;
+        }
+        if (stop) {
+            break;
+        }
+
+        struct pollfd pfd = {stop_fd, POLLIN, 0};
+        poll(&pfd, 1, LOG_FLUSH_MS);
+    }
+}
+
+void MessageLog::append(const LogRecord& record) {
+    size_t length = record.line.length();
+    size_t padded = (length + 7) & ~static_cast<size_t>(7);
+    size_t size = sizeof(LogRecordHeader) + padded;
+
+    if (segment_bytes + size > LOG_SEGMENT_SIZE && segment_bytes > sizeof(LogFileHeader)) {
+        writeOut();
+        // Unless a failed write has just moved us to a fresh segment
+        if (segment_bytes > sizeof(LogFileHeader)) {
+            sync();
+            closeSegment();
+            openSegment();
+        }
+    }
+    if (segment_fd < 0) {
+        // The segment could not be opened; openSegment reported why
+        write_errors.add(1);
+        return;
+    }
+
+    LogRecordHeader header = {static_cast<uint32_t>(length), 0, record.time_ms, record.channel_hash};
+    LogIndexEntry entry = {record.time_ms, record.channel_hash, segment_bytes};
+
+    size_t at = data.size();
+    data.resize(at + size);
+    memcpy(&data[at], &header, sizeof header);
+    memcpy(&data[at + sizeof header], record.line.data(), length);
+    memset(&data[at + sizeof header + length], 0, padded - length);
+
+    at = index.size();
+    index.resize(at + sizeof entry);
+    memcpy(&index[at], &entry, sizeof entry);
+
+    segment_bytes += size;
+    ++pending_records;
+}
+
+static bool writeAll(int fd, const std::vector<char>& buffer) {
+    size_t done = 0;
+    while (done < buffer.size()) {
+        ssize_t n = write(fd, buffer.data() + done, buffer.size() - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+void MessageLog::writeOut() {
+    if (segment_fd >= 0 && !data.empty()) {
+        if (writeAll(segment_fd, data) && writeAll(index_fd, index)) {
+            records_written.add(pending_records);
+            bytes_written.add(data.size());
+        } else {
+            perror("log write");
+            write_errors.add(1);
+            // Part of the batch may be on disk, and the offsets handed out
+            // assumed all of it would be: carry on in a new segment rather
+            // than index records at the wrong place
+            closeSegment();
+            openSegment();
+        }
+    }
+    // Capacity is kept, so steady state allocates nothing
+    data.clear();
+    index.clear();
+    pending_records = 0;
+}
+
+void MessageLog::sync() {
+    if (segment_fd < 0) return;
+    uint64_t start = monotonicNs();
+    if (fdatasync(segment_fd) == -1 || fdatasync(index_fd) == -1) {
+        perror("log fdatasync");
+        write_errors.add(1);
+    }
+    fsync_ns.record(monotonicNs() - start);
+}
+
+static int createFile(const std::string& path, const char* magic) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(("log open " + path).c_str());
+        return -1;
+    }
+
+    LogFileHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, magic, sizeof header.magic);
+    header.version = LOG_VERSION;
+    header.header_size = sizeof header;
+    header.created_ms = wallClockMs();
+    if (write(fd, &header, sizeof header) != static_cast<ssize_t>(sizeof header)) {
+        perror(("log write " + path).c_str());
+        close(fd);
+        unlink(path.c_str());
+        return -1;
+    }
+    return fd;
+}
+
+bool MessageLog::openSegment() {
+    ++segment_seq;
+    char name[32];
+    snprintf(name, sizeof name, "/%016llu", static_cast<unsigned long long>(segment_seq));
+    std::string base = directory + name;
+
+    segment_fd = createFile(base + ".log", LOG_MAGIC);
+    index_fd = segment_fd >= 0 ? createFile(base + ".idx", LOG_INDEX_MAGIC) : -1;
+    if (index_fd < 0) {
+        if (segment_fd >= 0) {
+            close(segment_fd);
+            unlink((base + ".log").c_str());
+            segment_fd = -1;
+        }
+        return false;
+    }
+    segment_bytes = sizeof(LogFileHeader);
+
+    // Make the new names themselves durable
+    int dir_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return true;
+}
+
+void MessageLog::closeSegment() {
+    if (segment_fd >= 0) {
+        close(segment_fd);
+        close(index_fd);
+        segment_fd = -1;
+        index_fd = -1;
+    }
+}
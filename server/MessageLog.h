@@ -0,0 +1,120 @@
+#ifndef MESSAGELOG_H
+#define MESSAGELOG_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include "Metrics.h"
+#include "MPSCQueue.h"
+#include "SharedBuffer.h"
+
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)   // Rotate once a segment reaches this
+#define LOG_FLUSH_MS 10                       // How often the writer drains its queue
+#define LOG_QUEUE_LIMIT (1 << 20)             // Records waiting before new ones are dropped
+#define LOG_BATCH_RESERVE 64                  // Initial size of a shard's batch
+
+// On-disk format. A log directory holds numbered segment pairs,
+// 0000000000000001.log and 0000000000000001.idx, each starting with a
+// LogFileHeader. All fields are little-endian and 8-byte aligned, so both
+// files can be mmapped and walked in place.
+//
+// The .log file holds the records: a LogRecordHeader, then the line
+// exactly as it was sent (CRLF included), padded to a multiple of 8.
+// The .idx file holds one LogIndexEntry per record, so a reader can pick
+// out a channel or a time range without touching the lines. Records are in
+// commit order; lines from different threads can be out of time order by
+// up to LOG_FLUSH_MS.
+//
+// channel_hash is IrcNameHash (FNV-1a over the RFC 1459 case-folded name),
+// so it does not depend on how the name was typed. Readers compare the
+// target in the line itself to rule out collisions.
+#define LOG_MAGIC "IRCLOG1"
+#define LOG_INDEX_MAGIC "IRCIDX1"
+#define LOG_VERSION 1
+
+struct LogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t created_ms;
+    uint64_t reserved;
+};
+
+struct LogRecordHeader {
+    uint32_t length;               // Line bytes, excluding padding
+    uint32_t reserved;
+    uint64_t time_ms;
+    uint64_t channel_hash;
+};
+
+struct LogIndexEntry {
+    uint64_t time_ms;
+    uint64_t channel_hash;
+    uint64_t offset;               // Of the LogRecordHeader in the .log file
+};
+
+// A line as handed to the log; holds a reference to the broadcast bytes
+struct LogRecord {
+    uint64_t time_ms;
+    uint64_t channel_hash;
+    SharedBuffer line;
+};
+
+// Append-only log of channel traffic. Shards collect records for a whole
+// event batch and hand them over in one lock-free push; a dedicated thread
+// drains the queue every LOG_FLUSH_MS, writes everything it got with one
+// write per file, and fdatasyncs once per fsync interval (group commit).
+// Nothing on the delivery path waits for the disk: if the writer falls
+// behind by LOG_QUEUE_LIMIT records, new batches are dropped and counted.
+class MessageLog {
+public:
+    MessageLog(const std::string& directory, int fsync_ms);
+    ~MessageLog();
+
+    // Open a new segment after the newest in the directory and start the
+    // writer; false on failure. A stopped log can be started again.
+    bool start();
+    // Write out and sync everything queued, stop the writer and close the
+    // segment. Records submitted meanwhile wait for the next start(). The
+    // destructor does this too.
+    void stop();
+
+    // Thread-safe; takes the records out of batch
+    void submit(std::vector<LogRecord>&& batch);
+
+    // Written by the writer thread; dropped by any thread
+    Counter records_written;
+    Counter bytes_written;
+    Counter write_errors;
+    Histogram fsync_ns;
+    std::atomic<uint64_t> records_dropped;
+
+private:
+    std::string directory;
+    uint64_t fsync_interval_ns;
+    MPSCQueue<std::vector<LogRecord>> queue;
+    std::atomic<size_t> queued;          // Records submitted but not yet written
+    std::atomic<bool> stopping;
+    int stop_fd;                         // eventfd that cuts the writer's sleep short
+    std::thread writer;
+
+    // Writer thread only
+    uint64_t segment_seq;
+    int segment_fd;
+    int index_fd;
+    uint64_t segment_bytes;              // Including data not yet written
+    uint64_t pending_records;            // Records in data
+    std::vector<char> data;
+    std::vector<char> index;
+
+    void run();
+    void append(const LogRecord& record);
+    void writeOut();
+    void sync();
+    bool openSegment();
+    void closeSegment();
+};
+
+#endif // MESSAGELOG_H
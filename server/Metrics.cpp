@@ -0,0 +1,36 @@
+#include "Metrics.h"
+
+const char* const command_names[CMD_COUNT] = {
+    "NICK", "USER", "PING", "JOIN", "PRIVMSG", "PART", "QUIT",
+    "NOTICE", "OPER", "STATS", "CHATHISTORY", "PASS", "SERVER", "PONG", "NAMES", "UNKNOWN"
+};
+
+void HistogramSnapshot::add(const Histogram& histogram) {
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        counts[i] += histogram.counts[i].load(std::memory_order_relaxed);
+    }
+    count += histogram.count.get();
+    sum += histogram.sum.get();
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const {
+    // Buckets are read one by one, so count may run ahead of their total
+    uint64_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        total += counts[i];
+    }
+    if (total == 0) return 0;
+
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen > rank) {
+            if (i < HIST_SUB_BUCKETS) return i;
+            int shift = (i - HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS;
+            uint64_t sub = (i - HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS;
+            return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+        }
+    }
+    return 0;
+}
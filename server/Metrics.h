@@ -0,0 +1,104 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+// Log-linear buckets: 8 per power of two, so a recorded value is within
+// 12.5% of the bucket it lands in, across the whole 64-bit range
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + (64 - HIST_SUB_BITS) * HIST_SUB_BUCKETS)
+
+enum CommandId {
+    CMD_NICK, CMD_USER, CMD_PING, CMD_JOIN, CMD_PRIVMSG, CMD_PART, CMD_QUIT,
+    CMD_NOTICE, CMD_OPER, CMD_STATS, CMD_CHATHISTORY, CMD_PASS, CMD_SERVER,
+    CMD_PONG, CMD_NAMES, CMD_UNKNOWN, CMD_COUNT
+};
+
+extern const char* const command_names[CMD_COUNT];
+
+inline uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// Milliseconds since the epoch, for timestamps that leave the process
+inline uint64_t wallClockMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Written only by the owning shard's thread, read by anyone. A relaxed
+// load and store is enough for that, and avoids a locked instruction.
+struct Counter {
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// HDR-style histogram with the same single-writer rule as Counter
+struct Histogram {
+    std::atomic<uint64_t> counts[HIST_BUCKETS] = {};
+    Counter count;
+    Counter sum;
+
+    static int bucketOf(uint64_t value) {
+        if (value < HIST_SUB_BUCKETS) return static_cast<int>(value);
+        int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+        return HIST_SUB_BUCKETS + shift * HIST_SUB_BUCKETS
+             + static_cast<int>((value >> shift) & (HIST_SUB_BUCKETS - 1));
+    }
+
+    void record(uint64_t value) {
+        std::atomic<uint64_t>& bucket = counts[bucketOf(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        count.add(1);
+        sum.add(value);
+    }
+};
+
+// Histograms from several shards merged for reporting
+struct HistogramSnapshot {
+    uint64_t counts[HIST_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    void add(const Histogram& histogram);
+    // Upper bound of the bucket holding the p-th percentile (0 < p < 100)
+    uint64_t percentile(double p) const;
+};
+
+// Per-shard instrumentation. Every field is written by the shard's own
+// thread only, so recording never contends across shards.
+class Metrics {
+public:
+    Histogram command_ns[CMD_COUNT];     // processCommand time, lock wait included
+    Histogram loop_busy_ns;              // Handling one wakeup, flush included
+    Histogram loop_lag_ns;               // How late the periodic lag probe ran
+    Histogram ready_events;              // Ready fds (or completions) per wakeup
+    Counter bytes_in;
+    Counter bytes_out;
+    Counter connections_accepted;
+    Counter connections_closed;
+    Counter slow_consumer_disconnects;
+    Counter sendq_drops;                 // Lines dropped for slow consumers
+    Counter flood_deferrals;             // Times a client's input was held back
+    Counter connections_rejected;        // Refused by the per-IP limit
+    Counter tls_handshakes;              // Completed, resumed ones included
+    Counter tls_resumptions;             // Handshakes that skipped the certificate
+    Counter tls_ktls_sends;              // Handshakes after which the kernel encrypts
+    Counter tls_failures;                // Handshakes that failed
+    Counter pings_sent;                  // Keepalive PINGs to silent clients
+    Counter ping_timeouts;               // Dropped for not answering one
+    Counter registration_timeouts;       // Dropped before completing NICK/USER
+    Counter idle_disconnects;            // Dropped by the idle timeout
+};
+
+#endif // METRICS_H
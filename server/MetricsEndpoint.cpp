@@ -0,0 +1,94 @@
+#include "MetricsEndpoint.h"
+#include "IRCServer.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+MetricsEndpoint::MetricsEndpoint(IRCServer* srv, const std::string& socket_path)
+    : server(srv), path(socket_path), listen_fd(-1) {}
+
+MetricsEndpoint::~MetricsEndpoint() {
+    if (listen_fd >= 0) {
+        // Wakes the blocking accept so the thread can exit
+        shutdown(listen_fd, SHUT_RDWR);
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+}
+
+bool MetricsEndpoint::start() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        std::cerr << "Metrics socket path too long: " << path << std::endl;
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("metrics socket");
+        return false;
+    }
+
+    // A socket left behind by a previous run would make bind fail
+    unlink(path.c_str());
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(listen_fd, 16) == -1) {
+        perror("metrics bind");
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    thread = std::thread(&MetricsEndpoint::run, this);
+    std::cout << "Metrics available on unix socket " << path << std::endl;
+    return true;
+}
+
+void MetricsEndpoint::run() {
+    while (true) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        serve(fd);
+        close(fd);
+    }
+}
+
+void MetricsEndpoint::serve(int fd) {
+    // Read the request head and ignore it: every path gets the metrics
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t n = recv(fd, buf, sizeof buf, 0);
+        if (n <= 0) break;
+        request.append(buf, n);
+    }
+
+    std::string body = server->metricsText();
+    std::string response = "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "\r\n" + body;
+
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sent += n;
+    }
+}
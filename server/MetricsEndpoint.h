@@ -0,0 +1,31 @@
+#ifndef METRICSENDPOINT_H
+#define METRICSENDPOINT_H
+
+#include <string>
+#include <thread>
+
+class IRCServer;
+
+// Serves the server's metrics in Prometheus text format over HTTP on a
+// local Unix socket, e.g.
+//   curl --unix-socket /run/miniircd.sock http://localhost/metrics
+// Runs on its own thread so a scrape never stalls an event loop.
+class MetricsEndpoint {
+public:
+    MetricsEndpoint(IRCServer* server, const std::string& path);
+    ~MetricsEndpoint();
+
+    // Bind the socket and start serving; false if the socket cannot be set up
+    bool start();
+
+private:
+    IRCServer* server;
+    std::string path;
+    int listen_fd;
+    std::thread thread;
+
+    void run();
+    void serve(int fd);
+};
+
+#endif // METRICSENDPOINT_H
@@ -0,0 +1,110 @@
+#include "NamesCache.h"
+#include "Client.h"
+#include <algorithm>
+#include <cstring>
+
+// Index nodes for every channel, so a part and a join reuse one instead of
+// going to the heap. Joins and parts can happen on any shard, hence the
+// synchronized pool.
+static std::pmr::synchronized_pool_resource index_pool;
+
+NamesCache::NamesCache(size_t line_budget) : chunk_of(&index_pool), budget(line_budget) {}
+
+size_t NamesCache::place(Client* client) {
+    size_t weight = client->nickname.size() + 1;
+    if (chunks.empty() || chunks.back().bytes + weight > budget) {
+        chunks.emplace_back();
+        serialized.emplace_back();
+    }
+    size_t index = chunks.size() - 1;
+    chunks[index].members.push_back(client);
+    chunks[index].bytes += weight;
+    chunk_of[client] = static_cast<uint32_t>(index);
+    return index;
+}
+
+void NamesCache::take(size_t index, Client* client) {
+    // Order within a line does not matter, so swap out of the middle
+    std::vector<Client*>& members = chunks[index].members;
+    auto it = std::find(members.begin(), members.end(), client);
+    *it = members.back();
+    members.pop_back();
+}
+
+void NamesCache::rebuild(size_t index) {
+    Chunk& chunk = chunks[index];
+    SharedBuffer line = SharedBuffer::allocate(chunk.bytes + 2);
+    char* out = line.mutableData();
+    char* start = out;
+    for (Client* member : chunk.members) {
+        // Not yet named; there is nothing to list
+        if (member->nickname.empty()) continue;
+        if (out != start) *out++ = ' ';
+        memcpy(out, member->nickname.data(), member->nickname.size());
+        out += member->nickname.size();
+    }
+    *out++ = '\r';
+    *out++ = '\n';
+    line.setLength(out - start);
+    serialized[index] = std::move(line);
+}
+
+void NamesCache::add(Client* client) {
+    rebuild(place(client));
+}
+
+void NamesCache::remove(Client* client) {
+    auto found = chunk_of.find(client);
+    if (found == chunk_of.end()) return;
+    size_t index = found->second;
+    chunk_of.erase(found);
+    take(index, client);
+    chunks[index].bytes -= client->nickname.size() + 1;
+
+    // Fill the gap from the last chunk, so every line but the last stays
+    // close to full however members come and go
+    size_t last = chunks.size() - 1;
+    if (index != last) {
+        Chunk& tail = chunks[last];
+        while (!tail.members.empty()) {
+            Client* moved = tail.members.back();
+            size_t weight = moved->nickname.size() + 1;
+            if (chunks[index].bytes + weight > budget) break;
+            tail.members.pop_back();
+            tail.bytes -= weight;
+            chunks[index].members.push_back(moved);
+            chunks[index].bytes += weight;
+            chunk_of[moved] = static_cast<uint32_t>(index);
+        }
+        rebuild(index);
+    }
+    if (chunks[last].members.empty()) {
+        chunks.pop_back();
+        serialized.pop_back();
+    } else {
+        rebuild(last);
+    }
+}
+
+void NamesCache::renamed(Client* client) {
+    auto found = chunk_of.find(client);
+    if (found == chunk_of.end()) return;
+    size_t index = found->second;
+
+    // The old length is gone with the old name, so recount this chunk
+    Chunk& chunk = chunks[index];
+    chunk.bytes = 0;
+    for (Client* member : chunk.members) {
+        chunk.bytes += member->nickname.size() + 1;
+    }
+    if (chunk.bytes <= budget) {
+        rebuild(index);
+        return;
+    }
+
+    // A longer name no longer fits; move it to the end
+    take(index, client);
+    chunk.bytes -= client->nickname.size() + 1;
+    rebuild(index);
+    rebuild(place(client));
+}
@@ -0,0 +1,49 @@
+#ifndef NAMESCACHE_H
+#define NAMESCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include "SharedBuffer.h"
+
+class Client;
+
+// A channel's member list, kept serialized for 353 replies. Members are
+// packed into chunks of at most budget bytes ("nick " each), and each chunk
+// holds its names as one ready-made line body, "nick1 nick2 ...\r\n". A
+// join, part or rename rewrites only the chunk it touches, so the cost of
+// keeping this current does not grow with the channel, and sending NAMES
+// is a reference per line. Changed under the exclusive state lock; lines()
+// may be read under the shared one.
+class NamesCache {
+public:
+    explicit NamesCache(size_t line_budget);
+
+    void add(Client* client);
+    void remove(Client* client);
+    // client's nickname has changed
+    void renamed(Client* client);
+
+    // One body per 353 line; the requester's prefix goes in front of each
+    const std::vector<SharedBuffer>& lines() const { return serialized; }
+
+private:
+    struct Chunk {
+        std::vector<Client*> members;
+        size_t bytes = 0;                // Nicknames plus a separator each
+    };
+    std::vector<Chunk> chunks;
+    std::vector<SharedBuffer> serialized;    // Parallel to chunks
+    std::pmr::unordered_map<Client*, uint32_t> chunk_of;   // Nodes from a shared pool
+    size_t budget;
+
+    // Put client in the last chunk, or a new one if it does not fit, and
+    // return which chunk that was
+    size_t place(Client* client);
+    void take(size_t index, Client* client);
+    void rebuild(size_t index);
+};
+
+#endif // NAMESCACHE_H
@@ -0,0 +1,77 @@
+#include "RecvBuffer.h"
+#include <cstring>
+#include <algorithm>
+
+RecvBuffer::RecvBuffer(size_t capacity, size_t max_capacity)
+    : initial(capacity), limit(max_capacity), start(0), scan(0), end(0), discarding(false) {}
+
+char* RecvBuffer::writePtr() {
+    if (!data) {
+        data = SharedBuffer::allocate(initial);
+    }
+    char* base = data.mutableData();
+    if (start > 0 && (start == end || writable() < MAX_LINE_LENGTH)) {
+        // At most one partial line is left, so this moves < MAX_LINE_LENGTH bytes
+        memmove(base, base + start, end - start);
+        scan -= start;
+        end -= start;
+        start = 0;
+    }
+    if (writable() < MAX_LINE_LENGTH && data.capacity() < limit) {
+        // Lines are being held back rather than consumed
+        SharedBuffer bigger = SharedBuffer::allocate(std::min(data.capacity() * 2, limit));
+        memcpy(bigger.mutableData(), base, end);
+        data = std::move(bigger);
+        base = data.mutableData();
+    }
+    return base + end;
+}
+
+void RecvBuffer::release() {
+    if (data && start == end) {
+        data.reset();
+        start = scan = end = 0;
+    }
+}
+
+RecvBuffer::LineStatus RecvBuffer::nextLine(std::string_view& line) {
+    while (true) {
+        const char* base = data ? data.data() : nullptr;
+        const char* nl = scan < end ? static_cast<const char*>(memchr(base + scan, '\n', end - scan)) : nullptr;
+
+        if (!nl) {
+            scan = end;
+            if (!discarding && end - start > MAX_LINE_LENGTH) {
+                // No terminator within the limit: drop what we have and the
+                // remainder of the line as it arrives
+                discarding = true;
+                start = scan = end;
+                return LINE_TOO_LONG;
+            }
+            if (discarding) {
+                start = scan = end;
+            }
+            return NO_LINE;
+        }
+
+        size_t line_end = nl - base;
+        size_t line_start = start;
+        start = scan = line_end + 1;
+
+        if (discarding) {
+            // Tail of a line that was already reported
+            discarding = false;
+            continue;
+        }
+
+        if (start - line_start > MAX_LINE_LENGTH) {
+            return LINE_TOO_LONG;
+        }
+
+        if (line_end > line_start && base[line_end - 1] == '\r') {
+            --line_end;
+        }
+        line = std::string_view(base + line_start, line_end - line_start);
+        return LINE;
+    }
+}
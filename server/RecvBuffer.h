@@ -0,0 +1,54 @@
+#ifndef RECVBUFFER_H
+#define RECVBUFFER_H
+
+#include <string_view>
+#include <cstddef>
+#include "SharedBuffer.h"
+
+#define MAX_LINE_LENGTH 512        // RFC 1459 limit, including the trailing CRLF
+#define RECV_BUFFER_SIZE 4096
+#define RECVQ_LIMIT (16 * 1024)    // Growth cap while lines are held back by flood control
+
+// Persistent per-connection receive buffer. Data is read straight into the
+// buffer and complete lines are handed out as views into it, so framing
+// never copies. A view stays valid until the next call to writePtr().
+// The buffer grows up to limit only while complete lines are left unread.
+// Storage is taken from the line buffer pools on the first read and given
+// back by release() once everything has been consumed, so a connection that
+// is not sending holds no buffer at all.
+class RecvBuffer {
+public:
+    enum LineStatus {
+        NO_LINE,                   // Need more data
+        LINE,                      // line holds a complete line, terminator stripped
+        LINE_TOO_LONG              // An over-long line was discarded
+    };
+
+    RecvBuffer(size_t capacity = RECV_BUFFER_SIZE, size_t limit = RECVQ_LIMIT);
+
+    // Free space for the next recv(), compacting consumed bytes first.
+    // writable() is 0 once held-back input has reached the limit.
+    char* writePtr();
+    size_t writable() const { return data ? data.capacity() - end : 0; }
+    void commit(size_t n) { end += n; }
+
+    LineStatus nextLine(std::string_view& line);
+    size_t pending() const { return end - start; }
+    // Everything received but not yet handed out as a line
+    std::string_view unread() const {
+        return data ? std::string_view(data.data() + start, end - start) : std::string_view();
+    }
+    // Return the storage to the pool if nothing is left unread
+    void release();
+
+private:
+    SharedBuffer data;             // Never shared; only the pooling is used
+    size_t initial;                // Capacity taken on the next read
+    size_t limit;
+    size_t start;                  // First unconsumed byte
+    size_t scan;                   // Bytes before this hold no '\n'
+    size_t end;                    // One past the last received byte
+    bool discarding;               // Skipping the rest of an over-long line
+};
+
+#endif // RECVBUFFER_H
@@ -0,0 +1,107 @@
+#include "Replies.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+static char* append(char* out, std::string_view part) {
+    memcpy(out, part.data(), part.size());
+    return out + part.size();
+}
+
+static std::string server_name = "miniircd";
+static std::string server_prefix = ":miniircd ";
+
+void setServerName(const std::string& name) {
+    server_name = name;
+    server_prefix = ":" + name + " ";
+}
+
+const std::string& serverName() {
+    return server_name;
+}
+
+const std::string& serverPrefix() {
+    return server_prefix;
+}
+
+SharedBuffer formatReply(const ReplyTemplate& reply, std::string_view nick) {
+    if (nick.empty()) nick = "*";
+    size_t total = server_prefix.size() + reply.head.size() + nick.size() + reply.tail.size();
+    SharedBuffer buffer = SharedBuffer::allocate(total);
+    char* out = buffer.mutableData();
+    out = append(out, server_prefix);
+    out = append(out, reply.head);
+    out = append(out, nick);
+    append(out, reply.tail);
+    buffer.setLength(total);
+    return buffer;
+}
+
+SharedBuffer formatReply(const ReplyTemplate& reply, std::string_view nick, std::string_view arg) {
+    if (nick.empty()) nick = "*";
+    size_t total = server_prefix.size() + reply.head.size() + nick.size() + 1 + arg.size() + reply.tail.size();
+    SharedBuffer buffer = SharedBuffer::allocate(total);
+    char* out = buffer.mutableData();
+    out = append(out, server_prefix);
+    out = append(out, reply.head);
+    out = append(out, nick);
+    *out++ = ' ';
+    out = append(out, arg);
+    append(out, reply.tail);
+    buffer.setLength(total);
+    return buffer;
+}
+
+void RegistrationBurst::add(std::string_view code, std::string_view text) {
+    // Each line ends the current segment at its nickname and starts the next
+    segments.back().append(server_prefix).append(code).append(" ");
+    segments.emplace_back(" :");
+    segments.back().append(text).append("\r\n");
+}
+
+bool RegistrationBurst::load(const std::string& path) {
+    std::vector<std::string> motd;
+    if (path.empty()) {
+        motd.push_back("Welcome to the mini IRC server!");
+    } else {
+        std::ifstream file(path);
+        if (!file) {
+            std::cerr << "Cannot read MOTD file " << path << std::endl;
+            return false;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            // Stray CRs (DOS line endings) would end the reply early
+            line.erase(std::remove_if(line.begin(), line.end(), [](char c) { return c == '\0' || c == '\r'; }),
+                       line.end());
+            motd.push_back(line.substr(0, MOTD_LINE_MAX));
+        }
+    }
+
+    segments.assign(1, std::string());
+    add("001", "Welcome to the mini IRC server");
+    add("375", "- " + server_name + " Message of the day - ");
+    for (const std::string& line : motd) {
+        add("372", "- " + line);
+    }
+    add("376", "End of /MOTD command.");
+
+    fixed_length = 0;
+    for (const std::string& segment : segments) {
+        fixed_length += segment.size();
+    }
+    return true;
+}
+
+SharedBuffer RegistrationBurst::format(std::string_view nick) const {
+    size_t total = fixed_length + nick.size() * (segments.size() - 1);
+    SharedBuffer buffer = SharedBuffer::allocate(total);
+    char* out = append(buffer.mutableData(), segments[0]);
+    for (size_t i = 1; i < segments.size(); ++i) {
+        out = append(out, nick);
+        out = append(out, segments[i]);
+    }
+    buffer.setLength(total);
+    return buffer;
+}
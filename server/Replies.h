@@ -0,0 +1,74 @@
+#ifndef REPLIES_H
+#define REPLIES_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "SharedBuffer.h"
+
+#define MOTD_LINE_MAX 400          // Bytes of MOTD text per 372 line
+#define SERVER_NAME_MAX 63         // Longest --name, as for a hostname
+
+// Set once at startup, before any shard runs: ":<name> " starts every line
+// the server sends in its own name
+void setServerName(const std::string& name);
+const std::string& serverName();
+const std::string& serverPrefix();
+
+// A numeric reply split around its variable parts. Everything but the
+// server prefix, the nickname and the argument is fixed when the server is
+// compiled, so a reply costs one allocation and a few memcpys:
+//   prefix + head + nick [+ " " + arg] + tail
+struct ReplyTemplate {
+    std::string_view head;         // "401 "
+    std::string_view tail;         // " :No such nick/channel\r\n"
+};
+
+#define REPLY_TEMPLATE(code, text) ReplyTemplate{code " ", " :" text "\r\n"}
+
+inline constexpr ReplyTemplate RPL_TOPIC = REPLY_TEMPLATE("332", "No topic is set");
+inline constexpr ReplyTemplate RPL_ENDOFNAMES = REPLY_TEMPLATE("366", "End of /NAMES list.");
+inline constexpr ReplyTemplate RPL_YOUREOPER = REPLY_TEMPLATE("381", "You are now an IRC operator");
+inline constexpr ReplyTemplate ERR_NOSUCHNICK = REPLY_TEMPLATE("401", "No such nick/channel");
+inline constexpr ReplyTemplate ERR_NOSUCHCHANNEL = REPLY_TEMPLATE("403", "No such channel");
+inline constexpr ReplyTemplate ERR_TOOMANYTARGETS = REPLY_TEMPLATE("407", "Too many targets");
+inline constexpr ReplyTemplate ERR_NOORIGIN = REPLY_TEMPLATE("409", "No origin specified");
+inline constexpr ReplyTemplate ERR_NORECIPIENT = REPLY_TEMPLATE("411", "No recipient given");
+inline constexpr ReplyTemplate ERR_NOTEXTTOSEND = REPLY_TEMPLATE("412", "No text to send");
+inline constexpr ReplyTemplate ERR_INPUTTOOLONG = REPLY_TEMPLATE("417", "Input line was too long");
+inline constexpr ReplyTemplate ERR_UNKNOWNCOMMAND = REPLY_TEMPLATE("421", "Unknown command");
+inline constexpr ReplyTemplate ERR_NONICKNAMEGIVEN = REPLY_TEMPLATE("431", "No nickname given");
+inline constexpr ReplyTemplate ERR_ERRONEUSNICKNAME = REPLY_TEMPLATE("432", "Erroneous nickname");
+inline constexpr ReplyTemplate ERR_NICKNAMEINUSE = REPLY_TEMPLATE("433", "Nickname is already in use");
+inline constexpr ReplyTemplate ERR_NICKCOLLISION = REPLY_TEMPLATE("436", "Nickname collision");
+inline constexpr ReplyTemplate ERR_NOTONCHANNEL = REPLY_TEMPLATE("442", "You're not on that channel");
+inline constexpr ReplyTemplate ERR_NEEDMOREPARAMS = REPLY_TEMPLATE("461", "Not enough parameters");
+inline constexpr ReplyTemplate ERR_ALREADYREGISTRED = REPLY_TEMPLATE("462", "You may not reregister");
+inline constexpr ReplyTemplate ERR_PASSWDMISMATCH = REPLY_TEMPLATE("464", "Password incorrect");
+inline constexpr ReplyTemplate ERR_BADCHANMASK = REPLY_TEMPLATE("476", "Invalid channel name");
+inline constexpr ReplyTemplate ERR_NOPRIVILEGES = REPLY_TEMPLATE("481", "Permission Denied- You're not an IRC operator");
+
+// Splice the variable parts into a fresh line. A client without a
+// nickname yet is addressed as "*".
+SharedBuffer formatReply(const ReplyTemplate& reply, std::string_view nick);
+SharedBuffer formatReply(const ReplyTemplate& reply, std::string_view nick, std::string_view arg);
+
+// The 001 welcome and the MOTD, sent together on registration. The MOTD
+// file is read once at startup and the whole burst is serialized with
+// gaps where the nickname goes, so each registration only fills those in.
+class RegistrationBurst {
+public:
+    // Read the MOTD from path, or use the built-in one if path is empty.
+    // False, with the reason printed, if the file cannot be read.
+    bool load(const std::string& path);
+
+    SharedBuffer format(std::string_view nick) const;
+
+private:
+    std::vector<std::string> segments;  // The nickname goes between each pair
+    size_t fixed_length = 0;
+
+    void add(std::string_view code, std::string_view text);
+};
+
+#endif // REPLIES_H
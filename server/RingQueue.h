@@ -0,0 +1,59 @@
+#ifndef RINGQUEUE_H
+#define RINGQUEUE_H
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+// FIFO over a power-of-two circular array. It only grows until release(),
+// so a queue that has reached its working size stops allocating, unlike
+// std::deque which allocates and frees blocks as items flow through it.
+template <typename T>
+class RingQueue {
+public:
+    RingQueue() : head(0), count(0) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    T& front() { return slots[head]; }
+    const T& operator[](size_t i) const { return slots[(head + i) & (slots.size() - 1)]; }
+
+    void push_back(T value) {
+        if (count == slots.size()) grow();
+        slots[(head + count) & (slots.size() - 1)] = std::move(value);
+        ++count;
+    }
+
+    void pop_front() {
+        slots[head] = T();
+        head = (head + 1) & (slots.size() - 1);
+        --count;
+    }
+
+    // Give the storage back if empty; the next push_back starts small
+    // again. Not for every time the queue drains: that is an allocation
+    // and a free per item for a queue that rarely holds more than one.
+    void release() {
+        if (count == 0) {
+            std::vector<T>().swap(slots);
+            head = 0;
+        }
+    }
+
+private:
+    std::vector<T> slots;
+    size_t head;
+    size_t count;
+
+    void grow() {
+        std::vector<T> bigger(slots.empty() ? 8 : slots.size() * 2);
+        for (size_t i = 0; i < count; ++i) {
+            bigger[i] = std::move(slots[(head + i) & (slots.size() - 1)]);
+        }
+        slots.swap(bigger);
+        head = 0;
+    }
+};
+
+#endif // RINGQUEUE_H
@@ -0,0 +1,1306 @@
+#include "Shard.h"
+#include "IRCServer.h"
+#include "Replies.h"
+#include <iostream>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <netdb.h>
+#include <poll.h>
+#include <climits>
+#include <algorithm>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_COUNT 1024          // Must be a power of two
+#define URING_BUFFER_SIZE 4096
+#define LAG_PROBE_NS (100 * 1000000ull)  // Loop-lag probe interval
+#define ACCEPT_BATCH 128                 // Connections accepted per wakeup at most
+#define URING_CANCEL_BATCH 1024          // Cancels in flight at once when pausing
+
+// io_uring user_data tags, kept in the low bits. Receives and polls also
+// carry the fd and the low half of the client id; sends carry their SendOp
+// pointer.
+#define TAG_ACCEPT 1
+#define TAG_WAKE 2
+#define TAG_RECV 3
+#define TAG_SEND 4
+#define TAG_PROBE 5
+#define TAG_THROTTLE 6
+#define TAG_CANCEL 7
+#define TAG_ACCEPT_TLS 8
+#define TAG_POLL 9                       // A TLS client is readable
+#define TAG_POLL_OUT 10                  // A TLS client can take more output
+#define TAG_MASK 15
+#define TAG_BITS 4
+
+// Shard-wide requests to arm again once the submission queue has room
+#define ARM_ACCEPT 1
+#define ARM_ACCEPT_TLS 2
+#define ARM_WAKE 4
+#define ARM_PROBE 8
+
+static thread_local Shard* current_shard = nullptr;
+
+Shard::Shard(IRCServer* srv, int shard_index, const ServerConfig& cfg, TlsContext* tls_context,
+             int listen_fd, int tls_listen_fd)
+    : index(shard_index),
+      arena(arena_storage, sizeof arena_storage), delivery_epoch(0),
+      server(srv), config(cfg), server_fd(listen_fd), tls(tls_context), tls_fd(tls_listen_fd),
+      ring(nullptr), multishot_recv(true), quiescing(false),
+      wake_value(0), next_probe(0),
+      throttle_timer_armed(false), lost_arms(0), cancels_waiting(0), timers(monotonicNs()),
+      welcome_notice(makeSharedBuffer(serverPrefix() + "NOTICE AUTH :Welcome to miniircd!\r\n")),
+      ping_line(makeSharedBuffer("PING :" + cfg.server_name + "\r\n")) {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    if (server_fd < 0) {
+        server_fd = setupServerSocket(config.port);
+    }
+    if (tls && tls_fd < 0) {
+        tls_fd = setupServerSocket(config.tls_port);
+    }
+}
+
+Shard::~Shard() {
+    for (auto& pair : clients) {
+        close(pair.first);
+        delete pair.second;
+    }
+    if (server_fd >= 0) {
+        close(server_fd);
+    }
+    if (tls_fd >= 0) {
+        close(tls_fd);
+    }
+    close(wake_fd);
+    for (SendOp* op : free_send_ops) {
+        delete op;
+    }
+    delete ring;
+}
+
+Shard* Shard::current() {
+    return current_shard;
+}
+
+void Shard::run() {
+    current_shard = this;
+
+    // The ring is created on the thread that submits to it
+    if (config.io_uring) {
+        ring = new URing();
+        if (!ring->init(URING_ENTRIES, URING_BUFFER_COUNT, URING_BUFFER_SIZE)) {
+            std::cerr << "io_uring unavailable on shard " << index << ", falling back to epoll" << std::endl;
+            delete ring;
+            ring = nullptr;
+        }
+    }
+
+    if (ring) {
+        runUring();
+    } else {
+        runEventLoop();
+    }
+}
+
+void Shard::runEventLoop() {
+    loop.add(wake_fd, false);
+    // Level-triggered: a pending connection is reported again next wakeup
+    if (!loop.add(server_fd, false) || (tls_fd >= 0 && !loop.add(tls_fd, false))) {
+        exit(EXIT_FAILURE);
+    }
+    resumeClients();
+    flushClients();
+
+    next_probe = monotonicNs() + LAG_PROBE_NS;
+    while (true) {
+        // Wake at least once per probe interval so lag is sampled when idle,
+        // and in time to resume throttled clients and fire timers
+        uint64_t now = monotonicNs();
+        uint64_t deadline = nextDeadline();
+        int timeout_ms = now >= deadline ? 0 : static_cast<int>((deadline - now + 999999) / 1000000);
+        int activity = loop.wait(events, timeout_ms);
+        uint64_t woke = monotonicNs();
+        onProbe(woke);
+
+        if (activity < 0) {
+            if (errno == EINTR) continue;
+            perror("event loop wait");
+            break;
+        }
+        if (activity > 0) {
+            metrics.ready_events.record(activity);
+        }
+
+        // Only the descriptors that are actually ready are visited
+        for (const IOEvent& event : events) {
+            if (event.fd == server_fd || event.fd == tls_fd) {
+                handleNewConnections(event.fd);
+            } else if (event.fd == wake_fd) {
+                uint64_t count;
+                while (read(wake_fd, &count, sizeof count) > 0) {}
+            } else {
+                handleClientEvent(event);
+            }
+        }
+
+        serviceThrottled();
+        expireTimers(monotonicNs());
+        drainInbox();
+
+        // Write everything queued during this batch with one pass per client
+        flushClients();
+        submitLog();
+        arena.release();
+        metrics.loop_busy_ns.record(monotonicNs() - woke);
+
+        if (server->pauseRequested()) {
+            park();
+        }
+    }
+}
+
+int Shard::setupServerSocket(int port) {
+    struct addrinfo hints, *res, *p;
+    int fd = -1;
+    int yes = 1;
+    int rv;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET6; // Use AF_INET6 for IPv6
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; // Use my IP
+
+    if ((rv = getaddrinfo(NULL, std::to_string(port).c_str(), &hints, &res)) != 0) {
+        std::cerr << "getaddrinfo: " << gai_strerror(rv) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Loop through all the results and bind to the first we can
+    for(p = res; p != NULL; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            perror("socket");
+            continue;
+        }
+
+        // Allow both IPv4 and IPv6
+        if (p->ai_family == AF_INET6) {
+            if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(int)) == -1) {
+                perror("setsockopt");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+            perror("setsockopt");
+            exit(EXIT_FAILURE);
+        }
+
+        // Every shard binds its own listener; the kernel spreads connections
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt");
+            exit(EXIT_FAILURE);
+        }
+
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(fd);
+            perror("bind");
+            continue;
+        }
+
+        break;
+    }
+
+    if (p == NULL)  {
+        std::cerr << "Failed to bind" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    freeaddrinfo(res); // All done with this structure
+
+    if (listen(fd, SOMAXCONN) == -1) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+void Shard::handleNewConnections(int listener) {
+    // Drain the backlog in batches. The listener is level-triggered, so
+    // whatever is left after ACCEPT_BATCH is reported again next wakeup,
+    // after the clients that are already connected have had their turn.
+    for (int accepted = 0; accepted < ACCEPT_BATCH; ++accepted) {
+        struct sockaddr_storage remoteaddr; // Generic address structure
+        socklen_t addrlen = sizeof remoteaddr;
+
+        int new_socket = accept4(listener, (struct sockaddr *)&remoteaddr, &addrlen,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        std::string ip;
+        if (!admit(new_socket, remoteaddr, ip)) {
+            continue;
+        }
+
+        if (!loop.add(new_socket)) {
+            std::cerr << "Cannot watch socket fd " << new_socket << ", dropping connection" << std::endl;
+            server->releaseConnection(ip);
+            close(new_socket);
+            continue;
+        }
+
+        // Queued like any other output, so a whole batch of accepted
+        // clients is greeted by the one flush pass at the end of the loop
+        Client* client = addClient(new_socket, ip);
+        client->enqueue(welcome_notice);
+        if (listener == tls_fd) {
+            startTls(client);
+        }
+    }
+}
+
+bool Shard::admit(int new_socket, const struct sockaddr_storage& remoteaddr, std::string& ip) {
+    // Get the remote IP address
+    char remoteIP[INET6_ADDRSTRLEN];
+    const void *addr;
+    if (remoteaddr.ss_family == AF_INET) {
+        const struct sockaddr_in *s = (const struct sockaddr_in *)&remoteaddr;
+        addr = &(s->sin_addr);
+    } else { // AF_INET6
+        const struct sockaddr_in6 *s = (const struct sockaddr_in6 *)&remoteaddr;
+        addr = &(s->sin6_addr);
+    }
+    inet_ntop(remoteaddr.ss_family, addr, remoteIP, sizeof remoteIP);
+    ip = remoteIP;
+
+    // Refused before any per-client state exists, so a reconnect storm from
+    // one address costs a hash lookup and a close
+    if (!server->admitConnection(ip)) {
+        static const char refusal[] = "ERROR :Closing Link: Too many connections from your host\r\n";
+        send(new_socket, refusal, sizeof refusal - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(new_socket);
+        metrics.connections_rejected.add(1);
+        return false;
+    }
+    return true;
+}
+
+Client* Shard::addClient(int new_socket, const std::string& ip) {
+    // Sockets arrive non-blocking from accept4 (or the io_uring accept
+    // flags): edge-triggered readiness and the inline flush both need it
+
+    // Create new client
+    Client* new_client = new Client(new_socket, this, config.sendq_limit);
+    new_client->ip = ip;
+    new_client->hostname = ip;
+    new_client->flood_tokens = config.flood_burst;
+    new_client->flood_refill_ns = monotonicNs();
+    new_client->connected_ns = new_client->flood_refill_ns;
+    new_client->last_active_ns = new_client->connected_ns;
+    new_client->last_message_ns = new_client->connected_ns;
+    checkLiveness(new_client, new_client->connected_ns);
+
+    clients[new_socket] = new_client;
+    metrics.connections_accepted.add(1);
+
+    // Not flushed per line; a connection storm would otherwise cost a
+    // write to stdout per client
+    std::cout << "New connection, shard: " << index << ", socket fd: " << new_socket
+              << ", IP: " << new_client->hostname << "\n";
+    return new_client;
+}
+
+void Shard::handleClientEvent(const IOEvent& event) {
+    auto it = clients.find(event.fd);
+    if (it == clients.end()) {
+        // Already removed earlier in this batch
+        return;
+    }
+    Client* client = it->second;
+
+    if (client->ssl) {
+        // Either direction can move a handshake along
+        if (event.readable || event.error || (event.writable && client->tls_handshaking)) {
+            serviceTls(client);
+        }
+    } else if (event.readable || event.error) {
+        handleClientMessages(client);
+    }
+
+    if (event.writable && !client->disconnecting && client->hasPendingOutput()) {
+        if (!client->flush()) {
+            client->disconnect("Write error");
+        }
+    }
+}
+
+// The welcome notice is already queued; it goes out once the handshake is done
+void Shard::startTls(Client* client) {
+    client->ssl = tls->accept(client->fd);
+    client->tls_handshaking = true;
+    if (!client->ssl) {
+        client->disconnect("TLS unavailable");
+    }
+}
+
+// Drive a TLS handshake as far as the socket allows. False if it failed
+// and the client is on its way out.
+bool Shard::continueHandshake(Client* client) {
+    ERR_clear_error();
+    int rc = SSL_do_handshake(client->ssl);
+    if (rc == 1) {
+        client->tls_handshaking = false;
+        client->tls_want_write = false;
+        client->ktls_send = BIO_get_ktls_send(SSL_get_wbio(client->ssl)) == 1;
+        metrics.tls_handshakes.add(1);
+        if (SSL_session_reused(client->ssl)) {
+            metrics.tls_resumptions.add(1);
+        }
+        if (client->ktls_send) {
+            metrics.tls_ktls_sends.add(1);
+        }
+        client->scheduleFlush();
+        return true;
+    }
+    switch (SSL_get_error(client->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        return true;
+    case SSL_ERROR_WANT_WRITE:
+        client->tls_want_write = true;
+        client->scheduleFlush();
+        return true;
+    default:
+        metrics.tls_failures.add(1);
+        client->disconnect("TLS handshake failed");
+        return false;
+    }
+}
+
+// A TLS socket is readable: finish the handshake, then read whatever the
+// socket and OpenSSL hold
+void Shard::serviceTls(Client* client) {
+    if (client->tls_handshaking && !continueHandshake(client)) {
+        return;
+    }
+    if (!client->tls_handshaking) {
+        handleClientMessages(client);
+    }
+}
+
+// Bytes read into dest, 0 if the connection is gone, or -1 if nothing is
+// available right now
+ssize_t Shard::readSocket(Client* client, char* dest, size_t size) {
+    if (client->ssl) {
+        ERR_clear_error();
+        int n = SSL_read(client->ssl, dest, static_cast<int>(std::min(size, static_cast<size_t>(INT_MAX))));
+        if (n > 0) return n;
+        int err = SSL_get_error(client->ssl, n);
+        // ZERO_RETURN is a close_notify; anything else breaks the connection
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? -1 : 0;
+    }
+    while (true) {
+        ssize_t n = recv(client->fd, dest, size, 0);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? -1 : 0;
+    }
+}
+
+void Shard::handleClientMessages(Client* client) {
+    int sd = client->fd;
+    RecvBuffer& buffer = client->recvbuf;
+
+    // Edge-triggered: drain the socket until it would block
+    while (!client->disconnecting) {
+        char* dest = buffer.writePtr();
+        if (buffer.writable() == 0) {
+            // Held-back input reached the receive queue limit
+            client->disconnect("Excess Flood");
+            break;
+        }
+        ssize_t valread = readSocket(client, dest, buffer.writable());
+        if (valread < 0) {
+            break;
+        }
+
+        if (valread == 0) {
+            // Client disconnected or error
+            std::cout << "Client disconnected, fd: " << sd << std::endl;
+            client->disconnect("Client disconnected");
+            break;
+        }
+        buffer.commit(valread);
+        metrics.bytes_in.add(valread);
+        client->last_active_ns = monotonicNs();
+        processInput(client);
+    }
+    // The last writePtr() may have taken storage that the read never used
+    buffer.release();
+}
+
+void Shard::processInput(Client* client) {
+    // A throttled client's lines wait for serviceThrottled(), in order
+    if (client->throttled) return;
+
+    bool limited = config.flood_rate > 0;
+    if (limited) {
+        refillTokens(client, monotonicNs());
+    }
+
+    // Handle complete lines while the bucket has tokens; a trailing partial
+    // line, or everything once the bucket is empty, stays buffered. Server
+    // links are exempt, including the burst that follows their SERVER line.
+    std::string_view line;
+    RecvBuffer::LineStatus status;
+    while (!client->disconnecting) {
+        if (limited && !client->is_link && client->flood_tokens <= 0) {
+            refillTokens(client, monotonicNs());
+            if (client->flood_tokens <= 0) {
+                throttle(client);
+                break;
+            }
+        }
+
+        status = client->recvbuf.nextLine(line);
+        if (status == RecvBuffer::NO_LINE) break;
+        if (status == RecvBuffer::LINE_TOO_LONG) {
+            client->sendMessage(formatReply(ERR_INPUTTOOLONG, client->nickname));
+            continue;
+        }
+        client->flood_tokens -= server->processCommand(client, line);
+    }
+    // Idle between reads, as most clients are most of the time
+    client->recvbuf.release();
+}
+
+void Shard::refillTokens(Client* client, uint64_t now) {
+    double elapsed = (now - client->flood_refill_ns) / 1e9;
+    client->flood_tokens = std::min(config.flood_burst, client->flood_tokens + elapsed * config.flood_rate);
+    client->flood_refill_ns = now;
+}
+
+void Shard::throttle(Client* client) {
+    if (client->recvbuf.pending() == 0) {
+        // Nothing waiting; the next read refills and checks again
+        return;
+    }
+    // Resume once the bucket is back above zero
+    client->throttled = true;
+    client->flood_resume_ns = client->flood_refill_ns
+                            + static_cast<uint64_t>(-client->flood_tokens / config.flood_rate * 1e9) + 1;
+    throttled.push_back(client);
+    metrics.flood_deferrals.add(1);
+}
+
+void Shard::serviceThrottled() {
+    if (throttled.empty()) return;
+
+    uint64_t now = monotonicNs();
+    for (size_t i = 0; i < throttled.size();) {
+        Client* client = throttled[i];
+        if (client->flood_resume_ns > now) {
+            ++i;
+            continue;
+        }
+        throttled[i] = throttled.back();
+        throttled.pop_back();
+        client->throttled = false;
+        // May throttle the client again, appending it with a later deadline
+        processInput(client);
+    }
+}
+
+// Runs when a client's timer fires, and once on arrival to arm it. Each
+// firing works out which deadline is next from the client's timestamps:
+// registration, then a PING once it has been silent for ping_interval,
+// then the disconnect if the PING goes unanswered; the idle timeout runs
+// alongside. Activity only moves the timestamps, so the timer usually
+// fires once per ping_interval and is simply pushed back. Links are only
+// checked for silence, on link_ping_interval; timing one out splits off
+// everything behind it.
+void Shard::checkLiveness(Client* client, uint64_t now) {
+    if (client->disconnecting) return;
+    // Most clients spend most of their time with nothing to send; the
+    // queue's storage goes back once per timer run rather than each time
+    // it drains, which would cost an allocation per line delivered
+    if (client->sendq.empty()) {
+        client->sendq.release();
+    }
+
+    const uint64_t second = 1000000000ull;
+    uint64_t next = UINT64_MAX;
+    bool link = client->is_link;
+    int ping_interval = link ? config.link_ping_interval : config.ping_interval;
+    if (!link && !client->registered && config.registration_timeout > 0) {
+        uint64_t deadline = client->connected_ns + config.registration_timeout * second;
+        if (now >= deadline) {
+            metrics.registration_timeouts.add(1);
+            client->disconnect("Registration timeout");
+            return;
+        }
+        next = deadline;
+    }
+    if (!link && config.idle_timeout > 0) {
+        uint64_t deadline = client->last_message_ns + config.idle_timeout * second;
+        if (now >= deadline) {
+            metrics.idle_disconnects.add(1);
+            client->disconnect("Idle timeout");
+            return;
+        }
+        next = std::min(next, deadline);
+    }
+    if (ping_interval > 0) {
+        if (client->ping_sent_ns > client->last_active_ns) {
+            // Waiting for an answer
+            uint64_t deadline = client->ping_sent_ns + config.pong_timeout * second;
+            if (now >= deadline) {
+                metrics.ping_timeouts.add(1);
+                client->disconnect("Ping timeout: " + std::to_string((now - client->last_active_ns) / second) + " seconds");
+                return;
+            }
+            next = std::min(next, deadline);
+        } else if (now >= client->last_active_ns + ping_interval * second) {
+            client->sendMessage(ping_line);
+            client->ping_sent_ns = now;
+            metrics.pings_sent.add(1);
+            next = std::min(next, now + config.pong_timeout * second);
+        } else {
+            next = std::min(next, client->last_active_ns + ping_interval * second);
+        }
+    }
+    if (next != UINT64_MAX) {
+        timers.schedule(&client->timer, next);
+    }
+}
+
+void Shard::expireTimers(uint64_t now) {
+    timers.advance(now, [this, now](TimerNode* timer) {
+        checkLiveness(static_cast<Client*>(timer->owner), now);
+    });
+}
+
+uint64_t Shard::nextDeadline() const {
+    uint64_t deadline = std::min(next_probe, timers.nextDeadline());
+    for (Client* client : throttled) {
+        deadline = std::min(deadline, client->flood_resume_ns);
+    }
+    return deadline;
+}
+
+void Shard::startDelivery() {
+    if (++delivery_epoch == 0) {
+        // Wrapped; old marks could match again
+        std::fill(delivery_marks.begin(), delivery_marks.end(), 0);
+        delivery_epoch = 1;
+    }
+}
+
+bool Shard::markDelivered(int fd) {
+    if (static_cast<size_t>(fd) >= delivery_marks.size()) {
+        delivery_marks.resize(fd + 1, 0);
+    }
+    if (delivery_marks[fd] == delivery_epoch) return false;
+    delivery_marks[fd] = delivery_epoch;
+    return true;
+}
+
+void Shard::post(Client* client, const SharedBuffer& message, bool close) {
+    if (inbox.push({client->fd, client->id, message, close})) {
+        // First item since the last drain: wake the owning loop
+        wake();
+    }
+}
+
+void Shard::wake() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof one) == -1 && errno != EAGAIN) {
+        perror("eventfd write");
+    }
+}
+
+void Shard::adopt(Client* client) {
+    // Counted as accepted so the open-connections gauge stays right
+    clients[client->fd] = client;
+    metrics.connections_accepted.add(1);
+    // Liveness starts over; the handoff itself is not the client's silence
+    client->connected_ns = monotonicNs();
+    client->last_active_ns = client->connected_ns;
+    client->last_message_ns = client->connected_ns;
+    checkLiveness(client, client->connected_ns);
+}
+
+void Shard::settle() {
+    // Lines other shards posted after our last drain. Killed clients are
+    // left disconnecting and are not handed over.
+    drainInbox();
+}
+
+// Start I/O on clients this loop did not accept itself: those inherited
+// from a previous process, or all of them after an io_uring pause
+void Shard::resumeClients() {
+    for (auto& pair : clients) {
+        Client* client = pair.second;
+        if (ring) {
+            armRecv(client);
+        } else if (!loop.add(client->fd)) {
+            client->disconnect("Cannot watch socket");
+            continue;
+        }
+        // Lines held back by flood control, and output not yet written
+        if (client->recvbuf.pending() > 0) {
+            processInput(client);
+        }
+        if (client->hasPendingOutput() || client->tls_want_write) {
+            client->scheduleFlush();
+        }
+    }
+}
+
+// Hold the loop for a hot restart. Returns if the handoff fails; on
+// success the process exits while we wait.
+void Shard::park() {
+    if (ring) {
+        quiesceUring();
+    }
+    server->parkShard();
+    if (ring) {
+        quiescing = false;
+        throttle_timer_armed = false;
+        lost_arms = 0;
+        armAccept(server_fd);
+        if (tls_fd >= 0) {
+            armAccept(tls_fd);
+        }
+        armWake();
+        armProbe();
+        resumeClients();
+        flushClients();
+    }
+}
+
+void Shard::drainInbox() {
+    inbox.drain([this](Delivery& delivery) {
+        auto it = clients.find(delivery.fd);
+        if (it != clients.end() && it->second->id == delivery.client_id) {
+            it->second->enqueue(delivery.message);
+            if (delivery.close) {
+                it->second->disconnect("Killed");
+            }
+        }
+    });
+}
+
+void Shard::submitLog() {
+    if (log_batch.empty()) return;
+    server->submitLog(std::move(log_batch));
+    log_batch.clear();                   // Moved from; make it definitely empty
+    log_batch.reserve(LOG_BATCH_RESERVE);
+}
+
+void Shard::flushClients() {
+    // Removing a client can queue QUITs for others, so the list may grow
+    for (size_t i = 0; i < flush_list.size(); ++i) {
+        Client* client = flush_list[i];
+        client->flush_pending = false;
+
+        if (!client->sendq_exceeded && !(ring ? submitSend(client) : client->flush())) {
+            client->disconnecting = true;
+            client->quit_reason = "Write error";
+        }
+
+        if (client->disconnecting) {
+            removeClient(client);
+        } else if (!ring) {
+            loop.watchWrite(client->fd, client->wantsWrite());
+        }
+    }
+    flush_list.clear();
+}
+
+// Samples loop lag once per probe interval. The first shard also uses the
+// tick to (re)connect configured server links.
+void Shard::onProbe(uint64_t now) {
+    if (now >= next_probe) {
+        metrics.loop_lag_ns.record(now - next_probe);
+        next_probe = now + LAG_PROBE_NS;
+        if (index == 0) {
+            server->maintainLinks(this);
+        }
+    }
+}
+
+Client* Shard::connectTo(const std::string& host, const struct sockaddr* address, socklen_t length) {
+    int fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("link socket");
+        return nullptr;
+    }
+    // Completes in the background; until then sends would block and are
+    // simply queued, and a refused connection shows up as a read error
+    if (connect(fd, address, length) == -1 && errno != EINPROGRESS) {
+        perror("link connect");
+        close(fd);
+        return nullptr;
+    }
+
+    if (!ring && !loop.add(fd)) {
+        close(fd);
+        return nullptr;
+    }
+    Client* client = addClient(fd, "");
+    client->hostname = host;
+    if (ring) {
+        armRecv(client);
+    }
+    return client;
+}
+
+void Shard::removeClient(Client* client) {
+    if (client->sendq_exceeded) {
+        std::cout << "Max SendQ exceeded, fd: " << client->fd
+                  << ", nickname: " << client->nickname
+                  << ", queued: " << client->sendq_bytes
+                  << ", dropped: " << client->messages_dropped << std::endl;
+        metrics.slow_consumer_disconnects.add(1);
+        client->quit_reason = "Max SendQ exceeded";
+    }
+    metrics.sendq_drops.add(client->messages_dropped);
+    metrics.connections_closed.add(1);
+    if (client->throttled) {
+        throttled.erase(std::find(throttled.begin(), throttled.end(), client));
+    }
+    timers.cancel(&client->timer);
+
+    // Drop shared state first; once that returns no other shard can reach
+    // the client, so it is safe to free
+    server->unlinkClient(client);
+    server->releaseConnection(client->ip);
+
+    if (client->ssl && !client->tls_handshaking && !client->send_inflight) {
+        // close_notify, best effort; without it OpenSSL drops the session
+        // from the cache instead of letting the client resume it
+        SSL_shutdown(client->ssl);
+    }
+    if (ring) {
+        // Ends the multishot receive, which holds its own file reference
+        shutdown(client->fd, SHUT_RDWR);
+    } else {
+        loop.remove(client->fd);
+    }
+    close(client->fd);
+    clients.erase(client->fd);
+    delete client;
+}
+
+void Shard::runUring() {
+    armAccept(server_fd);
+    if (tls_fd >= 0) {
+        armAccept(tls_fd);
+    }
+    armWake();
+    armProbe();
+    resumeClients();
+    flushClients();
+
+    while (true) {
+        // One syscall submits every receive, send and re-arm prepared since
+        // the last iteration and waits for more work, unless completions
+        // set aside last batch are still to be handled
+        if (ring->submitAndWait(deferred_cqes.empty() ? 1 : 0) < 0
+            && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        uint64_t woke = monotonicNs();
+        unsigned ready = reapCompletions();
+        if (ready > 0) {
+            metrics.ready_events.record(ready);
+        }
+
+        serviceThrottled();
+        if (!throttled.empty()) {
+            armThrottleTimer();
+        }
+        // The probe completes every tick, so timers need no request of their own
+        expireTimers(woke);
+        drainInbox();
+
+        // Queue sends for everything produced during this batch
+        flushClients();
+        if (lost_arms) {
+            rearmLost();
+        }
+        submitLog();
+        arena.release();
+        metrics.loop_busy_ns.record(monotonicNs() - woke);
+
+        if (server->pauseRequested()) {
+            park();
+        }
+    }
+}
+
+// A submission entry for the next request. When the queue is full and the
+// kernel will not take it (EBUSY: completions overflowed and the ring has
+// to be reaped first), the completions are moved aside and handled after
+// the current one, and the submit is tried again. Null if that fails too;
+// callers then drop the client or arm again later, rather than crash.
+io_uring_sqe* Shard::nextSqe() {
+    io_uring_sqe* sqe = ring->getSqe();
+    if (sqe) return sqe;
+    ring->forEachCompletion([this](const io_uring_cqe* cqe) {
+        deferred_cqes.push_back(*cqe);
+    });
+    return ring->getSqe();
+}
+
+// Handle everything on the ring, in the kernel's order: completions set
+// aside by nextSqe() came off the ring before the rest
+unsigned Shard::reapCompletions() {
+    handleDeferred();
+    unsigned count = ring->forEachCompletion([this](const io_uring_cqe* cqe) {
+        if (deferred_cqes.empty()) {
+            handleCompletion(cqe);
+        } else {
+            deferred_cqes.push_back(*cqe);
+        }
+    });
+    handleDeferred();
+    return count;
+}
+
+void Shard::handleDeferred() {
+    // Handling these can set more aside; those come after this batch
+    while (!deferred_cqes.empty()) {
+        deferred_batch.swap(deferred_cqes);
+        for (const io_uring_cqe& cqe : deferred_batch) {
+            handleCompletion(&cqe);
+        }
+        deferred_batch.clear();
+    }
+}
+
+void Shard::rearmLost() {
+    unsigned lost = lost_arms;
+    lost_arms = 0;
+    if (lost & ARM_ACCEPT) armAccept(server_fd);
+    if (lost & ARM_ACCEPT_TLS) armAccept(tls_fd);
+    if (lost & ARM_WAKE) armWake();
+    if (lost & ARM_PROBE) armProbe();
+}
+
+void Shard::armAccept(int listener) {
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        lost_arms |= listener == tls_fd ? ARM_ACCEPT_TLS : ARM_ACCEPT;
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = listener == tls_fd ? TAG_ACCEPT_TLS : TAG_ACCEPT;
+}
+
+void Shard::armWake() {
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        lost_arms |= ARM_WAKE;
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wake_value);
+    sqe->len = sizeof wake_value;
+    sqe->user_data = TAG_WAKE;
+}
+
+void Shard::armProbe() {
+    // A pure timeout; how late its completion is handled is the loop lag
+    next_probe = monotonicNs() + LAG_PROBE_NS;
+    probe_timeout.tv_sec = 0;
+    probe_timeout.tv_nsec = LAG_PROBE_NS;
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        lost_arms |= ARM_PROBE;
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&probe_timeout);
+    sqe->len = 1;
+    sqe->user_data = TAG_PROBE;
+}
+
+void Shard::armThrottleTimer() {
+    // One timer for the earliest resume; later ones are picked up when it fires
+    if (throttle_timer_armed) return;
+    uint64_t now = monotonicNs();
+    uint64_t deadline = nextDeadline();
+    uint64_t wait = deadline > now ? deadline - now : 0;
+    throttle_timeout.tv_sec = wait / 1000000000ull;
+    throttle_timeout.tv_nsec = wait % 1000000000ull;
+    // Without an entry it is tried again after the next batch
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&throttle_timeout);
+    sqe->len = 1;
+    sqe->user_data = TAG_THROTTLE;
+    throttle_timer_armed = true;
+}
+
+// Cancel every request in flight and reap the completions, so the ring no
+// longer reads from or writes to any socket. Data that arrives meanwhile
+// is handled as usual; output stays queued.
+//
+// Receives are cancelled one by one by user_data, which the kernel finds
+// by hash. A single match-any cancel rescans every pending request for each
+// one it cancels, which takes seconds with tens of thousands of clients; it
+// only mops up the handful of other requests at the end.
+void Shard::quiesceUring() {
+    quiescing = true;
+    cancels_waiting = 0;
+    auto cancel = [this]() {
+        io_uring_sqe* sqe;
+        while (!(sqe = nextSqe())) {
+            // Let the kernel work through what it has first
+            if (ring->submitAndWait(1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                perror("io_uring_enter");
+                return sqe;
+            }
+            reapCompletions();
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->user_data = TAG_CANCEL;
+        ++cancels_waiting;
+        return sqe;
+    };
+    for (auto& pair : clients) {
+        io_uring_sqe* sqe = cancel();
+        if (sqe) {
+            sqe->addr = recvUserData(pair.second);
+        }
+        if (cancels_waiting == URING_CANCEL_BATCH) {
+            reapCancels();
+        }
+    }
+    io_uring_sqe* sqe = cancel();
+    if (sqe) {
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+    reapCancels();
+
+    drainInbox();
+    flushClients();
+    submitLog();
+    arena.release();
+}
+
+// Submit and handle completions until waiting cancel requests have finished.
+// Requests a cancel stops complete before the cancel itself does.
+void Shard::reapCancels() {
+    while (cancels_waiting > 0) {
+        if (ring->submitAndWait(1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            perror("io_uring_enter");
+            cancels_waiting = 0;
+            break;
+        }
+        reapCompletions();
+    }
+}
+
+uint64_t Shard::recvUserData(const Client* client) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(client->id)) << 32)
+         | (static_cast<uint64_t>(client->fd) << TAG_BITS) | (client->ssl ? TAG_POLL : TAG_RECV);
+}
+
+void Shard::armRecv(Client* client) {
+    // Armed again for every client when the pause ends
+    if (quiescing) return;
+
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        // Nothing would ever read from it
+        client->disconnect("Server overloaded");
+        return;
+    }
+    if (client->ssl) {
+        // OpenSSL reads the socket itself; wait until there is something to read
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = client->fd;
+        sqe->poll32_events = POLLIN | POLLRDHUP;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = recvUserData(client);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URing::BUFFER_GROUP;
+    if (multishot_recv) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+    sqe->user_data = recvUserData(client);
+}
+
+// A TLS client's socket was full; wait until it drains
+void Shard::armPollOut(Client* client) {
+    if (quiescing || client->tls_poll_out) return;
+
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        client->disconnect("Server overloaded");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (recvUserData(client) & ~static_cast<uint64_t>(TAG_MASK)) | TAG_POLL_OUT;
+    client->tls_poll_out = true;
+}
+
+bool Shard::submitSend(Client* client) {
+    if (client->tlsWrites()) {
+        // SSL_write is synchronous; only the wait for a full socket is async
+        if (!client->flush()) return false;
+        if (client->tls_want_write) {
+            armPollOut(client);
+        }
+        return true;
+    }
+    if (quiescing || client->send_inflight || !client->hasPendingOutput()) {
+        return true;
+    }
+
+    // Before the op takes references to the queued lines
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        return false;
+    }
+
+    SendOp* op;
+    if (free_send_ops.empty()) {
+        op = new SendOp();
+    } else {
+        op = free_send_ops.back();
+        free_send_ops.pop_back();
+    }
+
+    int count = client->gatherOutput(op->iov, IOV_BATCH);
+    for (int i = 0; i < count; ++i) {
+        op->lines[i] = client->sendq[i];
+    }
+    op->fd = client->fd;
+    op->client_id = client->id;
+    memset(&op->msg, 0, sizeof op->msg);
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = count;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&op->msg);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = reinterpret_cast<uint64_t>(op) | TAG_SEND;
+
+    client->send_inflight = true;
+    return true;
+}
+
+Client* Shard::findClient(int fd, uint32_t id_low) {
+    auto it = clients.find(fd);
+    if (it == clients.end() || static_cast<uint32_t>(it->second->id) != id_low) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+void Shard::handleCompletion(const io_uring_cqe* cqe) {
+    switch (cqe->user_data & TAG_MASK) {
+    case TAG_ACCEPT:
+    case TAG_ACCEPT_TLS:
+        handleAcceptCompletion(cqe);
+        break;
+    case TAG_WAKE:
+        // The inbox is drained after every batch; just re-arm
+        if (!quiescing) armWake();
+        break;
+    case TAG_RECV:
+        handleRecvCompletion(cqe);
+        break;
+    case TAG_PROBE:
+        onProbe(monotonicNs());
+        if (!quiescing) armProbe();
+        break;
+    case TAG_THROTTLE:
+        // serviceThrottled() runs after this batch and re-arms if needed
+        throttle_timer_armed = false;
+        break;
+    case TAG_SEND:
+        handleSendCompletion(cqe);
+        break;
+    case TAG_CANCEL:
+        if (cancels_waiting > 0) --cancels_waiting;
+        break;
+    case TAG_POLL:
+    case TAG_POLL_OUT:
+        handlePollCompletion(cqe);
+        break;
+    }
+}
+
+void Shard::handleAcceptCompletion(const io_uring_cqe* cqe) {
+    bool secure = (cqe->user_data & TAG_MASK) == TAG_ACCEPT_TLS;
+    if (cqe->res >= 0) {
+        struct sockaddr_storage remoteaddr;
+        socklen_t addrlen = sizeof remoteaddr;
+        std::string ip;
+        if (getpeername(cqe->res, (struct sockaddr *)&remoteaddr, &addrlen) == -1) {
+            close(cqe->res);
+        } else if (admit(cqe->res, remoteaddr, ip)) {
+            Client* client = addClient(cqe->res, ip);
+            client->enqueue(welcome_notice);
+            if (secure) {
+                startTls(client);
+            }
+            if (!client->disconnecting) {
+                armRecv(client);
+            }
+        }
+    } else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+        errno = -cqe->res;
+        perror("accept");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !quiescing) {
+        armAccept(secure ? tls_fd : server_fd);
+    }
+}
+
+// Readiness on a TLS client: readable (multishot) or, after a full socket,
+// writable again
+void Shard::handlePollCompletion(const io_uring_cqe* cqe) {
+    bool out = (cqe->user_data & TAG_MASK) == TAG_POLL_OUT;
+    int fd = static_cast<int>((cqe->user_data >> TAG_BITS) & 0xfffffff);
+    Client* client = findClient(fd, static_cast<uint32_t>(cqe->user_data >> 32));
+    if (!client) return;
+    if (out) {
+        client->tls_poll_out = false;
+    }
+    if (client->disconnecting || cqe->res == -ECANCELED) {
+        return;
+    }
+    if (cqe->res < 0) {
+        std::cout << "Client disconnected, fd: " << fd << std::endl;
+        client->disconnect("Client disconnected");
+        return;
+    }
+
+    if (out) {
+        if (client->tls_handshaking) {
+            continueHandshake(client);
+        } else {
+            client->scheduleFlush();
+        }
+        return;
+    }
+    serviceTls(client);
+    if (!client->disconnecting && !(cqe->flags & IORING_CQE_F_MORE)) {
+        armRecv(client);
+    }
+}
+
+void Shard::handleRecvCompletion(const io_uring_cqe* cqe) {
+    int fd = static_cast<int>((cqe->user_data >> TAG_BITS) & 0xfffffff);
+    Client* client = findClient(fd, static_cast<uint32_t>(cqe->user_data >> 32));
+    bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    uint16_t bid = static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if (client && cqe->res > 0 && has_buffer && !client->disconnecting) {
+        metrics.bytes_in.add(cqe->res);
+        client->last_active_ns = monotonicNs();
+        // Move the bytes into the client's own buffer so the provided buffer
+        // can go straight back to the kernel
+        const char* data = ring->buffer(bid);
+        size_t remaining = cqe->res;
+        while (remaining > 0 && !client->disconnecting) {
+            char* dest = client->recvbuf.writePtr();
+            if (client->recvbuf.writable() == 0) {
+                // Held-back input reached the receive queue limit
+                client->disconnect("Excess Flood");
+                break;
+            }
+            size_t n = std::min(remaining, client->recvbuf.writable());
+            memcpy(dest, data, n);
+            client->recvbuf.commit(n);
+            data += n;
+            remaining -= n;
+            processInput(client);
+        }
+    }
+    if (has_buffer) {
+        ring->recycleBuffer(bid);
+    }
+
+    if (!client || client->disconnecting || cqe->res == -ECANCELED) {
+        return;
+    }
+
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -EINVAL)) {
+        // Client disconnected or error
+        std::cout << "Client disconnected, fd: " << fd << std::endl;
+        client->disconnect("Client disconnected");
+        return;
+    }
+    if (cqe->res == -EINVAL && multishot_recv) {
+        // Kernel predates multishot receive (6.0); re-arm one at a time
+        multishot_recv = false;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        armRecv(client);
+    }
+}
+
+void Shard::handleSendCompletion(const io_uring_cqe* cqe) {
+    SendOp* op = reinterpret_cast<SendOp*>(cqe->user_data & ~static_cast<uint64_t>(TAG_MASK));
+    auto it = clients.find(op->fd);
+    Client* client = (it != clients.end() && it->second->id == op->client_id) ? it->second : nullptr;
+
+    if (client) {
+        client->send_inflight = false;
+        if (cqe->res >= 0) {
+            client->consumeOutput(cqe->res);
+        } else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+            client->disconnect("Write error");
+        }
+        if (client->hasPendingOutput() && !client->flush_pending) {
+            // Short send or more queued meanwhile: go again this batch
+            client->flush_pending = true;
+            flush_list.push_back(client);
+        }
+    }
+
+    for (size_t i = 0; i < op->msg.msg_iovlen; ++i) {
+        op->lines[i].reset();
+    }
+    free_send_ops.push_back(op);
+}
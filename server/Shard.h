@@ -0,0 +1,199 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <memory_resource>
+#include <sys/socket.h>
+#include "Client.h"
+#include "Config.h"
+#include "EventLoop.h"
+#include "MessageLog.h"
+#include "Metrics.h"
+#include "MPSCQueue.h"
+#include "SharedBuffer.h"
+#include "TimerWheel.h"
+#include "TlsContext.h"
+#include "URing.h"
+
+#define ARENA_SIZE (64 * 1024)
+
+class IRCServer;
+
+// A line posted to a client that is owned by another shard
+struct Delivery {
+    int fd;
+    uint64_t client_id;            // Guards against the fd having been reused
+    SharedBuffer message;
+    bool close;                    // Disconnect once message is queued
+};
+
+// An io_uring send in flight. It holds its own references to the queued
+// lines so they outlive the client if it is removed before completion.
+// Aligned so the pointer leaves room for a user_data tag.
+struct alignas(16) SendOp {
+    int fd;
+    uint64_t client_id;
+    struct msghdr msg;
+    struct iovec iov[IOV_BATCH];
+    SharedBuffer lines[IOV_BATCH];
+};
+
+// One event-loop thread. A shard owns its own SO_REUSEPORT listeners (plain
+// and, if configured, TLS), the clients accepted on them and all of their
+// socket I/O. Shared IRC state (nicknames, channels) lives in IRCServer
+// behind its state lock, and lines for clients of other shards travel
+// through their lock-free inbox.
+//
+// I/O runs on the epoll (or select) EventLoop, or, when configured and
+// supported by the kernel, on io_uring: multishot accept, multishot receives
+// into a provided buffer ring, and sends batched into one submission per
+// loop iteration. TLS clients are read through OpenSSL on readiness (a
+// poll request on io_uring) and written through it until kTLS takes over.
+class Shard {
+public:
+    int index;
+    std::vector<Client*> flush_list;     // Clients with queued output or pending removal
+
+    Metrics metrics;                     // Written by this shard only
+
+    // Scratch memory for the current event batch, released in bulk once
+    // the batch has been flushed. Nothing that outlives the batch (queued
+    // lines, state) may point into it.
+    char arena_storage[ARENA_SIZE];
+    std::pmr::monotonic_buffer_resource arena;
+
+    // Channel lines for the message log from the current event batch,
+    // handed over in one push once the batch has been flushed
+    std::vector<LogRecord> log_batch;
+
+    // Recipients of the multi-target line being delivered, marked by socket
+    // fd so each connection gets it once. Only this shard's thread writes
+    // them, so deduplicating needs no more than the shared state lock.
+    std::vector<uint32_t> delivery_marks;
+    uint32_t delivery_epoch;
+    void startDelivery();
+    // True the first time fd is marked since startDelivery()
+    bool markDelivered(int fd);
+
+    // tls is null when there is no TLS listener. listen_fd and tls_listen_fd
+    // are listeners inherited from a previous process; -1 binds new ones.
+    Shard(IRCServer* server, int index, const ServerConfig& config, TlsContext* tls,
+          int listen_fd = -1, int tls_listen_fd = -1);
+    ~Shard();
+
+    void run();
+
+    // Thread-safe: queue message for client, which this shard owns, and
+    // optionally disconnect it afterwards
+    void post(Client* client, const SharedBuffer& message, bool close = false);
+
+    // Interrupt the loop's wait; thread-safe
+    void wake();
+
+    // Hot restart. adopt() takes a client restored from a snapshot, before
+    // the loop starts. While the shard is parked (IRCServer::handOff) the
+    // caller may settle() it, delivering lines still in its inbox, and
+    // read its listener and clients.
+    void adopt(Client* client);
+    void settle();
+    int listener() const { return server_fd; }
+    int tlsListener() const { return tls_fd; }
+    const std::unordered_map<int, Client*>& connections() const { return clients; }
+
+    // Start a non-blocking connection to another server and adopt it as a
+    // client. Owning thread only; null if the connection cannot be started.
+    Client* connectTo(const std::string& host, const struct sockaddr* address, socklen_t length);
+    // Work out the client's next liveness deadline and arm its timer, or
+    // drop it if one has passed. Owning thread only.
+    void checkLiveness(Client* client, uint64_t now);
+
+    // The shard whose loop is running on the calling thread, if any
+    static Shard* current();
+
+private:
+    IRCServer* server;
+    const ServerConfig& config;
+    int server_fd;
+    TlsContext* tls;
+    int tls_fd;                          // TLS listener, or -1
+    int wake_fd;                         // eventfd signalled when the inbox fills
+    EventLoop loop;
+    std::vector<IOEvent> events;
+    URing* ring;                         // Null when running on EventLoop
+    bool multishot_recv;
+    bool quiescing;                      // Cancelling every request for a pause
+    uint64_t wake_value;                 // Target of the io_uring eventfd read
+    uint64_t next_probe;                 // When the loop-lag probe is due
+    struct __kernel_timespec probe_timeout;
+    std::vector<Client*> throttled;      // Clients with input held back by flood control
+    bool throttle_timer_armed;           // io_uring only
+    unsigned lost_arms;                  // ARM_* requests that found no submission entry
+    size_t cancels_waiting;              // Outstanding cancels while quiescing
+    // Completions nextSqe() took off the ring to make room, handled ahead
+    // of anything reaped after them
+    std::vector<io_uring_cqe> deferred_cqes;
+    std::vector<io_uring_cqe> deferred_batch;
+    struct __kernel_timespec throttle_timeout;
+    TimerWheel timers;                   // One liveness timer per client
+    SharedBuffer welcome_notice;         // Same bytes for every new client
+    SharedBuffer ping_line;
+    std::vector<SendOp*> free_send_ops;
+    std::unordered_map<int, Client*> clients;   // Keyed by socket fd
+    MPSCQueue<Delivery> inbox;
+
+    int setupServerSocket(int port);
+    bool admit(int new_socket, const struct sockaddr_storage& remoteaddr, std::string& ip);
+    Client* addClient(int new_socket, const std::string& ip);
+    void resumeClients();
+    void park();
+    void startTls(Client* client);
+    bool continueHandshake(Client* client);
+    void serviceTls(Client* client);
+    ssize_t readSocket(Client* client, char* dest, size_t size);
+    void processInput(Client* client);
+    void refillTokens(Client* client, uint64_t now);
+    void throttle(Client* client);
+    void serviceThrottled();
+    void expireTimers(uint64_t now);
+    uint64_t nextDeadline() const;
+
+    // EventLoop backend
+    void runEventLoop();
+    void handleNewConnections(int listener);
+    void handleClientEvent(const IOEvent& event);
+    void handleClientMessages(Client* client);
+
+    // io_uring backend
+    void runUring();
+    void armAccept(int listener);
+    void armWake();
+    void armRecv(Client* client);
+    void armPollOut(Client* client);
+    void armProbe();
+    void armThrottleTimer();
+    void rearmLost();
+    io_uring_sqe* nextSqe();
+    unsigned reapCompletions();
+    void handleDeferred();
+    void quiesceUring();
+    void reapCancels();
+    static uint64_t recvUserData(const Client* client);
+    bool submitSend(Client* client);
+    void handleCompletion(const io_uring_cqe* cqe);
+    void handleRecvCompletion(const io_uring_cqe* cqe);
+    void handleSendCompletion(const io_uring_cqe* cqe);
+    void handleAcceptCompletion(const io_uring_cqe* cqe);
+    void handlePollCompletion(const io_uring_cqe* cqe);
+    Client* findClient(int fd, uint32_t id_low);
+
+    void drainInbox();
+    void flushClients();
+    void submitLog();
+    void onProbe(uint64_t now);
+    void removeClient(Client* client);
+};
+
+#endif // SHARD_H
@@ -0,0 +1,96 @@
+#include "SharedBuffer.h"
+#include <cstring>
+#include <new>
+
+#define POOL_CLASSES 3
+
+// The largest class is for receive buffers, which only clients in the
+// middle of sending hold
+static const uint32_t class_capacity[POOL_CLASSES] = {256, 1024, 4096};
+static const size_t class_limit[POOL_CLASSES] = {4096, 4096, 256};    // Per thread
+
+// Free blocks are chained through their payload. A block is returned to
+// the pool of whichever thread drops the last reference.
+struct BlockPool {
+    BufferBlock* head[POOL_CLASSES] = {};
+    size_t count[POOL_CLASSES] = {};
+
+    ~BlockPool() {
+        for (int c = 0; c < POOL_CLASSES; ++c) {
+            while (head[c]) {
+                BufferBlock* next = *reinterpret_cast<BufferBlock**>(head[c]->data());
+                ::operator delete(head[c]);
+                head[c] = next;
+            }
+        }
+    }
+};
+
+static thread_local BlockPool pool;
+
+SharedBuffer SharedBuffer::allocate(size_t capacity) {
+    int size_class = -1;
+    for (int c = 0; c < POOL_CLASSES; ++c) {
+        if (capacity <= class_capacity[c]) {
+            size_class = c;
+            capacity = class_capacity[c];
+            break;
+        }
+    }
+
+    BufferBlock* block;
+    if (size_class >= 0 && pool.head[size_class]) {
+        block = pool.head[size_class];
+        pool.head[size_class] = *reinterpret_cast<BufferBlock**>(block->data());
+        --pool.count[size_class];
+    } else {
+        block = static_cast<BufferBlock*>(::operator new(sizeof(BufferBlock) + capacity));
+    }
+
+    new (&block->refs) std::atomic<uint32_t>(1);
+    block->length = 0;
+    block->capacity = static_cast<uint32_t>(capacity);
+    block->size_class = size_class;
+
+    SharedBuffer buffer;
+    buffer.block = block;
+    return buffer;
+}
+
+void SharedBuffer::reset() {
+    if (!block) return;
+    if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        int c = block->size_class;
+        if (c >= 0 && pool.count[c] < class_limit[c]) {
+            *reinterpret_cast<BufferBlock**>(block->data()) = pool.head[c];
+            pool.head[c] = block;
+            ++pool.count[c];
+        } else {
+            ::operator delete(block);
+        }
+    }
+    block = nullptr;
+}
+
+SharedBuffer makeSharedBuffer(std::string_view data) {
+    SharedBuffer buffer = SharedBuffer::allocate(data.size());
+    memcpy(buffer.mutableData(), data.data(), data.size());
+    buffer.setLength(data.size());
+    return buffer;
+}
+
+SharedBuffer formatLine(std::initializer_list<std::string_view> parts) {
+    size_t total = 0;
+    for (std::string_view part : parts) {
+        total += part.size();
+    }
+
+    SharedBuffer buffer = SharedBuffer::allocate(total);
+    char* out = buffer.mutableData();
+    for (std::string_view part : parts) {
+        memcpy(out, part.data(), part.size());
+        out += part.size();
+    }
+    buffer.setLength(total);
+    return buffer;
+}
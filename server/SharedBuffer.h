@@ -0,0 +1,62 @@
+#ifndef SHAREDBUFFER_H
+#define SHAREDBUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+#include <utility>
+
+// Header of a reference-counted line; the bytes follow it in memory
+struct BufferBlock {
+    std::atomic<uint32_t> refs;
+    uint32_t length;
+    uint32_t capacity;
+    int size_class;                // Pool the block returns to, or -1
+
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
+// An immutable, serialized line shared by every queue it is enqueued on.
+// A broadcast allocates the payload once; each recipient holds a reference.
+// Blocks come from per-thread free lists, so building and releasing lines
+// does not touch the general-purpose heap once the pools are warm.
+class SharedBuffer {
+public:
+    SharedBuffer() : block(nullptr) {}
+    SharedBuffer(const SharedBuffer& other) : block(other.block) {
+        if (block) block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    SharedBuffer(SharedBuffer&& other) noexcept : block(other.block) {
+        other.block = nullptr;
+    }
+    SharedBuffer& operator=(SharedBuffer other) noexcept {
+        std::swap(block, other.block);
+        return *this;
+    }
+    ~SharedBuffer() { reset(); }
+
+    void reset();
+
+    const char* data() const { return block->data(); }
+    size_t length() const { return block->length; }
+    size_t capacity() const { return block->capacity; }
+    explicit operator bool() const { return block != nullptr; }
+
+    // A writable, unshared buffer with room for capacity bytes
+    static SharedBuffer allocate(size_t capacity);
+    char* mutableData() { return block->data(); }
+    void setLength(size_t length) { block->length = static_cast<uint32_t>(length); }
+
+private:
+    BufferBlock* block;
+};
+
+SharedBuffer makeSharedBuffer(std::string_view data);
+
+// Concatenate parts straight into a fresh buffer, e.g.
+// formatLine({":", nick, " PRIVMSG ", target, " :", text, "\r\n"})
+SharedBuffer formatLine(std::initializer_list<std::string_view> parts);
+
+#endif // SHAREDBUFFER_H
@@ -0,0 +1,87 @@
+#include "TimerWheel.h"
+#include <cstring>
+
+#define TIMER_MAX_TICKS ((1ull << (TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1)
+
+TimerWheel::TimerWheel(uint64_t now_ns) : current(now_ns / TIMER_TICK_NS), count(0) {
+    memset(slots, 0, sizeof slots);
+    memset(occupied, 0, sizeof occupied);
+}
+
+void TimerWheel::schedule(TimerNode* t, uint64_t when_ns) {
+    if (t->armed()) {
+        cancel(t);
+    }
+    // Rounded up, so a timer never fires before its time
+    t->expires = (when_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+    insert(t);
+}
+
+void TimerWheel::insert(TimerNode* t) {
+    int level = 0;
+    uint64_t expires = t->expires;
+    if (expires < current) {
+        // Overdue: the next tick processed
+        expires = current;
+    } else if (expires - current > TIMER_MAX_TICKS) {
+        expires = current + TIMER_MAX_TICKS;
+    }
+    // The lowest level whose span reaches the expiry
+    uint64_t delta = expires - current;
+    while (level < TIMER_LEVELS - 1 && delta >= (1ull << ((level + 1) * TIMER_LEVEL_BITS))) {
+        ++level;
+    }
+    int slot = static_cast<int>((expires >> (level * TIMER_LEVEL_BITS)) & (TIMER_SLOTS - 1));
+
+    TimerNode** head = &slots[level][slot];
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    t->level = static_cast<uint8_t>(level);
+    t->slot = static_cast<uint8_t>(slot);
+    occupied[level] |= 1ull << slot;
+    ++count;
+}
+
+void TimerWheel::cancel(TimerNode* t) {
+    if (!t->armed()) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    if (!slots[t->level][t->slot]) {
+        occupied[t->level] &= ~(1ull << t->slot);
+    }
+    t->next = nullptr;
+    t->pprev = nullptr;
+    --count;
+}
+
+// Move the timers of one higher-level slot down to where they now belong
+void TimerWheel::cascade(int level, int index) {
+    TimerNode* t = slots[level][index];
+    slots[level][index] = nullptr;
+    occupied[level] &= ~(1ull << index);
+    while (t) {
+        TimerNode* next = t->next;
+        --count;
+        insert(t);
+        t = next;
+    }
+}
+
+uint64_t TimerWheel::nextDeadline() const {
+    if (count == 0) return UINT64_MAX;
+
+    int index = static_cast<int>(current & (TIMER_SLOTS - 1));
+    // Level 0 slots from the current one on, wrapping around
+    uint64_t ahead = occupied[0] >> index;
+    if (index > 0) ahead |= occupied[0] << (TIMER_SLOTS - index);
+    uint64_t tick;
+    if (ahead) {
+        tick = current + __builtin_ctzll(ahead);
+    } else {
+        // Only later levels: wake for the next cascade and look again
+        tick = (current | (TIMER_SLOTS - 1)) + 1;
+    }
+    return tick * TIMER_TICK_NS;
+}
@@ -0,0 +1,90 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define TIMER_TICK_NS (100 * 1000000ull)   // Wheel resolution
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4                      // 64^4 ticks, about 19 days at 100 ms
+
+// A timer embedded in the object it belongs to, so arming one never
+// allocates. Owned by one wheel at a time.
+struct TimerNode {
+    void* owner = nullptr;              // Whatever the expiry callback needs
+    TimerNode* next = nullptr;
+    TimerNode** pprev = nullptr;        // Null while not armed
+    uint64_t expires = 0;               // Tick
+    uint8_t level = 0;
+    uint8_t slot = 0;
+
+    bool armed() const { return pprev != nullptr; }
+};
+
+// Hierarchical timing wheel, single-threaded like the shard that owns it.
+// Level 0 holds timers due within the next 64 ticks, one slot per tick;
+// each higher level covers 64 times the span of the one below, and its
+// slots are cascaded down as time reaches them. Scheduling and cancelling
+// are O(1); a tick costs one slot plus, every 64 ticks, a cascade of the
+// timers that have come within range, however many are armed in total.
+class TimerWheel {
+public:
+    explicit TimerWheel(uint64_t now_ns);
+
+    // Arm t to fire at when_ns, moving it if it is already armed. Times
+    // in the past fire on the next advance().
+    void schedule(TimerNode* t, uint64_t when_ns);
+    void cancel(TimerNode* t);
+    size_t size() const { return count; }
+
+    // When the next advance() may have work: the earliest occupied level 0
+    // slot, or the next cascade if only later levels hold timers.
+    // UINT64_MAX if nothing is armed.
+    uint64_t nextDeadline() const;
+
+    // Fire every timer due by now_ns, in tick order. A fired timer is
+    // disarmed before expire(t) runs, which may schedule it (or any other)
+    // again.
+    template <typename F>
+    void advance(uint64_t now_ns, F expire);
+
+private:
+    uint64_t current;                   // Next tick to process
+    TimerNode* slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS];    // Bit per non-empty slot
+    size_t count;
+
+    void insert(TimerNode* t);
+    void cascade(int level, int index);
+};
+
+template <typename F>
+void TimerWheel::advance(uint64_t now_ns, F expire) {
+    uint64_t target = now_ns / TIMER_TICK_NS;
+    while (current <= target) {
+        if (count == 0) {
+            // Nothing to cascade or fire; skip the idle stretch
+            current = target + 1;
+            break;
+        }
+        int index = static_cast<int>(current & (TIMER_SLOTS - 1));
+        if (index == 0) {
+            for (int level = 1; level < TIMER_LEVELS; ++level) {
+                int upper = static_cast<int>((current >> (level * TIMER_LEVEL_BITS)) & (TIMER_SLOTS - 1));
+                cascade(level, upper);
+                if (upper != 0) break;
+            }
+        }
+        ++current;
+
+        // Unlink each timer before its callback. One re-armed in the past
+        // lands in the next tick's slot, so this loop always ends.
+        while (TimerNode* t = slots[0][index]) {
+            cancel(t);
+            expire(t);
+        }
+    }
+}
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,92 @@
+#include "TlsContext.h"
+#include <iostream>
+#include <openssl/err.h>
+
+static void printErrors(const std::string& what) {
+    std::cerr << what << ": ";
+    unsigned long err;
+    bool any = false;
+    while ((err = ERR_get_error()) != 0) {
+        char buf[256];
+        ERR_error_string_n(err, buf, sizeof buf);
+        std::cerr << (any ? "; " : "") << buf;
+        any = true;
+    }
+    std::cerr << std::endl;
+}
+
+TlsContext::TlsContext() : ctx(nullptr) {}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(ctx);
+}
+
+bool TlsContext::init(const std::string& cert_file, const std::string& key_file, bool ktls) {
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        printErrors("SSL_CTX_new");
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1) {
+        printErrors("TLS certificate " + cert_file);
+        return false;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        printErrors("TLS key " + key_file);
+        return false;
+    }
+
+    // Writes resume from wherever the send queue stands, which may be a
+    // different address than the attempt that would have blocked. Idle
+    // connections give their record buffers back.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                          | SSL_MODE_RELEASE_BUFFERS);
+
+    static const unsigned char session_context[] = "miniircd";
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof session_context - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+
+    if (ktls) {
+        // Used only if the kernel has the tls module and the cipher suits it;
+        // otherwise OpenSSL quietly keeps doing the encryption itself
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+    return true;
+}
+
+std::string TlsContext::ticketKeys() {
+    char keys[TLS_TICKET_KEYS_SIZE];
+    if (SSL_CTX_get_tlsext_ticket_keys(ctx, keys, sizeof keys) != 1) {
+        return std::string();
+    }
+    return std::string(keys, sizeof keys);
+}
+
+bool TlsContext::setTicketKeys(std::string_view keys) {
+    if (keys.size() != TLS_TICKET_KEYS_SIZE) {
+        return false;
+    }
+    char copy[TLS_TICKET_KEYS_SIZE];
+    keys.copy(copy, sizeof copy);
+    return SSL_CTX_set_tlsext_ticket_keys(ctx, copy, sizeof copy) == 1;
+}
+
+SSL* TlsContext::accept(int fd) {
+    SSL* ssl = SSL_new(ctx);
+    if (!ssl) {
+        printErrors("SSL_new");
+        return nullptr;
+    }
+    if (SSL_set_fd(ssl, fd) != 1) {
+        printErrors("SSL_set_fd");
+        SSL_free(ssl);
+        return nullptr;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
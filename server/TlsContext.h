@@ -0,0 +1,42 @@
+#ifndef TLSCONTEXT_H
+#define TLSCONTEXT_H
+
+#include <string>
+#include <string_view>
+#include <openssl/ssl.h>
+
+#define TLS_SESSION_CACHE_SIZE 20480    // TLS 1.2 sessions kept for resumption
+#define TLS_SESSION_TIMEOUT 3600        // Seconds a session or ticket stays valid
+#define TLS_TICKET_KEYS_SIZE 80         // Key name, HMAC and AES keys, as OpenSSL packs them
+
+// Server-side TLS settings shared by every shard. One SSL_CTX serves all
+// listeners, so a session ticket issued on one shard resumes on any other;
+// OpenSSL locks the session cache internally.
+//
+// Session resumption keeps reconnect storms cheap: TLS 1.3 clients come
+// back with a stateless ticket, TLS 1.2 clients with a cached session id,
+// and neither costs a certificate signature. With kTLS the kernel takes
+// over record encryption once the handshake is done, so queued lines go
+// out with the same writev() (or io_uring send) as plaintext.
+class TlsContext {
+public:
+    TlsContext();
+    ~TlsContext();
+
+    // Load the certificate chain and key; false, with the reason printed,
+    // if they cannot be used
+    bool init(const std::string& cert_file, const std::string& key_file, bool ktls);
+
+    // A server-side session on a connected socket, ready for SSL_do_handshake
+    SSL* accept(int fd);
+
+    // The keys that seal session tickets. A hot restart carries them over,
+    // so clients dropped by the handoff resume with the tickets they hold.
+    std::string ticketKeys();
+    bool setTicketKeys(std::string_view keys);
+
+private:
+    SSL_CTX* ctx;
+};
+
+#endif // TLSCONTEXT_H
@@ -0,0 +1,165 @@
+#include "URing.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+static int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+URing::URing()
+    : ring_fd(-1), sq_entries(0), sq_head(nullptr), sq_tail(nullptr), sq_mask(0), sqes(nullptr),
+      sqe_tail(0), cq_head(nullptr), cq_tail(nullptr), cq_mask(0), cqes(nullptr),
+      sq_ptr(MAP_FAILED), sq_size(0), cq_ptr(MAP_FAILED), cq_size(0), sqes_size(0),
+      buf_ring(nullptr), buf_ring_size(0), buf_count(0), buffer_size(0), buffers(nullptr) {}
+
+URing::~URing() {
+    if (buffers) munmap(buffers, static_cast<size_t>(buf_count) * buffer_size);
+    if (buf_ring) munmap(buf_ring, buf_ring_size);
+    if (sqes) munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    if (ring_fd >= 0) close(ring_fd);
+}
+
+bool URing::init(unsigned entries, unsigned buffer_count, unsigned buf_size) {
+    io_uring_params params;
+    memset(&params, 0, sizeof params);
+    // Multishot receives can post many completions per submission
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 8;
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd < 0 && errno == EINVAL) {
+        // Older kernels reject the single-issuer hints
+        memset(&params, 0, sizeof params);
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 8;
+        ring_fd = io_uring_setup(entries, &params);
+    }
+    if (ring_fd < 0) {
+        perror("io_uring_setup");
+        return false;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        perror("mmap sq ring");
+        return false;
+    }
+    if (single_mmap) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            perror("mmap cq ring");
+            return false;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes_ptr = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED) {
+        perror("mmap sqes");
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe*>(sqes_ptr);
+
+    char* sq = static_cast<char*>(sq_ptr);
+    char* cq = static_cast<char*>(cq_ptr);
+    sq_entries = params.sq_entries;
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqe_tail = *sq_tail;
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // Submission slots map one-to-one onto the sqe array
+    unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; ++i) {
+        array[i] = i;
+    }
+
+    // Provided buffer ring (kernel 5.19+): receives pick a buffer themselves
+    buf_count = buffer_count;
+    buffer_size = buf_size;
+    buf_ring_size = buf_count * sizeof(io_uring_buf);
+    void* ring_mem = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* buf_mem = mmap(NULL, static_cast<size_t>(buf_count) * buffer_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_mem == MAP_FAILED || buf_mem == MAP_FAILED) {
+        perror("mmap buffers");
+        return false;
+    }
+    buf_ring = static_cast<io_uring_buf_ring*>(ring_mem);
+    buffers = static_cast<char*>(buf_mem);
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+    reg.ring_entries = buf_count;
+    reg.bgid = BUFFER_GROUP;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register pbuf ring");
+        return false;
+    }
+
+    buf_ring->tail = 0;
+    for (unsigned i = 0; i < buf_count; ++i) {
+        recycleBuffer(static_cast<uint16_t>(i));
+    }
+    return true;
+}
+
+io_uring_sqe* URing::getSqe() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sqe_tail - head >= sq_entries) {
+        // Queue full: push what we have to the kernel first
+        submitAndWait(0);
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sqe_tail - head >= sq_entries) {
+            return nullptr;
+        }
+    }
+    io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+    ++sqe_tail;
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+int URing::submitAndWait(unsigned wait_nr) {
+    // Entries the kernel skipped last time are still between head and tail
+    unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return io_uring_enter(ring_fd, to_submit, wait_nr, flags);
+}
+
+void URing::recycleBuffer(uint16_t bid) {
+    // Index the entries by hand: in C++ the header's flexible-array member
+    // lands at offset 8 instead of 0, past the tail overlay
+    unsigned short tail = buf_ring->tail;
+    io_uring_buf* buf = reinterpret_cast<io_uring_buf*>(buf_ring) + (tail & (buf_count - 1));
+    buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+    buf->len = buffer_size;
+    buf->bid = bid;
+    __atomic_store_n(&buf_ring->tail, static_cast<unsigned short>(tail + 1), __ATOMIC_RELEASE);
+}
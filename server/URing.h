@@ -0,0 +1,76 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <cstdint>
+#include <cstddef>
+
+// Minimal io_uring wrapper over the raw syscalls: one submission and one
+// completion ring plus a ring of provided receive buffers. Owned and used
+// by a single thread.
+class URing {
+public:
+    URing();
+    ~URing();
+
+    // Set the ring up; false if the kernel lacks io_uring or provided
+    // buffer rings, in which case the caller should fall back to epoll.
+    bool init(unsigned entries, unsigned buffer_count, unsigned buffer_size);
+
+    // Next free submission entry, zeroed. Submits pending entries first if
+    // the queue is full; null if the kernel would not take them, as when
+    // completions have overflowed (EBUSY) until some are reaped.
+    io_uring_sqe* getSqe();
+
+    // Submit everything prepared since the last call in one io_uring_enter
+    // and wait for at least wait_nr completions.
+    int submitAndWait(unsigned wait_nr);
+
+    // Hand every available completion to fn. Each is copied and released
+    // before fn sees it, so fn may itself reap (see Shard::nextSqe).
+    template <typename F>
+    unsigned forEachCompletion(F&& fn) {
+        unsigned count = 0;
+        while (true) {
+            unsigned head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) break;
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            fn(&cqe);
+            ++count;
+        }
+        return count;
+    }
+
+    // Provided buffers for IOSQE_BUFFER_SELECT receives
+    static const uint16_t BUFFER_GROUP = 0;
+    char* buffer(uint16_t bid) { return buffers + static_cast<size_t>(bid) * buffer_size; }
+    void recycleBuffer(uint16_t bid);
+
+private:
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    io_uring_sqe* sqes;
+    unsigned sqe_tail;             // Prepared but not yet published
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    unsigned buf_count;
+    unsigned buffer_size;
+    char* buffers;
+};
+
+#endif // URING_H
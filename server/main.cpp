@@ -1,8 +1,215 @@
 #include "IRCServer.h"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <getopt.h>
 
-int main() {
-    IRCServer server;
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [--port PORT] [--sendq BYTES] [--threads N] [--io-uring]\n"
+              << "       [--flood-rate TOKENS_PER_SEC] [--flood-burst TOKENS] [--max-per-ip N]\n"
+              << "       [--history-budget BYTES] [--log-dir DIR] [--log-fsync MS]\n"
+              << "       [--oper NAME:PASSWORD] [--metrics-socket PATH]\n"
+              << "       [--name SERVERNAME] [--link HOST:PORT]... [--link-password PASSWORD]\n"
+              << "       [--upgrade-socket PATH] [--motd FILE]\n"
+              << "       [--ping-interval SECS] [--pong-timeout SECS] [--registration-timeout SECS]\n"
+              << "       [--idle-timeout SECS] [--link-ping-interval SECS] [--max-targets N]\n"
+              << "       [--fanout-workers N] [--fanout-threshold MEMBERS]\n"
+              << "       [--tls-cert FILE --tls-key FILE] [--tls-port PORT] [--no-ktls]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    ServerConfig config;
+
+    static const struct option options[] = {
+        {"port",  required_argument, NULL, 'p'},
+        {"sendq", required_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 't'},
+        {"io-uring", no_argument,     NULL, 'u'},
+        {"flood-rate", required_argument, NULL, 'f'},
+        {"flood-burst", required_argument, NULL, 'b'},
+        {"max-per-ip", required_argument, NULL, 'i'},
+        {"history-budget", required_argument, NULL, 'H'},
+        {"log-dir", required_argument, NULL, 'l'},
+        {"log-fsync", required_argument, NULL, 'F'},
+        {"oper",  required_argument, NULL, 'o'},
+        {"metrics-socket", required_argument, NULL, 'm'},
+        {"name",  required_argument, NULL, 'n'},
+        {"link",  required_argument, NULL, 'L'},
+        {"link-password", required_argument, NULL, 'P'},
+        {"upgrade-socket", required_argument, NULL, 'U'},
+        {"tls-cert", required_argument, NULL, 'c'},
+        {"tls-key", required_argument, NULL, 'k'},
+        {"tls-port", required_argument, NULL, 'T'},
+        {"no-ktls", no_argument,      NULL, 'K'},
+        {"motd",  required_argument, NULL, 'M'},
+        {"ping-interval", required_argument, NULL, 'I'},
+        {"pong-timeout", required_argument, NULL, 'G'},
+        {"registration-timeout", required_argument, NULL, 'R'},
+        {"idle-timeout", required_argument, NULL, 'D'},
+        {"link-ping-interval", required_argument, NULL, 'J'},
+        {"max-targets", required_argument, NULL, 'X'},
+        {"fanout-workers", required_argument, NULL, 'W'},
+        {"fanout-threshold", required_argument, NULL, 'Y'},
+        {"help",  no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:s:t:uf:b:i:H:l:F:o:m:n:L:P:U:c:k:T:KM:I:G:R:D:J:X:W:Y:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 's':
+            config.sendq_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            if (config.threads < 1) {
+                std::cerr << "--threads must be at least 1" << std::endl;
+                return 1;
+            }
+            break;
+        case 'u':
+            config.io_uring = true;
+            break;
+        case 'f':
+            config.flood_rate = atof(optarg);
+            break;
+        case 'b':
+            config.flood_burst = atof(optarg);
+            if (config.flood_burst < 1) {
+                std::cerr << "--flood-burst must be at least 1" << std::endl;
+                return 1;
+            }
+            break;
+        case 'i':
+            config.max_per_ip = atoi(optarg);
+            break;
+        case 'H':
+            config.history_budget = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            config.log_dir = optarg;
+            break;
+        case 'F':
+            config.log_fsync_ms = atoi(optarg);
+            if (config.log_fsync_ms < 0) {
+                std::cerr << "--log-fsync must not be negative" << std::endl;
+                return 1;
+            }
+            break;
+        case 'o': {
+            const char* colon = strchr(optarg, ':');
+            if (!colon || colon == optarg || !colon[1]) {
+                std::cerr << "--oper takes NAME:PASSWORD" << std::endl;
+                return 1;
+            }
+            config.oper_name.assign(optarg, colon - optarg);
+            config.oper_password = colon + 1;
+            break;
+        }
+        case 'm':
+            config.metrics_socket = optarg;
+            break;
+        case 'n':
+            if (!*optarg || strpbrk(optarg, " :,") || strlen(optarg) > SERVER_NAME_MAX) {
+                std::cerr << "--name must be a single word of at most " << SERVER_NAME_MAX << " characters" << std::endl;
+                return 1;
+            }
+            config.server_name = optarg;
+            break;
+        case 'L': {
+            // The port follows the last colon, so ::1:6668 works
+            const char* colon = strrchr(optarg, ':');
+            if (!colon || colon == optarg || atoi(colon + 1) <= 0) {
+                std::cerr << "--link takes HOST:PORT" << std::endl;
+                return 1;
+            }
+            config.links.push_back(optarg);
+            break;
+        }
+        case 'P':
+            config.link_password = optarg;
+            break;
+        case 'U':
+            config.upgrade_socket = optarg;
+            break;
+        case 'c':
+            config.tls_cert = optarg;
+            break;
+        case 'k':
+            config.tls_key = optarg;
+            break;
+        case 'T':
+            config.tls_port = atoi(optarg);
+            break;
+        case 'K':
+            config.ktls = false;
+            break;
+        case 'M':
+            config.motd_file = optarg;
+            break;
+        case 'I':
+            config.ping_interval = atoi(optarg);
+            break;
+        case 'G':
+            config.pong_timeout = atoi(optarg);
+            if (config.pong_timeout < 1) {
+                std::cerr << "--pong-timeout must be at least 1" << std::endl;
+                return 1;
+            }
+            break;
+        case 'R':
+            config.registration_timeout = atoi(optarg);
+            break;
+        case 'D':
+            config.idle_timeout = atoi(optarg);
+            break;
+        case 'J':
+            config.link_ping_interval = atoi(optarg);
+            break;
+        case 'X':
+            config.max_targets = atoi(optarg);
+            if (config.max_targets < 1) {
+                std::cerr << "--max-targets must be at least 1" << std::endl;
+                return 1;
+            }
+            break;
+        case 'W':
+            config.fanout_workers = atoi(optarg);
+            if (config.fanout_workers < 0) {
+                std::cerr << "--fanout-workers must not be negative" << std::endl;
+                return 1;
+            }
+            break;
+        case 'Y':
+            config.fanout_threshold = strtoul(optarg, NULL, 10);
+            if (config.fanout_threshold < 1) {
+                std::cerr << "--fanout-threshold must be at least 1" << std::endl;
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (config.tls_cert.empty() != config.tls_key.empty()) {
+        std::cerr << "--tls-cert and --tls-key go together" << std::endl;
+        return 1;
+    }
+    if (!config.links.empty() && config.link_password.empty()) {
+        std::cerr << "--link needs --link-password" << std::endl;
+        return 1;
+    }
+
+    // Peers that vanish mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    IRCServer server(config);
     server.start();
     return 0;
 }
-